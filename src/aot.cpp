@@ -0,0 +1,31 @@
+//
+// Loads ROMs translated by chip8_aot
+//
+
+#include <dlfcn.h>
+#include <iostream>
+#include "aot.h"
+
+const AotProgram *load_aot_program(std::string path)
+{
+    //the library stays loaded for the rest of the run, the emulator keeps pointers into it
+    void *library = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+    if (library == nullptr)
+    {
+        std::cerr << dlerror() << std::endl;
+        return nullptr;
+    }
+    const AotProgram *program = (const AotProgram *) dlsym(library, CHIP8_AOT_SYMBOL);
+    if (program == nullptr)
+    {
+        std::cerr << path << " is not a translated ROM" << std::endl;
+        dlclose(library);
+    }
+    else if (program->state_size != (int) sizeof(Chip8State))
+    {
+        std::cerr << path << " was built for another version of the emulator, translate the ROM again" << std::endl;
+        dlclose(library);
+        return nullptr;
+    }
+    return program;
+}
@@ -0,0 +1,44 @@
+//
+// Interface between the emulator and ROMs translated ahead of time to C++ by chip8_aot
+//
+
+#ifndef CHIP8_AOT_H
+#define CHIP8_AOT_H
+
+
+#include <cstdint>
+#include <string>
+#include "chip8_state.h"
+
+//exported by every translated ROM under this name
+#define CHIP8_AOT_SYMBOL "chip8_aot_program"
+
+struct AotProgram
+{
+    int state_size; //sizeof(Chip8State) when it was built, first so libraries from before it was added are refused
+    uint32_t rom_hash; //aot_rom_hash of the ROM the blocks were translated from
+    int rom_size;
+    bool xo_chip; //translated for XO-CHIP mode
+    int block_count;
+    const uint16_t *block_start; //first byte of the code each block was translated from
+    const uint16_t *block_end; //address after the last instruction of each block
+    //runs translated blocks from pc until it reaches an address without an enabled block, a block longer than the
+    //remaining budget or an idle loop. Returns the number of instructions executed
+    int (*run)(Chip8State *, int, const uint8_t *);
+};
+
+//FNV-1a, ties a translation to the exact bytes it was made from
+inline uint32_t aot_rom_hash(const uint8_t *data, int size)
+{
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < size; i++)
+    {
+        hash = (hash ^ data[i]) * 16777619u;
+    }
+    return hash;
+}
+
+const AotProgram *load_aot_program(std::string); //opens a translated ROM built as a shared library, null on error
+
+
+#endif //CHIP8_AOT_H
@@ -0,0 +1,176 @@
+//
+// Beeper for the sound timer
+//
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <SDL.h>
+#include "audio.h"
+
+static const float TONE_HZ = 440.0f;
+static const float VOLUME = 0.25f;
+static const float RAMP_SECONDS = 0.002f; //fade in and out over this long instead of stepping the wave
+static const int MAX_AHEAD_BUFFERS = 16; //an edge further ahead of the device than this means the clocks drifted
+static const int PACE_BUFFERS = 2; //how far wait_for_device lets emulation run ahead of the device
+static const int STALL_MS = 100; //a device that finishes no buffer in this long has stopped, pacing gives up on it
+
+//the step of an ideal square wave minus a straight one, smoothed over the sample before and after each jump so
+//the harmonics above the Nyquist frequency mostly go away
+static float poly_blep(float t, float dt)
+{
+    if (t < dt)
+    {
+        t /= dt;
+        return t + t - t * t - 1.0f;
+    }
+    if (t > 1.0f - dt)
+    {
+        t = (t - 1.0f) / dt;
+        return t * t + t + t + 1.0f;
+    }
+    return 0.0f;
+}
+
+Audio::Audio() : device(0), sample_rate(48000), buffer_samples(512), queued_on(false), pace_offset(0), paced(false),
+                 device_played(0), buffer_done(nullptr), played(0), offset(0), synced(false), on(false), phase(0.0f),
+                 gain(0.0f)
+{}
+
+bool Audio::open()
+{
+    SDL_AudioSpec want, have;
+    memset(&want, 0, sizeof(want));
+    want.freq = 48000;
+    want.format = AUDIO_F32SYS;
+    want.channels = 1;
+    want.samples = 512;
+    want.callback = callback;
+    want.userdata = this;
+    device = SDL_OpenAudioDevice(nullptr, 0, &want, &have, SDL_AUDIO_ALLOW_FREQUENCY_CHANGE);
+    if (device == 0)
+    {
+        return false;
+    }
+    sample_rate = have.freq;
+    buffer_samples = have.samples;
+    buffer_done = SDL_CreateSemaphore(0);
+    SDL_PauseAudioDevice(device, 0);
+    return true;
+}
+
+bool Audio::is_open()
+{
+    return device != 0;
+}
+
+void Audio::set_tone(bool tone_on, double frames)
+{
+    if (device == 0 || tone_on == queued_on)
+    {
+        return;
+    }
+    //a full queue drops the edge and tries again on the next call, the tone is only a little late
+    if (edges.push(Edge{(uint64_t) (frames * sample_rate / 60.0), tone_on}))
+    {
+        queued_on = tone_on;
+    }
+}
+
+void Audio::wait_for_device(double frames)
+{
+    if (device == 0)
+    {
+        return;
+    }
+    int64_t emulated = (int64_t) (frames * sample_rate / 60.0);
+    for (;;)
+    {
+        int64_t ahead = emulated + pace_offset - (int64_t) device_played.load(std::memory_order_acquire);
+        //after a stall, or when emulation fell behind, start over from here rather than rushing to catch up
+        if (!paced || ahead < -buffer_samples)
+        {
+            pace_offset = (int64_t) device_played.load(std::memory_order_acquire) - emulated;
+            paced = true;
+            return;
+        }
+        if (ahead <= PACE_BUFFERS * buffer_samples)
+        {
+            return;
+        }
+        if (buffer_done == nullptr || SDL_SemWaitTimeout(buffer_done, STALL_MS) != 0)
+        {
+            paced = false;
+            return;
+        }
+    }
+}
+
+void Audio::callback(void *userdata, Uint8 *stream, int length)
+{
+    static_cast<Audio *>(userdata)->fill(reinterpret_cast<float *>(stream), length / (int) sizeof(float));
+}
+
+void Audio::fill(float *out, int count)
+{
+    const float dt = TONE_HZ / sample_rate;
+    const float ramp = VOLUME / (RAMP_SECONDS * sample_rate);
+    for (int i = 0; i < count; i++)
+    {
+        uint64_t now = played + i;
+        for (Edge *edge = edges.peek(); edge != nullptr; edge = edges.peek())
+        {
+            //the first edge, or one far off from where the device is, places emulated time one buffer ahead of now
+            int64_t at = (int64_t) edge->sample + offset;
+            if (!synced || at < (int64_t) now - buffer_samples ||
+                at > (int64_t) now + MAX_AHEAD_BUFFERS * buffer_samples)
+            {
+                offset = (int64_t) now + buffer_samples - (int64_t) edge->sample;
+                at = (int64_t) now + buffer_samples;
+                synced = true;
+            }
+            if (at > (int64_t) now)
+            {
+                break;
+            }
+            on = edge->on;
+            Edge done;
+            edges.pop(done);
+        }
+
+        gain = on ? std::min(VOLUME, gain + ramp) : std::max(0.0f, gain - ramp);
+        if (gain == 0.0f)
+        {
+            phase = 0.0f; //every beep starts the same way
+            out[i] = 0.0f;
+            continue;
+        }
+        float value = phase < 0.5f ? 1.0f : -1.0f;
+        value += poly_blep(phase, dt);
+        value -= poly_blep(std::fmod(phase + 0.5f, 1.0f), dt);
+        out[i] = gain * value;
+        phase += dt;
+        if (phase >= 1.0f)
+        {
+            phase -= 1.0f;
+        }
+    }
+    played += count;
+    device_played.store(played, std::memory_order_release);
+    if (buffer_done != nullptr)
+    {
+        SDL_SemPost(buffer_done);
+    }
+}
+
+Audio::~Audio()
+{
+    if (device != 0)
+    {
+        SDL_CloseAudioDevice(device);
+    }
+    if (buffer_done != nullptr)
+    {
+        SDL_DestroySemaphore(buffer_done);
+    }
+}
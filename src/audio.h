@@ -0,0 +1,67 @@
+//
+// Beeper for the sound timer, a band limited square wave synthesized in the SDL audio callback. The emulation thread
+// only queues on and off edges stamped with the point in emulated time they happen at, so neither thread ever waits
+// for the other
+//
+
+#ifndef CHIP8_AUDIO_H
+#define CHIP8_AUDIO_H
+
+
+#include <atomic>
+#include <cstdint>
+#include <SDL_audio.h>
+#include <SDL_mutex.h>
+#include "spsc_queue.h"
+
+class Audio
+{
+private:
+    //the tone turning on or off at a sample of the emulated stream, which runs at sample_rate per emulated second
+    struct Edge
+    {
+        uint64_t sample;
+        bool on;
+    };
+
+    SDL_AudioDeviceID device; //0 while closed
+    int sample_rate;
+    int buffer_samples; //size of one callback, also the latency edges are played at
+    SpscQueue<Edge, 256> edges; //emulation thread to audio callback
+
+    //emulation thread
+    bool queued_on; //state of the last edge queued
+    int64_t pace_offset; //device sample minus emulated sample for wait_for_device
+    bool paced; //false until wait_for_device sets pace_offset, and again after a stall
+
+    std::atomic<uint64_t> device_played; //played, published at the end of each callback
+    SDL_sem *buffer_done; //posted at the end of each callback
+
+    //audio callback
+    uint64_t played; //samples written to the device so far
+    int64_t offset; //device sample minus emulated sample, moved whenever the two clocks drift too far apart
+    bool synced; //false until the first edge sets offset
+    bool on;
+    float phase, gain; //phase of the square wave in cycles, gain ramps to avoid clicks on the edges
+
+    static void callback(void *, Uint8 *, int);
+    void fill(float *, int);
+
+public:
+    Audio();
+
+    bool open(); //false if there is no audio device, the emulator then runs silent
+
+    bool is_open();
+
+    void set_tone(bool, double); //queues an edge if the tone changed at the given number of emulated 60Hz frames
+
+    //blocks until the device has played up to a couple of buffers short of the given number of emulated frames,
+    //so emulation runs exactly as fast as the device consumes samples
+    void wait_for_device(double);
+
+    ~Audio();
+};
+
+
+#endif //CHIP8_AUDIO_H
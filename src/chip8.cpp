@@ -2,34 +2,39 @@
 // Created by sarbajit on 5/5/17.
 //
 
+#include <algorithm>
+#include <cstdio>
 #include <cstring>
 #include <fstream>
-#include <iostream>
+#include "aot.h"
 #include "chip8.h"
+#include "jit.h"
+#include "memory_policy.h"
+#include "opcodes.h"
+
+const uint8_t chip8_fontset[80] =
+        {
+                0xF0, 0x90, 0x90, 0x90, 0xF0, // 0
+                0x20, 0x60, 0x20, 0x20, 0x70, // 1
+                0xF0, 0x10, 0xF0, 0x80, 0xF0, // 2
+                0xF0, 0x10, 0xF0, 0x10, 0xF0, // 3
+                0x90, 0x90, 0xF0, 0x10, 0x10, // 4
+                0xF0, 0x80, 0xF0, 0x10, 0xF0, // 5
+                0xF0, 0x80, 0xF0, 0x90, 0xF0, // 6
+                0xF0, 0x10, 0x20, 0x40, 0x40, // 7
+                0xF0, 0x90, 0xF0, 0x90, 0xF0, // 8
+                0xF0, 0x90, 0xF0, 0x10, 0xF0, // 9
+                0xF0, 0x90, 0xF0, 0x90, 0x90, // A
+                0xE0, 0x90, 0xE0, 0x90, 0xE0, // B
+                0xF0, 0x80, 0x80, 0x80, 0xF0, // C
+                0xE0, 0x90, 0x90, 0x90, 0xE0, // D
+                0xF0, 0x80, 0xF0, 0x80, 0xF0, // E
+                0xF0, 0x80, 0xF0, 0x80, 0x80  // F
+        };
 
 //constructor
 Chip8::Chip8()
 {
-    unsigned char chip8_fontset[80] =
-            {
-                    0xF0, 0x90, 0x90, 0x90, 0xF0, // 0
-                    0x20, 0x60, 0x20, 0x20, 0x70, // 1
-                    0xF0, 0x10, 0xF0, 0x80, 0xF0, // 2
-                    0xF0, 0x10, 0xF0, 0x10, 0xF0, // 3
-                    0x90, 0x90, 0xF0, 0x10, 0x10, // 4
-                    0xF0, 0x80, 0xF0, 0x10, 0xF0, // 5
-                    0xF0, 0x80, 0xF0, 0x90, 0xF0, // 6
-                    0xF0, 0x10, 0x20, 0x40, 0x40, // 7
-                    0xF0, 0x90, 0xF0, 0x90, 0xF0, // 8
-                    0xF0, 0x90, 0xF0, 0x10, 0xF0, // 9
-                    0xF0, 0x90, 0xF0, 0x90, 0x90, // A
-                    0xE0, 0x90, 0xE0, 0x90, 0xE0, // B
-                    0xF0, 0x80, 0x80, 0x80, 0xF0, // C
-                    0xE0, 0x90, 0x90, 0x90, 0xE0, // D
-                    0xF0, 0x80, 0xF0, 0x80, 0xF0, // E
-                    0xF0, 0x80, 0xF0, 0x80, 0x80  // F
-            };
-
     pc = 0x200; // 0x000 to 0x1FF is reserved for  interpreter
 
     //resetting registers
@@ -44,6 +49,14 @@ Chip8::Chip8()
     memset(memory, 0, sizeof(memory));
 
     draw_flag = false;
+    xo_chip = false;
+    memory_mask = 0x0FFF;
+    idle_state = IDLE_NONE;
+    fault = Chip8Fault{FAULT_NONE, 0, 0};
+    fault_policy = FAULT_HALT;
+    aot = nullptr;
+    cycle_count = 0;
+    next_input_cycle = UINT64_MAX;
 
     //load fontset from 0 to 80
     for (int i = 0; i < 80; i++)
@@ -53,7 +66,13 @@ Chip8::Chip8()
 
     //resetting display and keypad
     memset(display, 0, sizeof(display));
-    memset(keypad, 0, sizeof(keypad));
+    keypad = 0;
+    plane_mask = 1;
+    hires = false;
+
+    //silent pattern at the default XO-CHIP pitch of 4000Hz
+    memset(audio_pattern, 0, sizeof(audio_pattern));
+    audio_pitch = 64;
 }
 
 //function to load ROM, with path to ROM given as argument
@@ -67,9 +86,10 @@ bool Chip8::load_rom(std::string rom_path)
     //load in memory from 0x200(512) onwards
     char c;
     int j = 512;
+    int memory_size = xo_chip ? 65536 : 4096;
     for (int i = 0x200; f.get(c); i++)
     {
-        if (j >= 4096)
+        if (j >= memory_size)
         {
             return false; //file size too big memory space over so exit
         }
@@ -90,23 +110,355 @@ void Chip8::set_draw_flag(bool flag)
     draw_flag = flag;
 }
 
+void Chip8::set_xo_chip(bool flag)
+{
+    xo_chip = flag;
+    memory_mask = flag ? 0xFFFF : 0x0FFF;
+}
+
+bool Chip8::is_xo_chip()
+{
+    return xo_chip;
+}
+
+int Chip8::get_display_width()
+{
+    return hires ? 128 : 64;
+}
+
+int Chip8::get_display_height()
+{
+    return hires ? 64 : 32;
+}
+
 int Chip8::get_display_value(int i)
 {
-    return display[i];
+    int width = get_display_width();
+    int x = i % width, y = i / width;
+    int word = x >> 6, bit = 63 - (x & 63);
+    return (int) (((display[0][y][word] >> bit) & 1) | (((display[1][y][word] >> bit) & 1) << 1));
+}
+
+const uint8_t *Chip8::get_memory()
+{
+    return memory;
+}
+
+const uint64_t *Chip8::get_display_row(int plane, int row)
+{
+    return display[plane][row];
+}
+
+uint64_t Chip8::get_display_hash()
+{
+    //multiply and fold over the packed words, the resolution is mixed in so a mode switch to a blank screen counts
+    uint64_t hash = hires ? 0x9E3779B97F4A7C15ull : 0;
+    const uint64_t *words = &display[0][0][0];
+    for (size_t i = 0; i < sizeof(display) / sizeof(uint64_t); i++)
+    {
+        hash = (hash ^ words[i]) * 0xFF51AFD7ED558CCDull;
+        hash ^= hash >> 32;
+    }
+    return hash;
+}
+
+const Chip8State &Chip8::get_state()
+{
+    return *this;
+}
+
+void Chip8::set_state(const Chip8State &state)
+{
+    //translated blocks only go stale where the memory differs, so restoring a snapshot of the same program every
+    //frame keeps them. A different memory size translates differently and drops them all
+    if (state.memory_mask != memory_mask || state.xo_chip != xo_chip)
+    {
+        *static_cast<Chip8State *>(this) = state;
+        invalidate_code(0, 65536);
+        return;
+    }
+    for (int chunk = 0; chunk <= memory_mask && (jit != nullptr || !aot_code.empty()); chunk += 64)
+    {
+        if (memcmp(memory + chunk, state.memory + chunk, 64) != 0)
+        {
+            invalidate_code((uint16_t) chunk, 64);
+        }
+    }
+    *static_cast<Chip8State *>(this) = state;
+}
+
+const uint8_t *Chip8::get_audio_pattern()
+{
+    return audio_pattern;
+}
+
+uint8_t Chip8::get_audio_pitch()
+{
+    return audio_pitch;
 }
 
 void Chip8::set_keypad_value(int index, int val)
 {
-    keypad[index] = val;
+    keypad = (uint16_t) (val != 0 ? keypad | 1u << index : keypad & ~(1u << index));
+}
+
+void Chip8::set_keypad(uint16_t keys)
+{
+    keypad = keys;
+}
+
+uint16_t Chip8::get_keypad()
+{
+    return keypad;
+}
+
+void Chip8::queue_keypad(uint64_t cycle, uint16_t keys)
+{
+    if (!input.empty() && cycle < input.back().cycle)
+    {
+        cycle = input.back().cycle;
+    }
+    input.push_back(KeypadChange{cycle, keys});
+    next_input_cycle = input.front().cycle;
+}
+
+uint64_t Chip8::get_cycle_count()
+{
+    return cycle_count;
+}
+
+void Chip8::apply_input()
+{
+    while (!input.empty() && input.front().cycle <= cycle_count)
+    {
+        keypad = input.front().keys;
+        input.pop_front();
+    }
+    next_input_cycle = input.empty() ? UINT64_MAX : input.front().cycle;
+}
+
+IdleState Chip8::get_idle_state()
+{
+    return idle_state;
+}
+
+//true if the program is idle and the timers have run out, so only a key press can change anything
+bool Chip8::needs_input()
+{
+    return (idle_state == IDLE_KEY || idle_state == IDLE_HALT || idle_state == IDLE_FAULT) && delay_timer == 0 &&
+           sound_timer == 0;
+}
+
+void Chip8::set_fault_policy(FaultPolicy policy, FaultHandler handler)
+{
+    fault_policy = policy == FAULT_CALLBACK && !handler ? FAULT_HALT : policy;
+    fault_handler = handler;
+}
+
+const Chip8Fault &Chip8::get_fault()
+{
+    return fault;
+}
+
+void Chip8::clear_fault()
+{
+    fault = Chip8Fault{FAULT_NONE, 0, 0};
+    if (idle_state == IDLE_FAULT)
+    {
+        idle_state = IDLE_NONE;
+    }
+}
+
+//runs the given number of instruction slots. A program that goes idle sits out the rest of them, except that queued
+//input falling inside them is still made at its cycle and lets the program run again
+int Chip8::run_cycles(int cycles, bool trace_mode)
+{
+    int i = 0;
+    uint64_t end = cycle_count + cycles;
+    if (idle_state != IDLE_FAULT)
+    {
+        idle_state = IDLE_NONE;
+    }
+    while (true)
+    {
+        if (cycle_count >= next_input_cycle)
+        {
+            apply_input();
+        }
+        if (cycle_count >= end)
+        {
+            break;
+        }
+        if (idle_state != IDLE_NONE)
+        {
+            if (next_input_cycle >= end)
+            {
+                cycle_count = end;
+                break;
+            }
+            cycle_count = next_input_cycle;
+            if (idle_state != IDLE_FAULT)
+            {
+                idle_state = IDLE_NONE;
+            }
+            continue;
+        }
+
+        if (aot == nullptr && jit == nullptr)
+        {
+            single_cycle(trace_mode);
+            i++;
+            continue;
+        }
+
+        //translated blocks stop at anything they can't run, which the interpreter does instead. They also stop short
+        //of the next input so it lands between the right two instructions. Tracing prints every instruction, so
+        //then they all go to the interpreter
+        if (!trace_mode)
+        {
+            int limit = (int) (std::min(end, next_input_cycle) - cycle_count);
+            int ran = aot != nullptr ? aot->run(this, limit, aot_enabled.data()) : jit->run(this, limit);
+            i += ran;
+            cycle_count += ran;
+            if (ran == limit || idle_state != IDLE_NONE)
+            {
+                continue;
+            }
+        }
+        //the interpreted instruction may write over translated code
+        int opcode = (memory_at(pc) << 8) | memory_at(pc + 1);
+        int write_length = memory_write_length(opcode);
+        uint16_t address = I;
+        single_cycle(trace_mode);
+        i++;
+
+        invalidate_code(address, write_length);
+    }
+    return i;
+}
+
+bool Chip8::set_aot_program(const AotProgram *program)
+{
+    if (program != nullptr && (program->xo_chip != xo_chip ||
+                               aot_rom_hash(memory + 0x200, program->rom_size) != program->rom_hash))
+    {
+        return false;
+    }
+    aot = program;
+    aot_enabled.assign(program != nullptr ? program->block_count : 0, 1);
+    aot_code.assign(program != nullptr ? 65536 : 0, 0);
+    for (int b = 0; b < (int) aot_enabled.size(); b++)
+    {
+        for (int address = program->block_start[b]; address < program->block_end[b]; address++)
+        {
+            aot_code[address] = 1;
+        }
+    }
+    return true;
+}
+
+bool Chip8::set_jit(bool on)
+{
+    if (on && !Jit::is_supported())
+    {
+        return false;
+    }
+    jit.reset(on ? new Jit(xo_chip) : nullptr);
+    return true;
+}
+
+//self modifying code, blocks translated from the old bytes can't be used again. The range wraps like the writes do
+void Chip8::invalidate_code(uint16_t address, int length)
+{
+    for (int i = 0; i < length && (jit != nullptr || !aot_code.empty()); i++)
+    {
+        uint16_t written = (uint16_t) ((address + i) & memory_mask);
+        if (jit != nullptr)
+        {
+            jit->invalidate(written, 1);
+        }
+        if (aot_code.empty() || !aot_code[written])
+        {
+            continue;
+        }
+        for (int b = 0; b < aot->block_count; b++)
+        {
+            if (written >= aot->block_start[b] && written < aot->block_end[b])
+            {
+                aot_enabled[b] = 0;
+            }
+        }
+        aot_code[written] = 0;
+    }
+}
+
+//decrements the timers, should be called 60 times per second
+void Chip8::update_timers()
+{
+    if (delay_timer > 0)
+    {
+        delay_timer--;
+    }
+    if (sound_timer > 0)
+    {
+        sound_timer--;
+    }
+}
+
+bool Chip8::is_sound_on()
+{
+    return sound_timer > 0;
 }
 
-//emulates one cycle
-void Chip8::single_cycle(bool trace_mode, bool sound_on)
+//advances the timers while the program is idle, without running any instructions. Stops at max_frames, when the
+//program would wake up or when both timers have run out. Returns the number of frames skipped
+int Chip8::fast_forward(int max_frames)
 {
+    int wake = -1; //frames until the program wakes up on its own, -1 if only input can wake it
+    if (idle_state == IDLE_NONE)
+    {
+        return 0;
+    }
+    if (idle_state == IDLE_TIMER)
+    {
+        //pc is at the FX07 of the polling loop, the skip after it decides when the loop exits
+        int skip = (memory[(pc + 2) & memory_mask] << 8) | memory[(pc + 3) & memory_mask];
+        int nn = skip & 0x00FF;
+        if ((skip & 0xF000) == 0x3000 && delay_timer > nn)
+        {
+            wake = delay_timer - nn;
+        }
+        else if ((skip & 0xF000) == 0x4000 && delay_timer == nn && nn > 0)
+        {
+            wake = 1;
+        }
+    }
+
+    int frames = 0;
+    while (frames < max_frames && frames != wake && (delay_timer > 0 || sound_timer > 0))
+    {
+        update_timers();
+        frames++;
+    }
+    return frames;
+}
+
+//emulates one cycle, does nothing while halted on a fault
+void Chip8::single_cycle(bool trace_mode)
+{
+    if (cycle_count >= next_input_cycle)
+    {
+        apply_input();
+    }
+    if (idle_state == IDLE_FAULT)
+    {
+        return;
+    }
+    cycle_count++;
     //2 byte opcode
-    int opcode = (memory[pc] << 8) | (memory[pc + 1]);
-    int opcode_msb_nibble = get_nibble(opcode, 12, 0xF000); //if value is ABCD(each 4 bits), it returns A
+    int opcode = (memory_at(pc) << 8) | memory_at(pc + 1);
     int val, reg, reg1, reg2;
+    idle_state = IDLE_NONE;
 
     if (trace_mode)
     {
@@ -118,230 +470,285 @@ void Chip8::single_cycle(bool trace_mode, bool sound_on)
         printf("\n");
     }
 
-    switch (opcode_msb_nibble)
+    //the decode table in opcodes.cpp is shared with the debugger and the disassembler
+    switch (decode(opcode))
     {
-        case 0:
-            //only found 00E0 and 00EE starting with 0 so check for these two
-            switch (opcode)
+        case OP_CLS:
+            //00E0. Clears only the selected planes
+            for (int p = 0; p < 2; p++)
             {
-                case 0x00E0:
-                    memset(display, 0, sizeof(display));
-                    draw_flag = true;
-                    pc += 2;
-                    break;
+                if (plane_mask & (1 << p))
+                {
+                    memset(display[p], 0, sizeof(display[p]));
+                }
+            }
+            draw_flag = true;
+            pc += 2;
+            break;
 
-                case 0x00EE:
-                    sp--;
-                    pc = stack[sp];
-                    pc += 2;
-                    break;
+        case OP_RET:
+            //00EE. Returns from a subroutine. With the default memory policy the stack is a ring of 16, so returning
+            //with nothing on it reads the oldest entry instead of memory outside the stack
+            sp = (uint8_t) MemoryPolicy::stack_pointer(sp - 1);
+            pc = stack[MemoryPolicy::stack_slot(sp)];
+            pc += 2;
+            break;
 
-                default:
-                    //incorrect opcode
-                    std::cerr << "Unknown opcode- " << opcode;
-                    break;
-            }
+        case OP_SCROLL_DOWN:
+            //00CN. Scrolls down by N pixels
+            scroll_vertical(get_nibble(opcode, 0, 0x000F));
+            pc += 2;
             break;
 
-        case 1:
-            pc = opcode & 0x0FFF;
+        case OP_SCROLL_UP:
+            //00DN. Scrolls up by N pixels
+            scroll_vertical(-get_nibble(opcode, 0, 0x000F));
+            pc += 2;
+            break;
+
+        case OP_SCROLL_RIGHT:
+            //00FB. Scrolls right by 4 pixels
+            scroll_horizontal(4);
+            pc += 2;
             break;
 
-        case 2:
-            //only instruction is 2NNN Calls subroutine at NNN.
-            //so put current address in stack and move pc to NNN
-            stack[sp] = pc;
-            sp++;
+        case OP_SCROLL_LEFT:
+            //00FC. Scrolls left by 4 pixels
+            scroll_horizontal(-4);
+            pc += 2;
+            break;
+
+        case OP_LORES:
+        case OP_HIRES:
+            //00FE switches to 64*32 and 00FF to 128*64, both clear the screen
+            hires = opcode == 0x00FF;
+            memset(display, 0, sizeof(display));
+            draw_flag = true;
+            pc += 2;
+            break;
+
+        case OP_JP:
+            //1NNN. Jumps to NNN. Jumping to itself or back into a delay timer polling loop means nothing can change
+            //until the next timer tick or key press, so the rest of the frame can be skipped
+            val = opcode & 0x0FFF;
+            if (val == pc)
+            {
+                idle_state = IDLE_HALT;
+            }
+            else if (is_delay_poll_loop(val))
+            {
+                idle_state = IDLE_TIMER;
+            }
+            pc = val;
+            break;
+
+        case OP_CALL:
+            //2NNN Calls subroutine at NNN.
+            //so put current address in stack and move pc to NNN. A 17th nested call overwrites the oldest entry
+            stack[MemoryPolicy::stack_slot(sp)] = pc;
+            sp = (uint8_t) MemoryPolicy::stack_pointer(sp + 1);
             pc = opcode & 0x0FFF;
             break;
 
-        case 3:
-            //only instruction is 3XNN Skips the next instruction if VX equals NN.
+        case OP_SE_BYTE:
+            //3XNN Skips the next instruction if VX equals NN.
             val = get_nibble(opcode, 0, 0x00FF); //extract the lower 8 bits
             reg = get_nibble(opcode, 8, 0x0F00); //get the X from opcode
             pc += 2; //next instruction
             if (V[reg] == val)
             {
-                pc += 2; //adding 2 again so this instruction is skipped
+                skip_next_instruction();
             }
             break;
 
-        case 4:
-            //instruction is 4XNN. Skips the next instruction if VX doesn't equal NN.
+        case OP_SNE_BYTE:
+            //4XNN. Skips the next instruction if VX doesn't equal NN.
             val = get_nibble(opcode, 0, 0x00FF); //extract the lower 8 bits
             reg = get_nibble(opcode, 8, 0x0F00); //get the X from opcode
             pc += 2; //next instruction
             if (V[reg] != val)
             {
-                pc += 2; //adding 2 again so this instruction is skipped
+                skip_next_instruction();
             }
             break;
 
-        case 5:
-            //instruction is 5XY0. Skips the next instruction if VX equals VY.
+        case OP_SE_REG:
+            //5XY0. Skips the next instruction if VX equals VY.
             reg1 = get_nibble(opcode, 8, 0x0F00);
             reg2 = get_nibble(opcode, 4, 0x00F0);
             pc += 2;
             if (V[reg1] == V[reg2])
             {
-                pc += 2;
+                skip_next_instruction();
+            }
+            break;
+
+        case OP_SAVE_RANGE:
+        case OP_LOAD_RANGE:
+        {
+            //5XY2 stores and 5XY3 loads VX to VY (in either order) at I, I is left unchanged
+            reg1 = get_nibble(opcode, 8, 0x0F00);
+            reg2 = get_nibble(opcode, 4, 0x00F0);
+            int step = reg1 <= reg2 ? 1 : -1;
+            int count = (reg2 - reg1) * step + 1;
+            for (int i = 0; i < count; i++)
+            {
+                if ((opcode & 0x000F) == 2)
+                {
+                    memory_at(I + i) = V[reg1 + i * step];
+                }
+                else
+                {
+                    V[reg1 + i * step] = memory_at(I + i);
+                }
             }
+            pc += 2;
             break;
+        }
 
-        case 6:
-            //instruction is 6XNN. Sets VX to NN.
+        case OP_LD_BYTE:
+            //6XNN. Sets VX to NN.
             val = get_nibble(opcode, 0, 0x00FF); //extract the lower 8 bits
             reg = get_nibble(opcode, 8, 0x0F00); //get the X from opcode
             V[reg] = val;
             pc += 2;
             break;
 
-        case 7:
-            //instruction is 7XNN. Adds NN to VX.
+        case OP_ADD_BYTE:
+            //7XNN. Adds NN to VX.
             val = get_nibble(opcode, 0, 0x00FF); //extract the lower 8 bits
             reg = get_nibble(opcode, 8, 0x0F00); //get the X from opcode
             V[reg] += val;
             pc += 2;
             break;
 
-        case 8:
-            //multiple instructions possible
-            val = get_nibble(opcode, 0, 0x000F); //extract last 4 bits
-            switch (val)
-            {
-                case 0:
-                    //8XY0. Sets VX to the value of VY.
-                    reg1 = get_nibble(opcode, 8, 0x0F00);
-                    reg2 = get_nibble(opcode, 4, 0x00F0);
-                    V[reg1] = V[reg2];
-                    pc += 2;
-                    break;
-
-                case 1:
-                    //8XY1. Sets VX to VX or VY. (Bitwise OR operation) VF is reset to 0.
-                    reg1 = get_nibble(opcode, 8, 0x0F00);
-                    reg2 = get_nibble(opcode, 4, 0x00F0);
-                    V[reg1] |= V[reg2];
-                    V[0xF] = 0;
-                    pc += 2;
-                    break;
-
-                case 2:
-                    //8XY2. Sets VX to VX and VY. (Bitwise AND operation) VF is reset to 0.
-                    reg1 = get_nibble(opcode, 8, 0x0F00);
-                    reg2 = get_nibble(opcode, 4, 0x00F0);
-                    V[reg1] &= V[reg2];
-                    V[0xF] = 0;
-                    pc += 2;
-                    break;
-
-                case 3:
-                    //8XY3. Sets VX to VX xor VY. VF to 0
-                    reg1 = get_nibble(opcode, 8, 0x0F00);
-                    reg2 = get_nibble(opcode, 4, 0x00F0);
-                    V[reg1] ^= V[reg2];
-                    V[0xF] = 0;
-                    pc += 2;
-                    break;
-
-                case 4:
-                    //Adds VY to VX. VF is set to 1 when there's a carry, and to 0 when there isn't.
-                    reg1 = get_nibble(opcode, 8, 0x0F00);
-                    reg2 = get_nibble(opcode, 4, 0x00F0);
-                    if (V[reg1] + V[reg2] > 0xFF)
-                    {
-                        V[0xF] = 1;
-                    }
-                    else
-                    {
-                        V[0xF] = 0;
-                    }
-                    V[reg1] += V[reg2];
-                    V[reg1] = (int8_t) V[reg1];
-                    pc += 2;
-                    break;
-
-                case 5:
-                    //VY is subtracted from VX. VF is set to 0 when there's a borrow, and 1 when there isn't.
-                    reg1 = get_nibble(opcode, 8, 0x0F00);
-                    reg2 = get_nibble(opcode, 4, 0x00F0);
-                    if (V[reg1] < V[reg2])
-                    {
-                        V[0xF] = 0;
-                    }
-                    else
-                    {
-                        V[0xF] = 1;
-                    }
-                    V[reg1] = (uint8_t) V[reg1] - (uint8_t) V[reg2];
-                    pc += 2;
-                    break;
-
-                case 6:
-                    //Shifts VX right by one. VF is set to the value of the least significant bit of VX before the shift.
-                    reg = get_nibble(opcode, 8, 0x0F00);
-                    V[0xF] = V[reg] & 0x1;
-                    V[reg] >>= 1;
-                    V[reg] = (uint8_t) V[reg];
-                    pc += 2;
-                    break;
-
-                case 7:
-                    //Sets VX to VY minus VX. VF is set to 0 when there's a borrow, and 1 when there isn't.
-                    reg1 = get_nibble(opcode, 8, 0x0F00);
-                    reg2 = get_nibble(opcode, 4, 0x00F0);
-                    if (V[reg1] > V[reg2])
-                    {
-                        V[0xF] = 0;
-                    }
-                    else
-                    {
-                        V[0xF] = 1;
-                    }
-                    V[reg1] = (uint8_t) V[reg2] - (uint8_t) V[reg1];
-                    pc += 2;
-                    break;
-
-                case 0xE:
-                    //Shifts VX left by one. VF is set to the value of the most significant bit of VX before the shift.[2]
-                    reg = get_nibble(opcode, 8, 0x0F00);
-                    V[0xF] = V[reg] >> 7;
-                    V[0xF] = (uint8_t) V[0xF];
-                    V[reg] <<= 1;
-                    V[reg] = (uint8_t) V[reg];
-                    pc += 2;
-                    break;
-
-                default:
-                    std::cerr << "Unknown opcode- " << opcode;
-                    break;
-            }
-            break;
-
-        case 9:
+        case OP_LD_REG:
+            //8XY0. Sets VX to the value of VY.
+            reg1 = get_nibble(opcode, 8, 0x0F00);
+            reg2 = get_nibble(opcode, 4, 0x00F0);
+            V[reg1] = V[reg2];
+            pc += 2;
+            break;
+
+        case OP_OR:
+            //8XY1. Sets VX to VX or VY. (Bitwise OR operation) VF is reset to 0.
+            reg1 = get_nibble(opcode, 8, 0x0F00);
+            reg2 = get_nibble(opcode, 4, 0x00F0);
+            V[reg1] |= V[reg2];
+            V[0xF] = 0;
+            pc += 2;
+            break;
+
+        case OP_AND:
+            //8XY2. Sets VX to VX and VY. (Bitwise AND operation) VF is reset to 0.
+            reg1 = get_nibble(opcode, 8, 0x0F00);
+            reg2 = get_nibble(opcode, 4, 0x00F0);
+            V[reg1] &= V[reg2];
+            V[0xF] = 0;
+            pc += 2;
+            break;
+
+        case OP_XOR:
+            //8XY3. Sets VX to VX xor VY. VF to 0
+            reg1 = get_nibble(opcode, 8, 0x0F00);
+            reg2 = get_nibble(opcode, 4, 0x00F0);
+            V[reg1] ^= V[reg2];
+            V[0xF] = 0;
+            pc += 2;
+            break;
+
+        case OP_ADD_REG:
+            //8XY4. Adds VY to VX. VF is set to 1 when there's a carry, and to 0 when there isn't.
+            reg1 = get_nibble(opcode, 8, 0x0F00);
+            reg2 = get_nibble(opcode, 4, 0x00F0);
+            if (V[reg1] + V[reg2] > 0xFF)
+            {
+                V[0xF] = 1;
+            }
+            else
+            {
+                V[0xF] = 0;
+            }
+            V[reg1] += V[reg2];
+            V[reg1] = (int8_t) V[reg1];
+            pc += 2;
+            break;
+
+        case OP_SUB:
+            //8XY5. VY is subtracted from VX. VF is set to 0 when there's a borrow, and 1 when there isn't.
+            reg1 = get_nibble(opcode, 8, 0x0F00);
+            reg2 = get_nibble(opcode, 4, 0x00F0);
+            if (V[reg1] < V[reg2])
+            {
+                V[0xF] = 0;
+            }
+            else
+            {
+                V[0xF] = 1;
+            }
+            V[reg1] = (uint8_t) V[reg1] - (uint8_t) V[reg2];
+            pc += 2;
+            break;
+
+        case OP_SHR:
+            //8XY6. Shifts VX right by one. VF is set to the value of the least significant bit of VX before the shift.
+            reg = get_nibble(opcode, 8, 0x0F00);
+            V[0xF] = V[reg] & 0x1;
+            V[reg] >>= 1;
+            V[reg] = (uint8_t) V[reg];
+            pc += 2;
+            break;
+
+        case OP_SUBN:
+            //8XY7. Sets VX to VY minus VX. VF is set to 0 when there's a borrow, and 1 when there isn't.
+            reg1 = get_nibble(opcode, 8, 0x0F00);
+            reg2 = get_nibble(opcode, 4, 0x00F0);
+            if (V[reg1] > V[reg2])
+            {
+                V[0xF] = 0;
+            }
+            else
+            {
+                V[0xF] = 1;
+            }
+            V[reg1] = (uint8_t) V[reg2] - (uint8_t) V[reg1];
+            pc += 2;
+            break;
+
+        case OP_SHL:
+            //8XYE. Shifts VX left by one. VF is set to the value of the most significant bit of VX before the shift.[2]
+            reg = get_nibble(opcode, 8, 0x0F00);
+            V[0xF] = V[reg] >> 7;
+            V[0xF] = (uint8_t) V[0xF];
+            V[reg] <<= 1;
+            V[reg] = (uint8_t) V[reg];
+            pc += 2;
+            break;
+
+        case OP_SNE_REG:
             //9XY0. 	Skips the next instruction if VX doesn't equal VY.
             reg1 = get_nibble(opcode, 8, 0x0F00);
             reg2 = get_nibble(opcode, 4, 0x00F0);
             pc += 2;
             if (V[reg1] != V[reg2])
             {
-                pc += 2;
+                skip_next_instruction();
             }
             break;
 
-        case 10: //0xA
+        case OP_LD_I:
             //ANNN Sets I to the address NNN.
             I = opcode & 0x0FFF;
             pc += 2;
             break;
 
-        case 11: //0xB
+        case OP_JP_V0:
             //BNNN. Jumps to the address NNN plus V0.
             pc = (opcode & 0x0FFF);
             pc += V[0];
             break;
 
-        case 12: //0xC
+        case OP_RND:
             //CXNN. Sets VX to the result of a bitwise and operation on a random number (Typically: 0 to 255) and NN.
             val = get_nibble(opcode, 0, 0x00FF); //extract the lower 8 bits
             reg = get_nibble(opcode, 8, 0x0F00); //get the X from opcode
@@ -349,197 +756,163 @@ void Chip8::single_cycle(bool trace_mode, bool sound_on)
             pc += 2;
             break;
 
-        case 13: //0xD
-        {
+        case OP_DRW:
             //DXYN. Draws a sprite at coordinate (VX, VY) that has a width of 8 pixels and a height of N pixels.
             // Each row of 8 pixels is read as bit-coded starting from memory location I;
             // I value doesn’t change after the execution of this instruction.
             // VF is set to 1 if any screen pixels are flipped from set to unset when the sprite is drawn, and to 0 if that doesn’t happen
-
             reg1 = get_nibble(opcode, 8, 0x0F00);
             reg2 = get_nibble(opcode, 4, 0x00F0);
-            int x = V[reg1], y = V[reg2];
-            int ht = opcode & 0x000F; //N
-            int wt = 8;
-            V[0x0F] = 0;
+            draw_sprite(V[reg1], V[reg2], opcode & 0x000F);
+            draw_flag = true;
+            pc += 2;
+            break;
 
-            for (int i = 0; i < ht; i++)
+        case OP_SKP:
+            //EX9E. Skips the next instruction if the key stored in VX is pressed.
+            reg = get_nibble(opcode, 8, 0x0F00);
+            pc += 2;
+            if ((keypad >> MemoryPolicy::key(V[reg])) & 1)
             {
-                int pixel = memory[I + i];
-                for (int j = 0; j < wt; j++)
-                {
-                    if ((pixel & (0x80 >> j)) != 0)
-                    {
-                        int index = ((x + j) + ((y + i) * 64)) % 2048;
-                        if (display[index] == 1)
-                        {
-                            V[0x0F] = 1;
-                        }
-                        display[index] ^= 1;
-                    }
-                }
+                skip_next_instruction();
             }
+            break;
 
-            draw_flag = true;
+        case OP_SKNP:
+            //EXA1. Skips the next instruction if the key stored in VX isn't pressed.
+            reg = get_nibble(opcode, 8, 0x0F00);
             pc += 2;
+            if (((keypad >> MemoryPolicy::key(V[reg])) & 1) == 0)
+            {
+                skip_next_instruction();
+            }
+            break;
+
+        case OP_LD_I_LONG:
+            //F000 NNNN. Sets I to the 16 bit address in the next 2 bytes
+            I = (uint16_t) ((memory_at(pc + 2) << 8) | memory_at(pc + 3));
+            pc += 4;
             break;
-        }
-        case 14: //0x0E
-            //two instructions possible
-            val = get_nibble(opcode, 0, 0x00FF);
-            switch (val)
-            {
-                case 0x9E:
-                    //Skips the next instruction if the key stored in VX is pressed.
-                    reg = get_nibble(opcode, 8, 0x0F00);
-                    pc += 2;
-                    if (keypad[V[reg]] != 0)
-                    {
-                        pc += 2;
-                    }
-                    break;
-
-                case 0xA1:
-                    //Skips the next instruction if the key stored in VX isn't pressed.
-                    reg = get_nibble(opcode, 8, 0x0F00);
-                    pc += 2;
-                    if (keypad[V[reg]] == 0)
-                    {
-                        pc += 2;
-                    }
-                    break;
-
-                default:
-                    std::cerr << "Invalid opcode-> " << std::hex << opcode;
-                    break;
-
-            }
-            break;
-
-        case 15: //0x0F
-            //multiple instructions possible
-            val = get_nibble(opcode, 0, 0x00FF);
-            switch (val)
-            {
-                case 0x07:
-                    //FX07. Sets VX to the value of the delay timer.
-                    reg = get_nibble(opcode, 8, 0x0F00);
-                    V[reg] = delay_timer;
-                    pc += 2;
-                    break;
-
-                case 0x0A:
-                    //FX0A. A key press is awaited, and then stored in VX.
-                {
-                    bool key_pressed = false;
-                    reg = get_nibble(opcode, 8, 0x0F00);
-                    for (int i = 0; i < 16; i++)
-                    {
-                        if (keypad[i] != 0)
-                        {
-                            key_pressed = true;
-                            V[reg] = (uint8_t) i;
-                        }
-                    }
-                    if (key_pressed)
-                    {
-                        pc += 2;
-                    }
-                    break;
-                }
 
-                case 0x15:
-                    //FX15. Sets the delay timer to VX.
-                    reg = get_nibble(opcode, 8, 0x0F00);
-                    delay_timer = V[reg];
-                    pc += 2;
-                    break;
-
-                case 0x18:
-                    //sets the sound timer to VX
-                    reg = get_nibble(opcode, 8, 0x0F00);
-                    sound_timer = V[reg];
-                    pc += 2;
-                    break;
-
-                case 0x1E:
-                    //Adds VX to I
-                    reg = get_nibble(opcode, 8, 0x0F00);
-                    if (I + V[reg] > 0xFFF)
-                    {
-                        V[0xF] = 1;
-                    }
-                    else
-                    {
-                        V[0xF] = 0;
-                    }
-                    I += V[reg];
-                    I = (uint16_t) I;
-                    pc += 2;
-                    break;
-
-                case 0x29:
-                    //Sets I to the location of the sprite for the character in VX. Characters 0-F (in hexadecimal) are represented by a 4x5 font.
-                    reg = get_nibble(opcode, 8, 0x0F00);
-                    I = V[reg] * 0x5;
-                    pc += 2;
-                    break;
-
-                case 0x33:
-                    //Stores the binary-coded decimal representation of VX, with the most significant of three digits at the address in I, the middle digit at I plus 1, and the least significant digit at I plus 2. (In other words, take the decimal representation of VX, place the hundreds digit in memory at location in I, the tens digit at location I+1, and the ones digit at location I+2.)
-                    reg = get_nibble(opcode, 8, 0x0F00);
-                    memory[I] = (uint8_t) ((uint8_t) V[reg] / 100);
-                    memory[I + 1] = (uint8_t) ((uint8_t) (V[reg] / 10) % 10);
-                    memory[I + 2] = (uint8_t) ((uint8_t) (V[reg] % 100) % 10);
-                    pc += 2;
-                    break;
-
-                case 0x55:
-                    //Stores V0 to VX (including VX) in memory starting at address I
-                    reg = get_nibble(opcode, 8, 0x0F00);
-                    for (int i = 0; i <= reg; i++)
-                    {
-                        memory[I + i] = V[i];
-                    }
-                    I = I + reg + 1;
-                    I = (uint16_t) I;
-                    pc += 2;
-                    break;
-
-                case 0x65:
-                    //Fills V0 to VX (including VX) with values from memory starting at address I
-                    reg = get_nibble(opcode, 8, 0x0F00);
-                    for (int i = 0; i <= reg; i++)
-                    {
-                        V[i] = memory[I + i];
-                    }
-                    I = I + reg + 1;
-                    I = (uint16_t) I;
-                    pc += 2;
-                    break;
-
-                default:
-                    std::cerr << "Invalid opcode -> " << std::hex << opcode << std::endl;
-                    break;
+        case OP_PLANE:
+            //FN01. Selects the bitplanes N used by drawing, clearing and scrolling
+            plane_mask = (uint8_t) get_nibble(opcode, 8, 0x0300);
+            pc += 2;
+            break;
+
+        case OP_AUDIO:
+            //F002. Loads the 16 byte audio pattern from I
+            for (int i = 0; i < 16; i++)
+            {
+                audio_pattern[i] = memory_at(I + i);
             }
+            pc += 2;
             break;
 
-        default:
-            std::cerr << "Invalid opcode -> " << std::hex << opcode << std::endl;
+        case OP_GET_DELAY:
+            //FX07. Sets VX to the value of the delay timer.
+            reg = get_nibble(opcode, 8, 0x0F00);
+            V[reg] = delay_timer;
+            pc += 2;
             break;
-    }
 
-    if (delay_timer > 0)
-    {
-        delay_timer--;
-    }
-    if (sound_timer > 0)
-    {
-        if (sound_on)
+        case OP_WAIT_KEY:
+            //FX0A. A key press is awaited, and then stored in VX.
         {
-            printf("\a\n"); //terminal dependent, should be changed later
+            //with several keys held the lowest one is taken
+            reg = get_nibble(opcode, 8, 0x0F00);
+            if (keypad != 0)
+            {
+                V[reg] = (uint8_t) __builtin_ctz(keypad);
+                pc += 2;
+            }
+            else
+            {
+                idle_state = IDLE_KEY;
+            }
+            break;
         }
-        sound_timer--;
+
+        case OP_SET_DELAY:
+            //FX15. Sets the delay timer to VX.
+            reg = get_nibble(opcode, 8, 0x0F00);
+            delay_timer = V[reg];
+            pc += 2;
+            break;
+
+        case OP_SET_SOUND:
+            //FX18. Sets the sound timer to VX
+            reg = get_nibble(opcode, 8, 0x0F00);
+            sound_timer = V[reg];
+            pc += 2;
+            break;
+
+        case OP_ADD_I:
+            //FX1E. Adds VX to I
+            reg = get_nibble(opcode, 8, 0x0F00);
+            if (I + V[reg] > 0xFFF)
+            {
+                V[0xF] = 1;
+            }
+            else
+            {
+                V[0xF] = 0;
+            }
+            I += V[reg];
+            I = (uint16_t) I;
+            pc += 2;
+            break;
+
+        case OP_FONT:
+            //FX29. Sets I to the location of the sprite for the character in VX. Characters 0-F (in hexadecimal) are represented by a 4x5 font.
+            reg = get_nibble(opcode, 8, 0x0F00);
+            I = V[reg] * 0x5;
+            pc += 2;
+            break;
+
+        case OP_PITCH:
+            //FX3A. Sets the audio pattern playback pitch to VX
+            reg = get_nibble(opcode, 8, 0x0F00);
+            audio_pitch = V[reg];
+            pc += 2;
+            break;
+
+        case OP_BCD:
+            //FX33. Stores the binary-coded decimal representation of VX, with the most significant of three digits at the address in I, the middle digit at I plus 1, and the least significant digit at I plus 2. (In other words, take the decimal representation of VX, place the hundreds digit in memory at location in I, the tens digit at location I+1, and the ones digit at location I+2.)
+            reg = get_nibble(opcode, 8, 0x0F00);
+            memory_at(I) = (uint8_t) ((uint8_t) V[reg] / 100);
+            memory_at(I + 1) = (uint8_t) ((uint8_t) (V[reg] / 10) % 10);
+            memory_at(I + 2) = (uint8_t) ((uint8_t) (V[reg] % 100) % 10);
+            pc += 2;
+            break;
+
+        case OP_STORE:
+            //FX55. Stores V0 to VX (including VX) in memory starting at address I
+            reg = get_nibble(opcode, 8, 0x0F00);
+            for (int i = 0; i <= reg; i++)
+            {
+                memory_at(I + i) = V[i];
+            }
+            I = I + reg + 1;
+            I = (uint16_t) I;
+            pc += 2;
+            break;
+
+        case OP_LOAD:
+            //FX65. Fills V0 to VX (including VX) with values from memory starting at address I
+            reg = get_nibble(opcode, 8, 0x0F00);
+            for (int i = 0; i <= reg; i++)
+            {
+                V[i] = memory_at(I + i);
+            }
+            I = I + reg + 1;
+            I = (uint16_t) I;
+            pc += 2;
+            break;
+
+        default:
+            raise_fault(FAULT_INVALID_OPCODE, opcode);
+            break;
     }
 }
 
@@ -552,3 +925,158 @@ int Chip8::get_nibble(int val, int bits, int val_to_binary_and = 0xFFFF) //extra
 {
     return ((val & val_to_binary_and) >> bits);
 }
+
+void Chip8::raise_fault(FaultCode code, int opcode)
+{
+    fault = Chip8Fault{code, pc, (uint16_t) opcode};
+    FaultPolicy action = fault_policy == FAULT_CALLBACK ? fault_handler(fault) : fault_policy;
+    if (action == FAULT_SKIP)
+    {
+        pc += 2;
+    }
+    else
+    {
+        idle_state = IDLE_FAULT;
+    }
+}
+
+//a single AND in the default masked build
+inline uint8_t &Chip8::memory_at(int address)
+{
+    return memory[MemoryPolicy::address(address, memory_mask)];
+}
+
+//checks for FX07, 3XNN or 4XNN, 1NNN back to the FX07, which can only exit after the delay timer changes
+bool Chip8::is_delay_poll_loop(int target)
+{
+    //only a look ahead, so it wraps without going through MemoryPolicy
+    int read = (memory[target & memory_mask] << 8) | memory[(target + 1) & memory_mask];
+    int skip = (memory[(target + 2) & memory_mask] << 8) | memory[(target + 3) & memory_mask];
+    return target + 4 == pc && (read & 0xF0FF) == 0xF007 &&
+           ((skip & 0xF000) == 0x3000 || (skip & 0xF000) == 0x4000) && (skip & 0x0F00) == (read & 0x0F00);
+}
+
+void Chip8::skip_next_instruction()
+{
+    //F000 NNNN is the only 4 byte instruction, so skipping it has to skip its operand too
+    if (xo_chip && memory_at(pc) == 0xF0 && memory_at(pc + 1) == 0x00)
+    {
+        pc += 4;
+    }
+    else
+    {
+        pc += 2;
+    }
+}
+
+void Chip8::draw_sprite(int x, int y, int n)
+{
+    int width = get_display_width(), height = get_display_height();
+    //DXY0 draws a 16*16 sprite, otherwise sprites are 8 pixels wide and N rows high
+    int sprite_width = (n == 0 && (hires || xo_chip)) ? 16 : 8;
+    int rows = sprite_width == 16 ? 16 : n;
+    int address = I;
+    x %= width;
+    y %= height;
+    V[0x0F] = 0;
+
+    //with both planes selected, the data for plane 1 follows the data for plane 0
+    for (int p = 0; p < 2; p++)
+    {
+        if ((plane_mask & (1 << p)) == 0)
+        {
+            continue;
+        }
+        for (int i = 0; i < rows; i++)
+        {
+            uint64_t bits = memory_at(address++);
+            if (sprite_width == 16)
+            {
+                bits = (bits << 8) | memory_at(address++);
+            }
+
+            //align the sprite row to the left edge, then rotate it to x so it wraps around the row. Each row wraps on
+            //its own, pixels past the right edge don't carry on into the next row
+            uint64_t hi = bits << (64 - sprite_width), lo = 0;
+            if (width == 64)
+            {
+                hi = x == 0 ? hi : (hi >> x) | (hi << (64 - x));
+            }
+            else
+            {
+                int shift = x;
+                if (shift >= 64)
+                {
+                    lo = hi;
+                    hi = 0;
+                    shift -= 64;
+                }
+                if (shift != 0)
+                {
+                    uint64_t new_hi = (hi >> shift) | (lo << (64 - shift));
+                    lo = (lo >> shift) | (hi << (64 - shift));
+                    hi = new_hi;
+                }
+            }
+
+            uint64_t *row = display[p][(y + i) % height];
+            if ((row[0] & hi) | (row[1] & lo))
+            {
+                V[0x0F] = 1;
+            }
+            row[0] ^= hi;
+            row[1] ^= lo;
+        }
+    }
+}
+
+void Chip8::scroll_vertical(int n)
+{
+    int height = get_display_height();
+    for (int p = 0; p < 2; p++)
+    {
+        if ((plane_mask & (1 << p)) == 0)
+        {
+            continue;
+        }
+        if (n > 0)
+        {
+            memmove(display[p][n], display[p][0], sizeof(display[p][0]) * (height - n));
+            memset(display[p][0], 0, sizeof(display[p][0]) * n);
+        }
+        else if (n < 0)
+        {
+            memmove(display[p][0], display[p][-n], sizeof(display[p][0]) * (height + n));
+            memset(display[p][height + n], 0, sizeof(display[p][0]) * -n);
+        }
+    }
+    draw_flag = true;
+}
+
+void Chip8::scroll_horizontal(int n)
+{
+    int height = get_display_height();
+    for (int p = 0; p < 2; p++)
+    {
+        if ((plane_mask & (1 << p)) == 0)
+        {
+            continue;
+        }
+        //whole rows are shifted as 128 bit values, in low resolution word 1 is always 0
+        for (int i = 0; i < height; i++)
+        {
+            uint64_t *row = display[p][i];
+            if (n > 0)
+            {
+                row[1] = hires ? (row[1] >> n) | (row[0] << (64 - n)) : 0;
+                row[0] >>= n;
+            }
+            else
+            {
+                row[0] = (row[0] << -n) | (row[1] >> (64 + n));
+                row[1] <<= -n;
+            }
+        }
+    }
+    draw_flag = true;
+}
@@ -7,34 +7,70 @@
 
 
 #include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
 #include <string>
+#include <vector>
+#include "chip8_state.h"
 
-class Chip8
-{
-private:
-    //CPU
-    uint8_t V[16]; //16 8 bit registers Vx where x ranges from 0 to F
-    uint16_t I, pc;
-    uint8_t sp; //16 bit register I,16 bit program counter, 8 bit stack pointer
-    uint16_t stack[16]; //16 16bit values can be stored in stack
-    uint8_t delay_timer, sound_timer; //delay and sound 8 bit registers
+struct AotProgram;
+class Jit;
+
+//the 4x5 hexadecimal digits 0 to F loaded at address 0, 5 bytes each with the top row first and the leftmost pixel
+//in bit 7
+extern const uint8_t chip8_fontset[80];
 
-    //MEMORY
-    uint8_t memory[4096]; //4k RAM
+//what the core does on a fault
+enum FaultPolicy
+{
+    FAULT_HALT, //records it and stops in IDLE_FAULT, the default
+    FAULT_SKIP, //records it and moves on to the next instruction
+    FAULT_CALLBACK //asks a function, which returns FAULT_HALT or FAULT_SKIP
+};
 
-    //DISPLAY
-    int display[64 * 32]; //64*32 display
+typedef std::function<FaultPolicy(const Chip8Fault &)> FaultHandler;
 
-    //KEYPAD
-    int keypad[16]; //hexadecimal keypad
+class Chip8 : private Chip8State
+{
+    friend class Debugger;
+    friend class GdbStub;
 
-    //flags
-    bool draw_flag; //if true, need to draw
+private:
+    const AotProgram *aot; //translated blocks run by run_cycles, null when there are none
+    std::vector<uint8_t> aot_enabled; //one per block, cleared when the program writes over the block's code
+    std::vector<uint8_t> aot_code; //addresses covered by at least one enabled block
+    std::unique_ptr<Jit> jit; //translates blocks itself as they get hot, null unless enabled
+    FaultPolicy fault_policy;
+    FaultHandler fault_handler; //only called under FAULT_CALLBACK
+
+    //the whole keypad changing once cycle_count reaches cycle
+    struct KeypadChange
+    {
+        uint64_t cycle;
+        uint16_t keys;
+    };
+    std::deque<KeypadChange> input; //queued by queue_keypad, in cycle order
+    uint64_t next_input_cycle; //cycle of the first queued change, UINT64_MAX when there is none
 
     //helper functions
     int get_nibble(int, int, int); //returns 4 bits from 1st argument
     // right shifting by second argument number of bits with optional third argument to & first
 
+    uint8_t &memory_at(int); //the byte an address computed by the program refers to under MemoryPolicy
+
+    bool is_delay_poll_loop(int); //true if a backwards jump to the argument is a delay timer polling loop
+
+    void invalidate_code(uint16_t, int); //drops every AOT or JIT block translated from the written range
+
+    void apply_input(); //makes every queued keypad change that is due
+
+    void raise_fault(FaultCode, int); //records a fault on the instruction at pc and applies the policy
+
+    void skip_next_instruction(); //moves pc past the next instruction, which is 4 bytes long for F000 NNNN
+    void draw_sprite(int, int, int); //DXYN on every selected plane, sets VF on collision
+    void scroll_vertical(int); //positive moves the selected planes down, negative moves them up
+    void scroll_horizontal(int); //positive moves the selected planes right, negative moves them left
 
 public:
     Chip8(); //constructor
@@ -43,12 +79,67 @@ public:
 
     void set_draw_flag(bool);
 
-    void single_cycle(bool, bool);
+    void set_xo_chip(bool); //must be called before load_rom so larger ROMs fit
+    bool is_xo_chip();
+
+    void single_cycle(bool);
+
+    //advances cycle_count by the given number of instruction slots, returns the number of instructions executed,
+    //which is fewer when the program went idle
+    int run_cycles(int, bool);
+
+    bool set_aot_program(const AotProgram *); //false if the blocks were translated from a different ROM or mode
+
+    bool set_jit(bool); //call after set_xo_chip, returns false if the host can't run translated code
+
+    void update_timers(); //one 60Hz timer tick
+
+    bool is_sound_on(); //true while the sound timer is running, the tone is left to the frontend
+
+    int fast_forward(int); //skips idle frames without running instructions, returns the number skipped
 
-    int get_display_value(int);
+    IdleState get_idle_state();
+
+    void set_fault_policy(FaultPolicy, FaultHandler = nullptr); //the handler is required for FAULT_CALLBACK
+
+    const Chip8Fault &get_fault(); //the last fault, also set under FAULT_SKIP
+
+    void clear_fault(); //forgets the last fault and lets a halted program run again from pc
+
+    bool needs_input();
+
+    int get_display_width();
+
+    int get_display_height();
+
+    int get_display_value(int); //plane 0 in bit 0 and plane 1 in bit 1 of the pixel at row major index
+
+    const uint8_t *get_memory(); //all 64k, only the first 4k are used outside XO-CHIP mode
+
+    const uint64_t *get_display_row(int, int); //packed words of a row of a plane
+
+    uint64_t get_display_hash(); //64 bit hash of both planes, cheap enough to take every frame
+
+    const Chip8State &get_state(); //the whole machine, copy it to take a snapshot
+
+    void set_state(const Chip8State &); //restores a snapshot, translated blocks are dropped where memory differs
+
+    const uint8_t *get_audio_pattern();
+
+    uint8_t get_audio_pitch();
 
     void set_keypad_value(int, int);
 
+    void set_keypad(uint16_t); //every key at once, bit n is key n
+
+    uint16_t get_keypad();
+
+    //sets the keypad at the given cycle_count, or before the next instruction if that has passed. A change stamped
+    //earlier than one already queued is made right after it, so changes always happen in the order they were queued
+    void queue_keypad(uint64_t, uint16_t);
+
+    uint64_t get_cycle_count();
+
     ~Chip8(); //destructor
 };
 
@@ -0,0 +1,73 @@
+//
+// Machine state of a Chip8, kept as plain data so translated code can run on it directly
+//
+
+#ifndef CHIP8_STATE_H
+#define CHIP8_STATE_H
+
+
+#include <cstdint>
+
+//why run_cycles stopped early, nothing the program does can change until the given event
+enum IdleState
+{
+    IDLE_NONE, //still running
+    IDLE_TIMER, //polling the delay timer, wakes up on the next timer tick
+    IDLE_KEY, //waiting in FX0A for a key press
+    IDLE_HALT, //jumping to itself, only the timers are left running
+    IDLE_FAULT //stopped on a fault, nothing runs until clear_fault or set_state
+};
+
+//something the program did that the machine can't carry out
+enum FaultCode
+{
+    FAULT_NONE,
+    FAULT_INVALID_OPCODE //pc is left on the instruction
+};
+
+struct Chip8Fault
+{
+    FaultCode code;
+    uint16_t pc, opcode; //where it happened and the instruction there
+};
+
+struct Chip8State
+{
+    //CPU
+    uint8_t V[16]; //16 8 bit registers Vx where x ranges from 0 to F
+    uint16_t I, pc;
+    uint8_t sp; //16 bit register I,16 bit program counter, 8 bit stack pointer
+    uint16_t stack[16]; //16 16bit values can be stored in stack
+    uint8_t delay_timer, sound_timer; //delay and sound 8 bit registers
+
+    //MEMORY
+    uint8_t memory[65536]; //4k RAM for CHIP-8, the full 64k is addressable in XO-CHIP mode
+    uint16_t memory_mask; //0xFFF, or 0xFFFF in XO-CHIP mode, what addresses wrap to
+
+    //DISPLAY
+    //plane-major packed framebuffer, each row is 128 bits split in two words with the leftmost pixel in the MSB
+    //of word 0. In low resolution mode only rows 0-31 of word 0 are used, so a row is exactly one word
+    uint64_t display[2][64][2];
+    uint8_t plane_mask; //bitplanes selected by FN01, bit 0 is plane 0
+    bool hires; //128*64 mode when true, 64*32 otherwise
+
+    //KEYPAD
+    uint16_t keypad; //hexadecimal keypad, bit n is set while key n is held
+
+    //AUDIO
+    uint8_t audio_pattern[16]; //128 bit sample pattern loaded by F002
+    uint8_t audio_pitch; //playback rate of the pattern set by FX3A
+
+    //CLOCK
+    uint64_t cycle_count; //instruction slots since power on, counting the ones run_cycles spent idle. Queued input
+    //is stamped with it
+
+    //flags
+    bool draw_flag; //if true, need to draw
+    bool xo_chip; //enables the 64k address space and the 4 byte F000 NNNN instruction for skips
+    IdleState idle_state; //set by the last instruction if the program is spinning
+    Chip8Fault fault; //the last fault, code is FAULT_NONE if there hasn't been one
+};
+
+
+#endif //CHIP8_STATE_H
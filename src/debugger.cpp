@@ -0,0 +1,238 @@
+//
+// Breakpoints, watchpoints and stepping on top of Chip8::run_cycles
+//
+
+#include <cstdio>
+#include <cstring>
+#include "debugger.h"
+#include "opcodes.h"
+
+Debugger::Debugger(Chip8 &c) : chip8(c)
+{
+    memset(flags, 0, sizeof(flags));
+    flag_count = 0;
+    register_watches = 0;
+    pending_steps = 0;
+    step_over_pc = -1;
+    step_over_sp = -1;
+    return_depth = -1;
+    skip_breakpoint = -1;
+    stop_reason = STOP_NONE;
+    stop_address = 0;
+}
+
+void Debugger::set_flag(uint16_t address, uint8_t flag, bool on)
+{
+    bool was_set = flags[address] != 0;
+    if (on)
+    {
+        flags[address] |= flag;
+    }
+    else
+    {
+        flags[address] &= ~flag;
+    }
+    flag_count += (flags[address] != 0) - was_set;
+}
+
+void Debugger::set_breakpoint(uint16_t address, bool on)
+{
+    set_flag(address, BREAKPOINT, on);
+}
+
+bool Debugger::has_breakpoint(uint16_t address)
+{
+    return (flags[address] & BREAKPOINT) != 0;
+}
+
+void Debugger::set_watchpoint(uint16_t address, int length, bool on)
+{
+    for (int i = 0; i < length; i++)
+    {
+        set_flag((uint16_t) (address + i), WATCHPOINT, on);
+    }
+}
+
+void Debugger::set_register_watch(int reg, bool on)
+{
+    if (on)
+    {
+        register_watches |= 1u << reg;
+    }
+    else
+    {
+        register_watches &= ~(1u << reg);
+    }
+}
+
+void Debugger::clear_all()
+{
+    memset(flags, 0, sizeof(flags));
+    flag_count = 0;
+    register_watches = 0;
+}
+
+void Debugger::step()
+{
+    pending_steps = 1;
+}
+
+void Debugger::step_over()
+{
+    int opcode = (chip8.memory[chip8.pc] << 8) | chip8.memory[(uint16_t) (chip8.pc + 1)];
+    if (op_info[decode(opcode)].flags & OPF_CALL)
+    {
+        //2NNN, run until the matching 00EE brings us back with the same stack depth
+        step_over_pc = (uint16_t) (chip8.pc + 2);
+        step_over_sp = chip8.sp;
+    }
+    else
+    {
+        pending_steps = 1;
+    }
+}
+
+bool Debugger::step_out()
+{
+    //sp wraps, so the return is found by counting calls and returns rather than by comparing sp
+    if (chip8.sp == 0)
+    {
+        return false;
+    }
+    return_depth = 0;
+    return true;
+}
+
+bool Debugger::is_armed()
+{
+    return flag_count != 0 || register_watches != 0 || pending_steps != 0 || step_over_pc >= 0 || return_depth >= 0;
+}
+
+void Debugger::stop(StopReason reason, uint16_t address)
+{
+    stop_reason = reason;
+    stop_address = address;
+    pending_steps = 0;
+    step_over_pc = -1;
+    step_over_sp = -1;
+    return_depth = -1;
+    skip_breakpoint = chip8.pc;
+}
+
+int Debugger::run(int cycles, bool trace_mode)
+{
+    stop_reason = STOP_NONE;
+    //with nothing set the debugger costs nothing, the whole batch goes to the interpreter
+    if (!is_armed())
+    {
+        int ran = chip8.run_cycles(cycles, trace_mode);
+        if (ran != 0)
+        {
+            skip_breakpoint = -1;
+        }
+        if (chip8.idle_state == IDLE_FAULT)
+        {
+            stop(STOP_FAULT, chip8.pc);
+        }
+        return ran;
+    }
+
+    int i = 0;
+    while (i < cycles)
+    {
+        uint16_t pc = chip8.pc;
+        if ((flags[pc] & BREAKPOINT) && pc != skip_breakpoint)
+        {
+            stop(STOP_BREAKPOINT, pc);
+            break;
+        }
+        skip_breakpoint = -1;
+
+        //remember what the instruction may change so watchpoints can be checked afterwards
+        int opcode = (chip8.memory[pc] << 8) | chip8.memory[(uint16_t) (pc + 1)];
+        int write_length = memory_write_length(opcode);
+        uint16_t old_I = chip8.I;
+        uint8_t old_V[16];
+        memcpy(old_V, chip8.V, sizeof(old_V));
+
+        chip8.single_cycle(trace_mode);
+        chip8.invalidate_code(old_I, write_length);
+        i++;
+        if (chip8.idle_state == IDLE_FAULT)
+        {
+            stop(STOP_FAULT, chip8.pc);
+            break;
+        }
+
+        for (int j = 0; j < write_length; j++)
+        {
+            uint16_t address = (uint16_t) ((old_I + j) & chip8.memory_mask);
+            if (flags[address] & WATCHPOINT)
+            {
+                stop(STOP_WATCHPOINT, address);
+                break;
+            }
+        }
+        if (register_watches != 0 && stop_reason == STOP_NONE)
+        {
+            for (int j = 0; j < 16; j++)
+            {
+                if ((register_watches & (1u << j)) && old_V[j] != chip8.V[j])
+                {
+                    stop(STOP_WATCHPOINT, (uint16_t) j);
+                    break;
+                }
+            }
+            if ((register_watches & (1u << 16)) && old_I != chip8.I && stop_reason == STOP_NONE)
+            {
+                stop(STOP_WATCHPOINT, 16);
+            }
+        }
+        if (stop_reason != STOP_NONE)
+        {
+            break;
+        }
+
+        //running to return stops at the first 00EE that isn't matched by a call made since
+        int op_flags = op_info[decode(opcode)].flags;
+        bool returned = return_depth == 0 && (op_flags & OPF_RETURN);
+        if (return_depth >= 0)
+        {
+            return_depth += (op_flags & OPF_CALL) ? 1 : (op_flags & OPF_RETURN) ? -1 : 0;
+        }
+        if ((pending_steps != 0 && --pending_steps == 0) ||
+            (step_over_pc >= 0 && chip8.pc == step_over_pc && chip8.sp == step_over_sp) || returned)
+        {
+            stop(STOP_STEP, chip8.pc);
+            break;
+        }
+        if (chip8.idle_state != IDLE_NONE)
+        {
+            break;
+        }
+    }
+    return i;
+}
+
+StopReason Debugger::get_stop_reason()
+{
+    return stop_reason;
+}
+
+uint16_t Debugger::get_stop_address()
+{
+    return stop_address;
+}
+
+void Debugger::print_state()
+{
+    int opcode = (chip8.memory[chip8.pc] << 8) | chip8.memory[(uint16_t) (chip8.pc + 1)];
+    int next = (chip8.memory[(uint16_t) (chip8.pc + 2)] << 8) | chip8.memory[(uint16_t) (chip8.pc + 3)];
+    printf("PC=%.4X OP=%.4X %-16s I=%.4X SP=%.2X DT=%.2X ST=%.2X\n", chip8.pc, opcode,
+           format_instruction(opcode, next).c_str(), chip8.I, chip8.sp, chip8.delay_timer, chip8.sound_timer);
+    for (int i = 0; i < 16; i++)
+    {
+        printf("V%X=%.2X ", i, chip8.V[i]);
+    }
+    printf("\n");
+}
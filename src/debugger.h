@@ -0,0 +1,73 @@
+//
+// Breakpoints, watchpoints and stepping on top of Chip8::run_cycles
+//
+
+#ifndef CHIP8_DEBUGGER_H
+#define CHIP8_DEBUGGER_H
+
+
+#include <cstdint>
+#include "chip8.h"
+
+//why Debugger::run returned
+enum StopReason
+{
+    STOP_NONE, //ran for the requested number of cycles or the program went idle
+    STOP_STEP, //a step, step over or run to return has finished
+    STOP_BREAKPOINT, //about to execute an instruction with a breakpoint
+    STOP_WATCHPOINT, //the last instruction wrote to a watched address or changed a watched register
+    STOP_FAULT //the program halted on a fault, Chip8::get_fault says which
+};
+
+class Debugger
+{
+private:
+    static const uint8_t BREAKPOINT = 1;
+    static const uint8_t WATCHPOINT = 2;
+
+    Chip8 &chip8;
+
+    uint8_t flags[65536]; //BREAKPOINT and WATCHPOINT bits for every address
+    int flag_count; //addresses with a flag set, run takes the plain interpreter path while this is 0 and nothing is armed
+    uint32_t register_watches; //bit n watches Vn, bit 16 watches I
+
+    //stepping, armed by step, step_over and step_out and cleared on any stop
+    int pending_steps; //instructions left before stopping, 0 when not single stepping
+    int step_over_pc, step_over_sp; //stop when the call returns to step_over_pc, -1 if not stepping over
+    int return_depth; //calls made since step_out that haven't returned yet, -1 if not running to return
+    int skip_breakpoint; //pc of the last stop, whose breakpoint is ignored once so the program can move on, or -1
+
+    StopReason stop_reason;
+    uint16_t stop_address; //pc of the breakpoint, or the watched address or register that changed
+
+    bool is_armed();
+    void set_flag(uint16_t, uint8_t, bool);
+    void stop(StopReason, uint16_t);
+
+public:
+    explicit Debugger(Chip8 &);
+
+    void set_breakpoint(uint16_t, bool); //adds or removes a breakpoint
+    bool has_breakpoint(uint16_t);
+
+    void set_watchpoint(uint16_t, int, bool); //watches or unwatches the given number of bytes from an address
+
+    void set_register_watch(int, bool); //0 to 15 for V0 to VF, 16 for I
+
+    void clear_all();
+
+    void step(); //stop after the next instruction
+    void step_over(); //like step, but runs a 2NNN call until it returns
+    bool step_out(); //runs until the current subroutine returns, false if there is none to return from
+
+    int run(int, bool); //runs up to the given cycles like Chip8::run_cycles, returns the number executed
+
+    StopReason get_stop_reason();
+
+    uint16_t get_stop_address();
+
+    void print_state();
+};
+
+
+#endif //CHIP8_DEBUGGER_H
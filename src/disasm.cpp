@@ -0,0 +1,241 @@
+//
+// Recursive descent disassembler and control flow graph for ROMs
+//
+
+#include <cstdio>
+#include <string>
+#include "disasm.h"
+#include "opcodes.h"
+
+ControlFlowGraph::ControlFlowGraph(const uint8_t *m, int rom_end, bool xo) : memory(m), end(rom_end), xo_chip(xo),
+                                                                              kinds(65536, BYTE_DATA)
+{}
+
+int ControlFlowGraph::opcode_at(int address)
+{
+    return (memory[(uint16_t) address] << 8) | memory[(uint16_t) (address + 1)];
+}
+
+int ControlFlowGraph::instruction_length(int address)
+{
+    return (xo_chip && decode(opcode_at(address)) == OP_LD_I_LONG) ? 4 : 2;
+}
+
+//follows straight line code from an address, queueing every other place control can go
+void ControlFlowGraph::trace(uint16_t entry)
+{
+    std::vector<uint16_t> work(1, entry);
+    leaders.insert(entry);
+    while (!work.empty())
+    {
+        int address = work.back();
+        work.pop_back();
+        while (address + 1 < end && kinds[address] == BYTE_DATA)
+        {
+            int opcode = opcode_at(address), length = instruction_length(address);
+            int flags = op_info[decode(opcode)].flags;
+            kinds[address] = BYTE_INSTRUCTION;
+            for (int i = 1; i < length; i++)
+            {
+                kinds[(uint16_t) (address + i)] = BYTE_OPERAND;
+            }
+            int next = address + length;
+
+            if (flags & (OPF_JUMP | OPF_CALL))
+            {
+                leaders.insert((uint16_t) (opcode & 0x0FFF));
+                work.push_back((uint16_t) (opcode & 0x0FFF));
+                if (flags & OPF_CALL)
+                {
+                    subroutines.insert((uint16_t) (opcode & 0x0FFF));
+                }
+            }
+            if (flags & OPF_SKIP)
+            {
+                //both the next instruction and the one after it start blocks
+                int skipped = next + instruction_length(next);
+                leaders.insert((uint16_t) next);
+                leaders.insert((uint16_t) skipped);
+                work.push_back((uint16_t) skipped);
+            }
+            if (flags & OPF_CALL)
+            {
+                leaders.insert((uint16_t) next);
+            }
+            if ((flags & (OPF_JUMP | OPF_RETURN | OPF_INDIRECT)) || decode(opcode) == OP_INVALID)
+            {
+                break;
+            }
+            address = next;
+        }
+    }
+}
+
+void ControlFlowGraph::build(uint16_t entry)
+{
+    trace(entry);
+
+    //split the decoded instructions into blocks at leaders and after control transfers
+    BasicBlock *block = nullptr;
+    for (int address = 0; address < 65536; address++)
+    {
+        if (kinds[address] != BYTE_INSTRUCTION)
+        {
+            if (kinds[address] == BYTE_DATA)
+            {
+                block = nullptr;
+            }
+            continue;
+        }
+        if (block == nullptr || leaders.count((uint16_t) address))
+        {
+            if (block != nullptr)
+            {
+                block->successors.push_back((uint16_t) address); //falls through into the new block
+            }
+            BasicBlock &b = blocks[(uint16_t) address];
+            b.start = (uint16_t) address;
+            b.indirect = false;
+            b.returns = false;
+            block = &b;
+        }
+
+        int opcode = opcode_at(address), length = instruction_length(address);
+        int flags = op_info[decode(opcode)].flags;
+        int next = address + length;
+        block->end = (uint16_t) next;
+
+        if (flags & OPF_JUMP)
+        {
+            block->successors.push_back((uint16_t) (opcode & 0x0FFF));
+        }
+        else if (flags & OPF_CALL)
+        {
+            block->calls.push_back((uint16_t) (opcode & 0x0FFF));
+            block->successors.push_back((uint16_t) next);
+        }
+        else if (flags & OPF_SKIP)
+        {
+            block->successors.push_back((uint16_t) next);
+            block->successors.push_back((uint16_t) (next + instruction_length(next)));
+        }
+        else if (flags & OPF_RETURN)
+        {
+            block->returns = true;
+        }
+        else if (flags & OPF_INDIRECT)
+        {
+            block->indirect = true;
+        }
+        else if (decode(opcode) != OP_INVALID && next < end && kinds[next] == BYTE_INSTRUCTION)
+        {
+            continue; //straight line code, if the next instruction is a leader its block adds the fall through edge
+        }
+        block = nullptr;
+    }
+}
+
+const std::map<uint16_t, BasicBlock> &ControlFlowGraph::get_blocks()
+{
+    return blocks;
+}
+
+bool ControlFlowGraph::is_instruction(uint16_t address)
+{
+    return kinds[address] == BYTE_INSTRUCTION;
+}
+
+void ControlFlowGraph::print_listing(std::ostream &out)
+{
+    char line[128];
+    int address = 0x200;
+    while (address < end)
+    {
+        if (kinds[address] != BYTE_INSTRUCTION)
+        {
+            //up to 8 bytes of data per line, stopping at the next instruction
+            int count = 0;
+            snprintf(line, sizeof(line), "%.4X  ", address);
+            out << line << "db";
+            while (address < end && kinds[address] != BYTE_INSTRUCTION && count < 8)
+            {
+                snprintf(line, sizeof(line), "%s0x%.2X", count == 0 ? " " : ", ", memory[address]);
+                out << line;
+                address++;
+                count++;
+            }
+            out << "\n";
+            continue;
+        }
+
+        if (leaders.count((uint16_t) address))
+        {
+            snprintf(line, sizeof(line), "\n%s_%.4X:\n", subroutines.count((uint16_t) address) ? "sub" : "label",
+                     address);
+            out << line;
+        }
+        int opcode = opcode_at(address), length = instruction_length(address);
+        int next_word = opcode_at(address + 2);
+        const char *comment = "";
+        int flags = op_info[decode(opcode)].flags;
+        if (flags & OPF_INDIRECT)
+        {
+            comment = "; indirect jump, targets unknown";
+        }
+        else if (decode(opcode) == OP_INVALID)
+        {
+            comment = "; invalid opcode";
+        }
+        else if ((flags & OPF_JUMP) && (opcode & 0x0FFF) == address)
+        {
+            comment = "; halts";
+        }
+        if (length == 4)
+        {
+            snprintf(line, sizeof(line), "%.4X  %.4X %.4X  %-20s%s", address, opcode, next_word,
+                     format_instruction(opcode, next_word).c_str(), comment);
+        }
+        else
+        {
+            snprintf(line, sizeof(line), "%.4X  %.4X       %-20s%s", address, opcode,
+                     format_instruction(opcode, next_word).c_str(), comment);
+        }
+        std::string text(line);
+        out << text.substr(0, text.find_last_not_of(' ') + 1) << "\n";
+        address += length;
+    }
+}
+
+void ControlFlowGraph::print_dot(std::ostream &out)
+{
+    char text[128];
+    out << "digraph cfg {\n"
+        << "    node [shape=box, fontname=monospace];\n";
+    for (std::map<uint16_t, BasicBlock>::iterator it = blocks.begin(); it != blocks.end(); ++it)
+    {
+        BasicBlock &block = it->second;
+        snprintf(text, sizeof(text), "    b%.4X [label=\"", block.start);
+        out << text;
+        for (int address = block.start; address < block.end; address += instruction_length(address))
+        {
+            int opcode = opcode_at(address);
+            snprintf(text, sizeof(text), "%.4X  %s\\l", address,
+                     format_instruction(opcode, opcode_at(address + 2)).c_str());
+            out << text;
+        }
+        out << "\"" << (block.indirect ? ", color=red" : "") << (subroutines.count(block.start) ? ", peripheries=2" : "")
+            << "];\n";
+
+        for (size_t i = 0; i < block.successors.size(); i++)
+        {
+            snprintf(text, sizeof(text), "    b%.4X -> b%.4X;\n", block.start, block.successors[i]);
+            out << text;
+        }
+        for (size_t i = 0; i < block.calls.size(); i++)
+        {
+            snprintf(text, sizeof(text), "    b%.4X -> b%.4X [style=dashed];\n", block.start, block.calls[i]);
+            out << text;
+        }
+    }
+    out << "}\n";
+}
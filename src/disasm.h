@@ -0,0 +1,62 @@
+//
+// Recursive descent disassembler and control flow graph for ROMs
+//
+
+#ifndef CHIP8_DISASM_H
+#define CHIP8_DISASM_H
+
+
+#include <cstdint>
+#include <map>
+#include <ostream>
+#include <set>
+#include <vector>
+
+struct BasicBlock
+{
+    uint16_t start, end; //end is the address after the last instruction
+    std::vector<uint16_t> successors; //blocks control can continue in, not counting calls
+    std::vector<uint16_t> calls; //subroutines called at the end of the block
+    bool indirect; //ends in BNNN, so the successors are only known at run time
+    bool returns; //ends in 00EE
+};
+
+class ControlFlowGraph
+{
+private:
+    enum ByteKind
+    {
+        BYTE_DATA,
+        BYTE_INSTRUCTION, //first byte of an instruction
+        BYTE_OPERAND //any other byte of an instruction
+    };
+
+    const uint8_t *memory; //the whole 64k address space
+    int end; //first address after the ROM, nothing at or past it is decoded
+    bool xo_chip;
+
+    std::vector<uint8_t> kinds; //ByteKind of every address
+    std::set<uint16_t> leaders; //addresses that start a basic block
+    std::set<uint16_t> subroutines; //targets of 2NNN
+    std::map<uint16_t, BasicBlock> blocks;
+
+    int opcode_at(int);
+    int instruction_length(int);
+    void trace(uint16_t);
+
+public:
+    ControlFlowGraph(const uint8_t *, int, bool); //memory, address after the ROM and XO-CHIP mode
+
+    void build(uint16_t); //decodes everything reachable from the entry point and splits it into blocks
+
+    const std::map<uint16_t, BasicBlock> &get_blocks();
+
+    bool is_instruction(uint16_t);
+
+    void print_listing(std::ostream &);
+
+    void print_dot(std::ostream &);
+};
+
+
+#endif //CHIP8_DISASM_H
@@ -0,0 +1,67 @@
+//
+// Turns the packed display planes into 32 bit pixels through a 4 colour palette
+//
+
+#include <cstring>
+#include "expand.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+void build_expand_table(const uint32_t *palette, ExpandTable &table)
+{
+    for (int index = 0; index < 256; index++)
+    {
+        for (int pixel = 0; pixel < 4; pixel++)
+        {
+            int bit = 3 - pixel; //the leftmost pixel is the high bit of the nibble
+            table.pixels[index][pixel] = palette[((index >> bit) & 1) | (((index >> (4 + bit)) & 1) << 1)];
+        }
+    }
+}
+
+//4 finished pixels, a single 16 byte load and store with SSE2
+static inline void copy_pixels(uint32_t *out, const uint32_t *pixels)
+{
+#if defined(__SSE2__)
+    _mm_storeu_si128((__m128i *) out, _mm_load_si128((const __m128i *) pixels));
+#else
+    memcpy(out, pixels, 4 * sizeof(uint32_t));
+#endif
+}
+
+//8 pixels per step, a byte of each plane gives two table indexes
+void expand_row(const uint64_t *plane0, const uint64_t *plane1, int width, const ExpandTable &table, uint32_t *out)
+{
+    for (int word = 0; word < width / 64; word++)
+    {
+        uint64_t p0 = plane0[word], p1 = plane1[word];
+        for (int shift = 56; shift >= 0; shift -= 8, out += 8)
+        {
+            unsigned b0 = (unsigned) (p0 >> shift) & 0xFF, b1 = (unsigned) (p1 >> shift) & 0xFF;
+            copy_pixels(out, table.pixels[(b0 >> 4) | (b1 & 0xF0)]);
+            copy_pixels(out + 4, table.pixels[(b0 & 0xF) | ((b1 & 0xF) << 4)]);
+        }
+    }
+}
+
+//each pixel is broadcast to a register and stored 4 copies at a time
+void scale_row(const uint32_t *in, int width, int scale, uint32_t *out)
+{
+    for (int x = 0; x < width; x++, out += scale)
+    {
+        int copy = 0;
+#if defined(__SSE2__)
+        __m128i pixel = _mm_set1_epi32((int) in[x]);
+        for (; copy + 4 <= scale; copy += 4)
+        {
+            _mm_storeu_si128((__m128i *) (out + copy), pixel);
+        }
+#endif
+        for (; copy < scale; copy++)
+        {
+            out[copy] = in[x];
+        }
+    }
+}
@@ -0,0 +1,29 @@
+//
+// Turns the packed display planes into 32 bit pixels through a 4 colour palette, for writing straight into a texture
+//
+
+#ifndef CHIP8_EXPAND_H
+#define CHIP8_EXPAND_H
+
+
+#include <cstdint>
+
+//the 4 pixels of every combination of a nibble of plane 0 (low 4 bits of the index) and plane 1 (high 4 bits), so
+//the palette costs nothing once the table is built
+struct ExpandTable
+{
+    alignas(16) uint32_t pixels[256][4];
+};
+
+//the colour of a pixel is palette[plane 1 bit * 2 + plane 0 bit], rebuild the table when the palette changes
+void build_expand_table(const uint32_t *, ExpandTable &);
+
+//one display row of width pixels (64 or 128) from the row's words in both planes, as Chip8::get_display_row returns
+//them
+void expand_row(const uint64_t *, const uint64_t *, int, const ExpandTable &, uint32_t *);
+
+//nearest neighbour upscale of a row of width pixels by an integer factor, writes width * scale pixels
+void scale_row(const uint32_t *, int, int, uint32_t *);
+
+
+#endif //CHIP8_EXPAND_H
@@ -0,0 +1,676 @@
+//
+// GDB remote serial protocol server for a running Chip8
+//
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "gdb_stub.h"
+
+static const char hex_digits[] = "0123456789abcdef";
+
+static int hex_value(char c)
+{
+    if (c >= '0' && c <= '9')
+    {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f')
+    {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F')
+    {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+//reads hex digits up to the first non hex character, leaving p after them
+static uint32_t parse_hex(const char *&p)
+{
+    uint32_t value = 0;
+    while (hex_value(*p) >= 0)
+    {
+        value = (value << 4) | hex_value(*p);
+        p++;
+    }
+    return value;
+}
+
+GdbStub::GdbStub(Chip8 &c, Debugger &d) : chip8(c), debugger(d), running(false)
+{
+    listen_fd = -1;
+    wake_pipe[0] = wake_pipe[1] = -1;
+    attached = false;
+    halted = false;
+}
+
+bool GdbStub::start(int port)
+{
+    listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd < 0)
+    {
+        return false;
+    }
+    int on = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons((uint16_t) port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK); //only local debuggers can attach
+    if (bind(listen_fd, (sockaddr *) &address, sizeof(address)) < 0 || listen(listen_fd, 1) < 0 || pipe(wake_pipe) < 0)
+    {
+        close(listen_fd);
+        listen_fd = -1;
+        return false;
+    }
+
+    running = true;
+    server = std::thread(&GdbStub::serve, this);
+    return true;
+}
+
+void GdbStub::stop()
+{
+    if (!running)
+    {
+        return;
+    }
+    running = false;
+    char c = 0;
+    if (write(wake_pipe[1], &c, 1) < 0)
+    {
+        perror("gdb stub");
+    }
+    server.join();
+    close(listen_fd);
+    close(wake_pipe[0]);
+    close(wake_pipe[1]);
+}
+
+GdbStub::~GdbStub()
+{
+    stop();
+}
+
+//socket thread, accepts one debugger at a time and moves packets between it and the queues
+void GdbStub::serve()
+{
+    while (running)
+    {
+        pollfd waiting[2] = {{listen_fd, POLLIN, 0},
+                             {wake_pipe[0], POLLIN, 0}};
+        if (::poll(waiting, 2, -1) < 0 || !running)
+        {
+            continue;
+        }
+        if (waiting[1].revents & POLLIN)
+        {
+            char drain[64];
+            if (read(wake_pipe[0], drain, sizeof(drain)) < 0)
+            {
+                perror("gdb stub");
+            }
+        }
+        if ((waiting[0].revents & POLLIN) == 0)
+        {
+            continue;
+        }
+        int client = accept(listen_fd, NULL, NULL);
+        if (client < 0)
+        {
+            continue;
+        }
+
+        Packet packet;
+        packet.kind = PACKET_CONNECT;
+        packet.length = 0;
+        push_command(packet);
+
+        //packets look like $data#checksum, with a lone 0x03 byte for ctrl-c
+        bool in_packet = false, escaped = false, repeat = false;
+        int checksum_digits = 0, checksum = 0, sum = 0;
+        auto append = [&](char byte)
+        {
+            if (packet.length < (int) sizeof(packet.data) - 1)
+            {
+                packet.data[packet.length++] = byte;
+            }
+        };
+        packet.kind = PACKET_DATA;
+        packet.length = 0;
+        while (running)
+        {
+            pollfd sources[2] = {{client, POLLIN, 0},
+                                 {wake_pipe[0], POLLIN, 0}};
+            if (::poll(sources, 2, -1) < 0)
+            {
+                continue;
+            }
+            if (sources[1].revents & POLLIN)
+            {
+                char drain[64];
+                if (read(wake_pipe[0], drain, sizeof(drain)) < 0 || !send_replies(client))
+                {
+                    break;
+                }
+            }
+            if ((sources[0].revents & (POLLIN | POLLHUP | POLLERR)) == 0)
+            {
+                continue;
+            }
+
+            char buffer[1024];
+            ssize_t n = recv(client, buffer, sizeof(buffer), 0);
+            if (n <= 0)
+            {
+                break;
+            }
+            for (ssize_t i = 0; i < n; i++)
+            {
+                char c = buffer[i];
+                if (!in_packet)
+                {
+                    if (c == '$')
+                    {
+                        in_packet = true;
+                        escaped = repeat = false;
+                        packet.length = 0;
+                        checksum_digits = 0;
+                        sum = 0;
+                    }
+                    else if (c == 0x03)
+                    {
+                        Packet interrupt;
+                        interrupt.kind = PACKET_INTERRUPT;
+                        interrupt.length = 0;
+                        push_command(interrupt);
+                    }
+                    continue; //acks and noise between packets
+                }
+                if (checksum_digits == 0 && c != '#')
+                {
+                    //the checksum covers the bytes as sent. } escapes the next byte, which is sent xored with 0x20,
+                    //and *n repeats the byte before it n - 29 more times
+                    sum += (uint8_t) c;
+                    if (escaped)
+                    {
+                        append((char) (c ^ 0x20));
+                        escaped = false;
+                    }
+                    else if (repeat)
+                    {
+                        for (int k = 0; k < (uint8_t) c - 29 && packet.length > 0; k++)
+                        {
+                            append(packet.data[packet.length - 1]);
+                        }
+                        repeat = false;
+                    }
+                    else if (c == '}')
+                    {
+                        escaped = true;
+                    }
+                    else if (c == '*')
+                    {
+                        repeat = true;
+                    }
+                    else
+                    {
+                        append(c);
+                    }
+                    continue;
+                }
+                if (c == '#')
+                {
+                    checksum = 0;
+                    checksum_digits = 1;
+                    continue;
+                }
+                checksum = (checksum << 4) | (hex_value(c) & 0xF);
+                if (++checksum_digits < 3)
+                {
+                    continue;
+                }
+
+                in_packet = false;
+                packet.data[packet.length] = '\0';
+                //a full queue or a bad checksum makes gdb send the packet again
+                bool ok = (sum & 0xFF) == checksum && commands.push(packet);
+                if (send(client, ok ? "+" : "-", 1, MSG_NOSIGNAL) < 0)
+                {
+                    break;
+                }
+            }
+        }
+
+        close(client);
+        Packet disconnect;
+        disconnect.kind = PACKET_DISCONNECT;
+        disconnect.length = 0;
+        push_command(disconnect);
+    }
+}
+
+//socket thread, waits for room as the emulation thread has to see connects, disconnects and interrupts
+void GdbStub::push_command(const Packet &packet)
+{
+    while (!commands.push(packet) && running)
+    {
+        usleep(1000);
+    }
+}
+
+//socket thread, frames and sends everything the emulation thread has queued
+bool GdbStub::send_replies(int client)
+{
+    Packet packet;
+    while (replies.pop(packet))
+    {
+        char framed[sizeof(packet.data) + 4];
+        int sum = 0;
+        framed[0] = '$';
+        for (int i = 0; i < packet.length; i++)
+        {
+            framed[i + 1] = packet.data[i];
+            sum += (uint8_t) packet.data[i];
+        }
+        sprintf(framed + packet.length + 1, "#%.2x", sum & 0xFF);
+        if (send(client, framed, (size_t) packet.length + 4, MSG_NOSIGNAL) < 0)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+void GdbStub::poll()
+{
+    //only a couple of atomic loads while no debugger is talking to us
+    Packet command;
+    while (commands.pop(command))
+    {
+        handle(command);
+    }
+}
+
+bool GdbStub::is_attached()
+{
+    return attached;
+}
+
+bool GdbStub::is_halted()
+{
+    return attached && halted;
+}
+
+void GdbStub::report_stop(StopReason reason)
+{
+    if (!attached || reason == STOP_NONE)
+    {
+        return;
+    }
+    halted = true;
+    send_reply(reason == STOP_FAULT ? "S04" : "S05"); //SIGILL or SIGTRAP
+}
+
+//emulation thread, queues a reply and wakes the socket thread
+void GdbStub::send_reply(const char *text)
+{
+    reply.kind = PACKET_DATA;
+    reply.length = (int) strlen(text);
+    memcpy(reply.data, text, (size_t) reply.length);
+    if (replies.push(reply))
+    {
+        char c = 0;
+        if (write(wake_pipe[1], &c, 1) < 0)
+        {
+            perror("gdb stub");
+        }
+    }
+}
+
+void GdbStub::send_hex(const uint8_t *bytes, int length)
+{
+    char text[sizeof(reply.data)];
+    int n = 0;
+    for (int i = 0; i < length && n + 2 < (int) sizeof(text); i++)
+    {
+        text[n++] = hex_digits[bytes[i] >> 4];
+        text[n++] = hex_digits[bytes[i] & 0xF];
+    }
+    text[n] = '\0';
+    send_reply(text);
+}
+
+bool GdbStub::read_register(int n, uint32_t &value)
+{
+    if (n < 16)
+    {
+        value = chip8.V[n];
+    }
+    else if (n == 16)
+    {
+        value = chip8.I;
+    }
+    else if (n == 17)
+    {
+        value = chip8.pc;
+    }
+    else if (n == 18)
+    {
+        value = chip8.sp;
+    }
+    else if (n == 19)
+    {
+        value = chip8.delay_timer;
+    }
+    else if (n == 20)
+    {
+        value = chip8.sound_timer;
+    }
+    else
+    {
+        return false;
+    }
+    return true;
+}
+
+bool GdbStub::write_register(int n, uint32_t value)
+{
+    if (n < 16)
+    {
+        chip8.V[n] = (uint8_t) value;
+    }
+    else if (n == 16)
+    {
+        chip8.I = (uint16_t) value;
+    }
+    else if (n == 17)
+    {
+        chip8.pc = (uint16_t) value;
+        chip8.clear_fault(); //moving pc off a faulting instruction lets the program continue
+    }
+    else if (n == 18 && value < 16)
+    {
+        chip8.sp = (uint8_t) value;
+    }
+    else if (n == 19)
+    {
+        chip8.delay_timer = (uint8_t) value;
+    }
+    else if (n == 20)
+    {
+        chip8.sound_timer = (uint8_t) value;
+    }
+    else
+    {
+        return false;
+    }
+    return true;
+}
+
+//size in bytes of each register on the wire
+static int register_size(int n)
+{
+    return (n == 16 || n == 17) ? 2 : 1;
+}
+
+//tells gdb the registers above, in the order of the g packet, so it doesn't read them as its default architecture's
+static const char target_xml[] =
+        "<?xml version=\"1.0\"?>"
+        "<!DOCTYPE target SYSTEM \"gdb-target.dtd\">"
+        "<target version=\"1.0\">"
+        "<feature name=\"org.chip8.core\">"
+        "<reg name=\"v0\" bitsize=\"8\" regnum=\"0\" type=\"uint8\"/>"
+        "<reg name=\"v1\" bitsize=\"8\" type=\"uint8\"/>"
+        "<reg name=\"v2\" bitsize=\"8\" type=\"uint8\"/>"
+        "<reg name=\"v3\" bitsize=\"8\" type=\"uint8\"/>"
+        "<reg name=\"v4\" bitsize=\"8\" type=\"uint8\"/>"
+        "<reg name=\"v5\" bitsize=\"8\" type=\"uint8\"/>"
+        "<reg name=\"v6\" bitsize=\"8\" type=\"uint8\"/>"
+        "<reg name=\"v7\" bitsize=\"8\" type=\"uint8\"/>"
+        "<reg name=\"v8\" bitsize=\"8\" type=\"uint8\"/>"
+        "<reg name=\"v9\" bitsize=\"8\" type=\"uint8\"/>"
+        "<reg name=\"va\" bitsize=\"8\" type=\"uint8\"/>"
+        "<reg name=\"vb\" bitsize=\"8\" type=\"uint8\"/>"
+        "<reg name=\"vc\" bitsize=\"8\" type=\"uint8\"/>"
+        "<reg name=\"vd\" bitsize=\"8\" type=\"uint8\"/>"
+        "<reg name=\"ve\" bitsize=\"8\" type=\"uint8\"/>"
+        "<reg name=\"vf\" bitsize=\"8\" type=\"uint8\"/>"
+        "<reg name=\"i\" bitsize=\"16\" type=\"data_ptr\"/>"
+        "<reg name=\"pc\" bitsize=\"16\" type=\"code_ptr\"/>"
+        "<reg name=\"sp\" bitsize=\"8\" type=\"uint8\"/>"
+        "<reg name=\"dt\" bitsize=\"8\" type=\"uint8\"/>"
+        "<reg name=\"st\" bitsize=\"8\" type=\"uint8\"/>"
+        "</feature>"
+        "</target>";
+
+//replies to qXfer:features:read:target.xml:offset,length with m and a part or l and the rest. The XML has none of
+//the characters that would need escaping
+void GdbStub::send_target_description(const char *p)
+{
+    uint32_t offset = parse_hex(p);
+    p++; //,
+    uint32_t length = parse_hex(p);
+    uint32_t size = sizeof(target_xml) - 1;
+    if (offset > size)
+    {
+        send_reply("E01");
+        return;
+    }
+    char text[sizeof(reply.data)];
+    length = std::min(length, std::min(size - offset, (uint32_t) sizeof(text) - 2));
+    text[0] = offset + length < size ? 'm' : 'l';
+    memcpy(text + 1, target_xml + offset, length);
+    text[length + 1] = '\0';
+    send_reply(text);
+}
+
+void GdbStub::handle(const Packet &packet)
+{
+    if (packet.kind == PACKET_CONNECT)
+    {
+        //the program stops as soon as a debugger attaches
+        attached = true;
+        halted = true;
+        return;
+    }
+    if (packet.kind == PACKET_DISCONNECT)
+    {
+        attached = false;
+        halted = false;
+        debugger.clear_all();
+        return;
+    }
+    if (packet.kind == PACKET_INTERRUPT)
+    {
+        if (!halted)
+        {
+            halted = true;
+            send_reply("S02"); //SIGINT
+        }
+        return;
+    }
+
+    const char *p = packet.data + 1;
+    switch (packet.data[0])
+    {
+        case '?':
+            send_reply("S05");
+            break;
+
+        case 'g':
+        {
+            //all registers in order, multi byte ones little endian
+            uint8_t bytes[32];
+            int n = 0;
+            for (int i = 0; i < REGISTER_COUNT; i++)
+            {
+                uint32_t value;
+                read_register(i, value);
+                for (int j = 0; j < register_size(i); j++)
+                {
+                    bytes[n++] = (uint8_t) (value >> (8 * j));
+                }
+            }
+            send_hex(bytes, n);
+            break;
+        }
+
+        case 'G':
+            for (int i = 0; i < REGISTER_COUNT && hex_value(p[0]) >= 0; i++)
+            {
+                uint32_t value = 0;
+                for (int j = 0; j < register_size(i) && hex_value(p[0]) >= 0 && hex_value(p[1]) >= 0; j++)
+                {
+                    value |= (uint32_t) ((hex_value(p[0]) << 4) | hex_value(p[1])) << (8 * j);
+                    p += 2;
+                }
+                write_register(i, value);
+            }
+            send_reply("OK");
+            break;
+
+        case 'p':
+        {
+            int n = (int) parse_hex(p);
+            uint32_t value;
+            if (!read_register(n, value))
+            {
+                send_reply("E01");
+                break;
+            }
+            uint8_t bytes[2] = {(uint8_t) value, (uint8_t) (value >> 8)};
+            send_hex(bytes, register_size(n));
+            break;
+        }
+
+        case 'P':
+        {
+            int n = (int) parse_hex(p);
+            uint32_t value = 0;
+            p++; //=
+            for (int j = 0; j < 2 && hex_value(p[0]) >= 0 && hex_value(p[1]) >= 0; j++, p += 2)
+            {
+                value |= (uint32_t) ((hex_value(p[0]) << 4) | hex_value(p[1])) << (8 * j);
+            }
+            send_reply(write_register(n, value) ? "OK" : "E01");
+            break;
+        }
+
+        case 'm':
+        {
+            uint32_t address = parse_hex(p);
+            p++;
+            uint32_t length = parse_hex(p);
+            uint8_t bytes[sizeof(reply.data) / 2 - 1];
+            if (length > sizeof(bytes))
+            {
+                length = sizeof(bytes);
+            }
+            for (uint32_t i = 0; i < length; i++)
+            {
+                bytes[i] = chip8.memory[(uint16_t) (address + i)];
+            }
+            send_hex(bytes, (int) length);
+            break;
+        }
+
+        case 'M':
+        {
+            uint32_t address = parse_hex(p);
+            p++;
+            uint32_t length = parse_hex(p);
+            p++;
+            for (uint32_t i = 0; i < length && hex_value(p[0]) >= 0 && hex_value(p[1]) >= 0; i++, p += 2)
+            {
+                chip8.memory[(uint16_t) (address + i)] = (uint8_t) ((hex_value(p[0]) << 4) | hex_value(p[1]));
+            }
+            chip8.invalidate_code((uint16_t) address, (int) length);
+            send_reply("OK");
+            break;
+        }
+
+        case 'Z':
+        case 'z':
+        {
+            //Z0 and Z1 are breakpoints, Z2 is a write watchpoint, the kind field is its length
+            bool set = packet.data[0] == 'Z';
+            uint32_t type = parse_hex(p);
+            p++;
+            uint32_t address = parse_hex(p);
+            p++;
+            uint32_t length = parse_hex(p);
+            if (type == 0 || type == 1)
+            {
+                debugger.set_breakpoint((uint16_t) address, set);
+                send_reply("OK");
+            }
+            else if (type == 2)
+            {
+                debugger.set_watchpoint((uint16_t) address, length == 0 ? 1 : (int) length, set);
+                send_reply("OK");
+            }
+            else
+            {
+                send_reply("");
+            }
+            break;
+        }
+
+        case 's':
+            debugger.step();
+            halted = false; //the reply is sent by report_stop
+            break;
+
+        case 'c':
+            halted = false;
+            break;
+
+        case 'D':
+            send_reply("OK");
+            //fall through
+
+        case 'k':
+            attached = false;
+            halted = false;
+            debugger.clear_all();
+            break;
+
+        case 'H':
+            send_reply("OK");
+            break;
+
+        case 'q':
+            if (strncmp(packet.data, "qSupported", 10) == 0)
+            {
+                send_reply("PacketSize=800;qXfer:features:read+");
+            }
+            else if (strncmp(packet.data, "qXfer:features:read:target.xml:", 31) == 0)
+            {
+                send_target_description(packet.data + 31);
+            }
+            else if (strcmp(packet.data, "qAttached") == 0)
+            {
+                send_reply("1");
+            }
+            else
+            {
+                send_reply("");
+            }
+            break;
+
+        default:
+            send_reply(""); //unsupported
+            break;
+    }
+}
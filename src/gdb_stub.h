@@ -0,0 +1,79 @@
+//
+// GDB remote serial protocol server for a running Chip8
+//
+
+#ifndef CHIP8_GDB_STUB_H
+#define CHIP8_GDB_STUB_H
+
+
+#include <atomic>
+#include <thread>
+#include "chip8.h"
+#include "debugger.h"
+#include "spsc_queue.h"
+
+//registers are numbered V0 to VF, then I (16), pc (17), sp (18), the delay timer (19) and the sound timer (20). I
+//and pc are sent as 2 little endian bytes. gdb gets the layout from the target description in qXfer
+class GdbStub
+{
+private:
+    static const int REGISTER_COUNT = 21;
+
+    enum PacketKind
+    {
+        PACKET_DATA, //a checksummed packet from gdb, or a reply for it
+        PACKET_INTERRUPT, //gdb sent ctrl-c
+        PACKET_CONNECT,
+        PACKET_DISCONNECT
+    };
+
+    struct Packet
+    {
+        PacketKind kind;
+        int length;
+        char data[4096];
+    };
+
+    Chip8 &chip8;
+    Debugger &debugger;
+
+    //the socket thread only frames packets, all of them are handled on the emulation thread in poll
+    SpscQueue<Packet, 8> commands; //socket thread to emulation thread
+    SpscQueue<Packet, 8> replies; //emulation thread to socket thread
+    std::thread server;
+    std::atomic<bool> running;
+    int listen_fd, wake_pipe[2]; //writing to wake_pipe[1] tells the socket thread a reply is waiting
+
+    bool attached, halted;
+    Packet reply; //scratch space for building replies on the emulation thread
+
+    void serve();
+    void push_command(const Packet &);
+    bool send_replies(int);
+    void handle(const Packet &);
+    void send_reply(const char *);
+    void send_hex(const uint8_t *, int);
+    void send_target_description(const char *);
+    bool read_register(int, uint32_t &);
+    bool write_register(int, uint32_t);
+
+public:
+    GdbStub(Chip8 &, Debugger &);
+
+    bool start(int); //listens on the given port of localhost, returns false if the socket could not be set up
+
+    void stop();
+
+    void poll(); //handles queued commands, call from the emulation thread at least once per frame
+
+    bool is_attached();
+
+    bool is_halted(); //true while gdb has the program stopped
+
+    void report_stop(StopReason); //tells gdb the debugger stopped the program
+
+    ~GdbStub();
+};
+
+
+#endif //CHIP8_GDB_STUB_H
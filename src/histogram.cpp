@@ -0,0 +1,78 @@
+//
+// Distribution of durations in fixed memory
+//
+
+#include <cmath>
+#include "histogram.h"
+
+Histogram::Histogram() : total(0), largest(0)
+{
+    for (int i = 0; i < BUCKETS; i++)
+    {
+        counts[i].store(0, std::memory_order_relaxed);
+    }
+}
+
+//a value of n significant bits is shifted right until SUB_BITS - 1 of them are left below its top bit, each shift
+//gets the next HALF buckets
+int Histogram::bucket_of(uint64_t value)
+{
+    if (value >= (uint64_t) 1 << MAX_BITS)
+    {
+        return BUCKETS - 1;
+    }
+    if (value < (uint64_t) 1 << SUB_BITS)
+    {
+        return (int) value;
+    }
+    int shift = 63 - __builtin_clzll(value) - (SUB_BITS - 1);
+    return shift * HALF + (int) (value >> shift);
+}
+
+uint64_t Histogram::highest_in(int bucket)
+{
+    if (bucket < 1 << SUB_BITS)
+    {
+        return (uint64_t) bucket;
+    }
+    int shift = bucket / HALF - 1;
+    uint64_t top = (uint64_t) (bucket % HALF + HALF);
+    return ((top + 1) << shift) - 1;
+}
+
+void Histogram::record(uint64_t value)
+{
+    std::atomic<uint64_t> &bucket = counts[bucket_of(value)];
+    bucket.store(bucket.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    total.store(total.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    if (value > largest.load(std::memory_order_relaxed))
+    {
+        largest.store(value, std::memory_order_relaxed);
+    }
+}
+
+uint64_t Histogram::count()
+{
+    return total.load(std::memory_order_relaxed);
+}
+
+uint64_t Histogram::percentile(double fraction)
+{
+    uint64_t wanted = (uint64_t) std::ceil(fraction * count());
+    uint64_t seen = 0;
+    for (int i = 0; i < BUCKETS; i++)
+    {
+        seen += counts[i].load(std::memory_order_relaxed);
+        if (seen >= wanted && seen != 0)
+        {
+            //the last bucket has no top, and no value went past the largest one
+            return i < BUCKETS - 1 && highest_in(i) < max() ? highest_in(i) : max();
+        }
+    }
+    return max();
+}
+
+uint64_t Histogram::max()
+{
+    return largest.load(std::memory_order_relaxed);
+}
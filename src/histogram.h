@@ -0,0 +1,49 @@
+//
+// Distribution of durations in fixed memory, bucketed like HdrHistogram so percentiles in the tail are as precise
+// as the median
+//
+
+#ifndef CHIP8_HISTOGRAM_H
+#define CHIP8_HISTOGRAM_H
+
+
+#include <atomic>
+#include <cstdint>
+
+//values below 2^SUB_BITS get a bucket each, larger ones share buckets 1/64 of their size wide, so a percentile is
+//never more than 1.6% over the real value. Values from 2^MAX_BITS up are counted in the last bucket. Recording is a
+//couple of relaxed atomic stores with no allocation, for one writing thread at a time while any thread reads
+class Histogram
+{
+public:
+    static const int SUB_BITS = 7;
+    static const int MAX_BITS = 40; //nanoseconds, about 18 minutes
+
+private:
+    static const int HALF = 1 << (SUB_BITS - 1);
+    static const int BUCKETS = (MAX_BITS - SUB_BITS + 2) * HALF;
+
+    std::atomic<uint64_t> counts[BUCKETS];
+    std::atomic<uint64_t> total;
+    std::atomic<uint64_t> largest;
+
+    static int bucket_of(uint64_t);
+
+    static uint64_t highest_in(int); //the largest value that goes in a bucket
+
+public:
+    Histogram();
+
+    void record(uint64_t);
+
+    uint64_t count();
+
+    //the value the given fraction of recorded values are at or below, rounded up to the top of its bucket. 0 when
+    //nothing was recorded
+    uint64_t percentile(double);
+
+    uint64_t max(); //exact, even past 2^MAX_BITS
+};
+
+
+#endif //CHIP8_HISTOGRAM_H
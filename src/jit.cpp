@@ -0,0 +1,742 @@
+//
+// Translates hot blocks to x86-64 machine code at run time
+//
+
+#include <cstddef>
+#include <cstring>
+#include <initializer_list>
+#include <sys/mman.h>
+#include "jit.h"
+#include "opcodes.h"
+
+namespace
+{
+    const size_t ARENA_SIZE = 1 << 20;
+    const int HOT = 2; //times an address has to be reached before it is translated
+    const int MAX_BLOCK = 64; //instructions per block
+
+    enum Reg
+    {
+        RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15
+    };
+
+    //host registers the V registers are kept in while a block runs, rdi points to the state and rax and rcx are
+    //scratch. Values are always zero extended to 32 bits so byte operations and 32 bit moves can be mixed
+    const int pool[] = {RSI, R8, R9, R10, R11, RBX, RBP, R12, R13, R14, R15};
+    const int POOL_SIZE = sizeof(pool) / sizeof(pool[0]);
+
+    enum Cond
+    {
+        CC_B = 0x2, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5, CC_BE = 0x6, CC_A = 0x7
+    };
+
+    enum Alu
+    {
+        ALU_ADD = 0, ALU_OR = 1, ALU_AND = 4, ALU_SUB = 5, ALU_XOR = 6, ALU_CMP = 7
+    };
+
+    const int OFF_V = offsetof(Chip8State, V);
+    const int OFF_I = offsetof(Chip8State, I);
+    const int OFF_PC = offsetof(Chip8State, pc);
+    const int OFF_SP = offsetof(Chip8State, sp);
+    const int OFF_STACK = offsetof(Chip8State, stack);
+    const int OFF_DELAY = offsetof(Chip8State, delay_timer);
+    const int OFF_SOUND = offsetof(Chip8State, sound_timer);
+    const int OFF_MEMORY = offsetof(Chip8State, memory);
+    const int OFF_PLANE_MASK = offsetof(Chip8State, plane_mask);
+    const int OFF_KEYPAD = offsetof(Chip8State, keypad);
+    const int OFF_AUDIO_PITCH = offsetof(Chip8State, audio_pitch);
+    const int OFF_IDLE = offsetof(Chip8State, idle_state);
+
+    //just the x86-64 encodings the translator needs
+    class Emitter
+    {
+    public:
+        std::vector<uint8_t> code;
+
+        void byte(int b)
+        {
+            code.push_back((uint8_t) b);
+        }
+
+        void word(int w)
+        {
+            byte(w);
+            byte(w >> 8);
+        }
+
+        void dword(uint32_t d)
+        {
+            word(d & 0xFFFF);
+            word(d >> 16);
+        }
+
+        //opcode with a register and an [rdi + index * 2^scale + disp] operand
+        void mem(std::initializer_list<int> opcode, int reg, int disp, bool byte_reg = false, int index = -1,
+                 int scale = 0)
+        {
+            int rex = ((reg & 8) >> 1) | (index >= 0 ? (index & 8) >> 2 : 0);
+            if (rex != 0 || (byte_reg && reg >= 4 && reg < 8))
+            {
+                byte(0x40 | rex);
+            }
+            for (int op : opcode)
+            {
+                byte(op);
+            }
+            if (index < 0)
+            {
+                byte(0x80 | (reg & 7) << 3 | RDI);
+            }
+            else
+            {
+                byte(0x84 | (reg & 7) << 3);
+                byte(scale << 6 | (index & 7) << 3 | RDI);
+            }
+            dword((uint32_t) disp);
+        }
+
+        //opcode with two register operands, byte_regs makes 4-7 mean spl-dil rather than ah-bh
+        void regs(std::initializer_list<int> opcode, int reg, int rm, bool byte_regs)
+        {
+            int rex = ((reg & 8) >> 1) | ((rm & 8) >> 3);
+            if (rex != 0 || (byte_regs && ((reg >= 4 && reg < 8) || (rm >= 4 && rm < 8))))
+            {
+                byte(0x40 | rex);
+            }
+            for (int op : opcode)
+            {
+                byte(op);
+            }
+            byte(0xC0 | (reg & 7) << 3 | (rm & 7));
+        }
+
+        void mov_imm(int reg, uint32_t value)
+        {
+            if (reg & 8)
+            {
+                byte(0x41);
+            }
+            byte(0xB8 + (reg & 7));
+            dword(value);
+        }
+
+        void alu8(Alu alu, int dst, int src)
+        {
+            regs({alu << 3}, src, dst, true);
+        }
+
+        void alu8_imm(Alu alu, int dst, int value)
+        {
+            regs({0x80}, alu, dst, true);
+            byte(value);
+        }
+
+        void and32_imm(int dst, int value)
+        {
+            regs({0x83}, ALU_AND, dst, false);
+            byte(value);
+        }
+
+        void mov32(int dst, int src)
+        {
+            regs({0x89}, src, dst, false);
+        }
+
+        void movzx8(int dst, int src)
+        {
+            regs({0x0F, 0xB6}, dst, src, true);
+        }
+
+        void setcc(Cond cond, int reg)
+        {
+            regs({0x0F, 0x90 | cond}, 0, reg, true);
+        }
+
+        void store_pc(int value)
+        {
+            byte(0x66);
+            mem({0xC7}, 0, OFF_PC);
+            word(value);
+        }
+
+        int jcc(Cond cond) //returns the offset to pass to patch once the target is known
+        {
+            byte(0x70 | cond);
+            byte(0);
+            return (int) code.size();
+        }
+
+        void patch(int from)
+        {
+            code[from - 1] = (uint8_t) (code.size() - from);
+        }
+
+        void push(int reg)
+        {
+            if (reg & 8)
+            {
+                byte(0x41);
+            }
+            byte(0x50 + (reg & 7));
+        }
+
+        void pop(int reg)
+        {
+            if (reg & 8)
+            {
+                byte(0x41);
+            }
+            byte(0x58 + (reg & 7));
+        }
+    };
+
+    //maps V registers to host registers for one block and emits its instructions
+    class BlockTranslator
+    {
+    private:
+        const uint8_t *memory;
+        bool xo_chip;
+        int memory_mask;
+        int host[16]; //host register of each V register, -1 while it is only in memory
+        bool dirty[16];
+        int used; //pool registers handed out
+        int ever_used; //pool registers used at any point, the callee saved ones are pushed
+
+        int get(int v, bool load)
+        {
+            if (host[v] < 0)
+            {
+                host[v] = pool[used++];
+                ever_used = used > ever_used ? used : ever_used;
+                if (load)
+                {
+                    body.mem({0x0F, 0xB6}, host[v], OFF_V + v);
+                }
+            }
+            return host[v];
+        }
+
+        int write(int v, bool load) //a register the instruction changes
+        {
+            dirty[v] = true;
+            return get(v, load);
+        }
+
+        void skip(Cond no_skip, int next)
+        {
+            //flags are set by the caller, movs leave them alone
+            body.store_pc(next);
+            int over = body.jcc(no_skip);
+            if (xo_chip)
+            {
+                //F000 NNNN is skipped as a whole, the bytes are checked now as the program may have changed them
+                body.store_pc((uint16_t) (next + 2));
+                body.byte(0x66);
+                body.mem({0x81}, ALU_CMP, OFF_MEMORY + next);
+                body.word(0x00F0);
+                int short_skip = body.jcc(CC_NE);
+                body.store_pc((uint16_t) (next + 4));
+                body.patch(short_skip);
+            }
+            else
+            {
+                body.store_pc((uint16_t) (next + 2));
+            }
+            body.patch(over);
+        }
+
+    public:
+        Emitter body;
+
+        BlockTranslator(const uint8_t *m, bool xo, int mask) : memory(m), xo_chip(xo), memory_mask(mask), used(0),
+                                                               ever_used(0)
+        {
+            for (int i = 0; i < 16; i++)
+            {
+                host[i] = -1;
+                dirty[i] = false;
+            }
+        }
+
+        void write_back()
+        {
+            for (int v = 0; v < 16; v++)
+            {
+                if (host[v] >= 0 && dirty[v])
+                {
+                    body.mem({0x88}, host[v], OFF_V + v, true);
+                }
+                host[v] = -1;
+                dirty[v] = false;
+            }
+            used = 0;
+        }
+
+        //false if the instruction is left to the interpreter or there are no host registers left for it
+        bool can_translate(int address, int opcode)
+        {
+            int x = (opcode & 0x0F00) >> 8, y = (opcode & 0x00F0) >> 4, nnn = opcode & 0x0FFF;
+            switch (decode(opcode))
+            {
+                case OP_INVALID:
+                case OP_CLS:
+                case OP_SCROLL_DOWN:
+                case OP_SCROLL_UP:
+                case OP_SCROLL_RIGHT:
+                case OP_SCROLL_LEFT:
+                case OP_LORES:
+                case OP_HIRES:
+                case OP_SAVE_RANGE:
+                case OP_JP_V0:
+                case OP_RND:
+                case OP_DRW:
+                case OP_AUDIO:
+                case OP_WAIT_KEY:
+                case OP_BCD:
+                case OP_STORE:
+                    return false;
+                case OP_JP:
+                    //delay timer polling loops are recognised by the interpreter
+                    return nnn + 4 != address;
+                default:
+                    break;
+            }
+            int needed = (1 << x) | (1 << y) | (1 << 15), missing = 0;
+            for (int v = 0; v < 16; v++)
+            {
+                missing += (needed >> v & 1) && host[v] < 0;
+            }
+            return used + missing <= POOL_SIZE;
+        }
+
+        //emits one instruction, returns true if it sets pc and ends the block
+        bool translate(int address, int opcode)
+        {
+            int x = (opcode & 0x0F00) >> 8, y = (opcode & 0x00F0) >> 4;
+            int nn = opcode & 0x00FF, nnn = opcode & 0x0FFF;
+            int next = (uint16_t) (address + 2);
+            bool quirk = x == 0xF || y == 0xF; //VF is written before VX, so the flag result changes the other result
+            switch (decode(opcode))
+            {
+                case OP_RET:
+                    //the stack is a ring of 16 like in the interpreter
+                    body.mem({0x0F, 0xB6}, RAX, OFF_SP);
+                    body.regs({0xFF}, 1, RAX, false); //dec eax
+                    body.and32_imm(RAX, 0xF);
+                    body.mem({0x88}, RAX, OFF_SP);
+                    body.mem({0x0F, 0xB7}, RAX, OFF_STACK, false, RAX, 1);
+                    body.byte(0x05); //add eax, 2
+                    body.dword(2);
+                    body.byte(0x66);
+                    body.mem({0x89}, RAX, OFF_PC);
+                    return true;
+
+                case OP_JP:
+                    if (nnn == address)
+                    {
+                        body.mem({0xC7}, 0, OFF_IDLE);
+                        body.dword(IDLE_HALT);
+                    }
+                    body.store_pc(nnn);
+                    return true;
+
+                case OP_CALL:
+                    body.mem({0x0F, 0xB6}, RAX, OFF_SP);
+                    body.and32_imm(RAX, 0xF);
+                    body.byte(0x66);
+                    body.mem({0xC7}, 0, OFF_STACK, false, RAX, 1);
+                    body.word(address);
+                    body.regs({0xFF}, 0, RAX, false); //inc eax
+                    body.and32_imm(RAX, 0xF);
+                    body.mem({0x88}, RAX, OFF_SP);
+                    body.store_pc(nnn);
+                    return true;
+
+                case OP_SE_BYTE:
+                case OP_SNE_BYTE:
+                    body.alu8_imm(ALU_CMP, get(x, true), nn);
+                    skip(decode(opcode) == OP_SE_BYTE ? CC_NE : CC_E, next);
+                    return true;
+
+                case OP_SE_REG:
+                case OP_SNE_REG:
+                    body.alu8(ALU_CMP, get(x, true), get(y, true));
+                    skip(decode(opcode) == OP_SE_REG ? CC_NE : CC_E, next);
+                    return true;
+
+                case OP_SKP:
+                case OP_SKNP:
+                    body.mov32(RAX, get(x, true));
+                    body.and32_imm(RAX, 0xF); //only the low nibble of VX picks the key
+                    body.byte(0x66);
+                    body.mem({0x0F, 0xA3}, RAX, OFF_KEYPAD); //bt word [keypad], ax puts the key in the carry
+                    skip(decode(opcode) == OP_SKP ? CC_AE : CC_B, next);
+                    return true;
+
+                case OP_LOAD_RANGE:
+                case OP_LOAD:
+                {
+                    //touches up to all 16 registers, so they go through memory
+                    int first = decode(opcode) == OP_LOAD ? 0 : x, last = decode(opcode) == OP_LOAD ? x : y;
+                    int step = first <= last ? 1 : -1;
+                    write_back();
+                    for (int i = 0; i <= (last - first) * step; i++)
+                    {
+                        body.mem({0x0F, 0xB7}, RAX, OFF_I);
+                        if (i != 0)
+                        {
+                            body.byte(0x05);
+                            body.dword(i);
+                        }
+                        body.byte(0x25); //and eax, the address wraps like in the interpreter
+                        body.dword(memory_mask);
+                        body.mem({0x0F, 0xB6}, RCX, OFF_MEMORY, false, RAX, 0);
+                        body.mem({0x88}, RCX, OFF_V + first + i * step, true);
+                    }
+                    if (decode(opcode) == OP_LOAD)
+                    {
+                        body.mem({0x0F, 0xB7}, RAX, OFF_I);
+                        body.byte(0x05);
+                        body.dword(x + 1);
+                        body.byte(0x66);
+                        body.mem({0x89}, RAX, OFF_I);
+                    }
+                    return false;
+                }
+
+                case OP_LD_BYTE:
+                    body.mov_imm(write(x, false), nn);
+                    return false;
+
+                case OP_ADD_BYTE:
+                    body.alu8_imm(ALU_ADD, write(x, true), nn);
+                    return false;
+
+                case OP_LD_REG:
+                {
+                    int src = get(y, true);
+                    body.mov32(write(x, false), src);
+                    return false;
+                }
+
+                case OP_OR:
+                case OP_AND:
+                case OP_XOR:
+                {
+                    Op op = decode(opcode);
+                    int src = get(y, true), dst = write(x, true);
+                    body.alu8(op == OP_OR ? ALU_OR : op == OP_AND ? ALU_AND : ALU_XOR, dst, src);
+                    body.mov_imm(write(15, false), 0);
+                    return false;
+                }
+
+                case OP_ADD_REG:
+                {
+                    int src = get(y, true), dst = write(x, true), vf = write(15, true);
+                    if (quirk)
+                    {
+                        body.mov32(RCX, dst);
+                        body.alu8(ALU_ADD, RCX, src);
+                        body.setcc(CC_B, RCX);
+                        body.movzx8(vf, RCX);
+                        body.alu8(ALU_ADD, dst, src);
+                    }
+                    else
+                    {
+                        body.alu8(ALU_ADD, dst, src);
+                        body.setcc(CC_B, vf);
+                    }
+                    return false;
+                }
+
+                case OP_SUB:
+                {
+                    int src = get(y, true), dst = write(x, true), vf = write(15, true);
+                    if (quirk)
+                    {
+                        body.alu8(ALU_CMP, dst, src);
+                        body.setcc(CC_AE, RCX);
+                        body.movzx8(vf, RCX);
+                        body.alu8(ALU_SUB, dst, src);
+                    }
+                    else
+                    {
+                        body.alu8(ALU_SUB, dst, src);
+                        body.setcc(CC_AE, vf);
+                    }
+                    return false;
+                }
+
+                case OP_SUBN:
+                {
+                    int src = get(y, true), dst = write(x, true), vf = write(15, true);
+                    if (quirk)
+                    {
+                        body.alu8(ALU_CMP, dst, src);
+                        body.setcc(CC_BE, RCX);
+                        body.movzx8(vf, RCX);
+                    }
+                    body.mov32(RCX, src);
+                    body.alu8(ALU_SUB, RCX, dst);
+                    if (!quirk)
+                    {
+                        body.setcc(CC_AE, vf);
+                    }
+                    body.movzx8(dst, RCX);
+                    return false;
+                }
+
+                case OP_SHR:
+                case OP_SHL:
+                {
+                    int shift = decode(opcode) == OP_SHR ? 5 : 4;
+                    int dst = write(x, true), vf = write(15, true);
+                    if (x == 0xF)
+                    {
+                        //VF gets the shifted out bit and is then shifted itself
+                        if (shift == 5)
+                        {
+                            body.regs({0x81}, ALU_AND, vf, false);
+                            body.dword(1);
+                        }
+                        else
+                        {
+                            body.regs({0xC1}, 5, vf, false); //shr vf, 7
+                            body.byte(7);
+                        }
+                        body.regs({0xD0}, shift, vf, true);
+                    }
+                    else
+                    {
+                        body.regs({0xD0}, shift, dst, true);
+                        body.setcc(CC_B, vf);
+                    }
+                    return false;
+                }
+
+                case OP_LD_I:
+                case OP_LD_I_LONG:
+                    body.byte(0x66);
+                    body.mem({0xC7}, 0, OFF_I);
+                    body.word(decode(opcode) == OP_LD_I ? nnn :
+                              (memory[(uint16_t) (address + 2)] << 8) | memory[(uint16_t) (address + 3)]);
+                    return false;
+
+                case OP_PLANE:
+                    body.mem({0xC6}, 0, OFF_PLANE_MASK);
+                    body.byte(x & 3);
+                    return false;
+
+                case OP_GET_DELAY:
+                    body.mem({0x0F, 0xB6}, write(x, false), OFF_DELAY);
+                    return false;
+
+                case OP_SET_DELAY:
+                case OP_SET_SOUND:
+                case OP_PITCH:
+                {
+                    Op op = decode(opcode);
+                    body.mem({0x88}, get(x, true), op == OP_SET_DELAY ? OFF_DELAY : op == OP_SET_SOUND ? OFF_SOUND :
+                                                                                  OFF_AUDIO_PITCH, true);
+                    return false;
+                }
+
+                case OP_ADD_I:
+                {
+                    int src = get(x, true), vf = write(15, true);
+                    body.mem({0x0F, 0xB7}, RAX, OFF_I);
+                    body.mov32(RCX, RAX);
+                    body.regs({0x01}, src, RCX, false); //add ecx, src
+                    body.regs({0x81}, ALU_CMP, RCX, false);
+                    body.dword(0xFFF);
+                    body.setcc(CC_A, vf);
+                    body.regs({0x01}, src, RAX, false); //reads VF again when X is F
+                    body.byte(0x66);
+                    body.mem({0x89}, RAX, OFF_I);
+                    return false;
+                }
+
+                case OP_FONT:
+                {
+                    int src = get(x, true);
+                    //lea eax, [src + src * 4]
+                    if (src & 8)
+                    {
+                        body.byte(0x43);
+                    }
+                    body.byte(0x8D);
+                    body.byte(0x44);
+                    body.byte(2 << 6 | (src & 7) << 3 | (src & 7));
+                    body.byte(0);
+                    body.byte(0x66);
+                    body.mem({0x89}, RAX, OFF_I);
+                    return false;
+                }
+
+                default:
+                    return false;
+            }
+        }
+
+        std::vector<int> callee_saved() //pool registers the block used that it has to preserve
+        {
+            std::vector<int> saved;
+            for (int i = 0; i < ever_used; i++)
+            {
+                if (pool[i] == RBX || pool[i] == RBP || pool[i] >= R12)
+                {
+                    saved.push_back(pool[i]);
+                }
+            }
+            return saved;
+        }
+    };
+}
+
+Jit::Jit(bool xo) : arena_used(0), xo_chip(xo)
+{
+    void *memory = mmap(nullptr, ARENA_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    arena = memory == MAP_FAILED ? nullptr : (uint8_t *) memory;
+    hits.assign(65536, 0);
+    flush();
+}
+
+bool Jit::is_supported()
+{
+#if defined(__x86_64__) && !defined(_WIN32)
+    return true;
+#else
+    return false;
+#endif
+}
+
+void Jit::flush()
+{
+    blocks.clear();
+    block_at.assign(65536, NOT_TRANSLATED);
+    code.assign(65536, 0);
+    arena_used = 0;
+}
+
+int Jit::translate(const Chip8State *s, uint16_t start)
+{
+    BlockTranslator translator(s->memory, xo_chip, s->memory_mask);
+    int address = start, count = 0;
+    bool ended = false;
+    //stopping short of the top of memory keeps address wrap around out of the generated code
+    while (!ended && count < MAX_BLOCK && address <= s->memory_mask - 7 && arena != nullptr)
+    {
+        int opcode = (s->memory[address] << 8) | s->memory[address + 1];
+        if (!translator.can_translate(address, opcode))
+        {
+            break;
+        }
+        ended = translator.translate(address, opcode);
+        address += decode(opcode) == OP_LD_I_LONG ? 4 : 2;
+        count++;
+    }
+    if (count == 0)
+    {
+        return NO_BLOCK;
+    }
+    if (!ended)
+    {
+        translator.body.store_pc(address);
+    }
+    translator.write_back();
+
+    Emitter block;
+    std::vector<int> saved = translator.callee_saved();
+    for (size_t i = 0; i < saved.size(); i++)
+    {
+        block.push(saved[i]);
+    }
+    block.code.insert(block.code.end(), translator.body.code.begin(), translator.body.code.end());
+    for (size_t i = saved.size(); i > 0; i--)
+    {
+        block.pop(saved[i - 1]);
+    }
+    block.byte(0xC3); //ret
+
+    if (arena_used + block.code.size() > ARENA_SIZE)
+    {
+        flush();
+    }
+    Block b;
+    b.code = (BlockCode) (arena + arena_used);
+    b.start = start;
+    b.end = (uint16_t) address;
+    b.count = count;
+    memcpy(arena + arena_used, block.code.data(), block.code.size());
+    arena_used += block.code.size();
+    for (int i = start; i < address; i++)
+    {
+        code[i] = 1;
+    }
+    blocks.push_back(b);
+    return (int) blocks.size() - 1;
+}
+
+int Jit::run(Chip8State *s, int cycles)
+{
+    int done = 0;
+    while (s->idle_state == IDLE_NONE)
+    {
+        uint16_t pc = s->pc;
+        int b = block_at[pc];
+        if (b == NOT_TRANSLATED)
+        {
+            if (++hits[pc] < HOT)
+            {
+                return done;
+            }
+            hits[pc] = 0;
+            b = translate(s, pc);
+            block_at[pc] = b;
+        }
+        if (b == NO_BLOCK || blocks[b].count > cycles - done)
+        {
+            return done;
+        }
+        blocks[b].code(s);
+        done += blocks[b].count;
+    }
+    return done;
+}
+
+void Jit::invalidate(uint16_t address, int length)
+{
+    for (int i = 0; i < length; i++)
+    {
+        uint16_t written = (uint16_t) (address + i);
+        //an instruction left to the interpreter may have become one that can be translated
+        for (int start = written - 1; start <= written; start++)
+        {
+            if (start >= 0 && block_at[start] == NO_BLOCK)
+            {
+                block_at[start] = NOT_TRANSLATED;
+            }
+        }
+        if (!code[written])
+        {
+            continue;
+        }
+        for (size_t b = 0; b < blocks.size(); b++)
+        {
+            if (written >= blocks[b].start && written < blocks[b].end && block_at[blocks[b].start] == (int) b)
+            {
+                block_at[blocks[b].start] = NOT_TRANSLATED;
+            }
+        }
+        code[written] = 0;
+    }
+}
+
+Jit::~Jit()
+{
+    if (arena != nullptr)
+    {
+        munmap(arena, ARENA_SIZE);
+    }
+}
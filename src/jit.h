@@ -0,0 +1,57 @@
+//
+// Translates hot blocks to x86-64 machine code at run time
+//
+
+#ifndef CHIP8_JIT_H
+#define CHIP8_JIT_H
+
+
+#include <cstdint>
+#include <vector>
+#include "chip8_state.h"
+
+class Jit
+{
+private:
+    typedef void (*BlockCode)(Chip8State *);
+
+    struct Block
+    {
+        BlockCode code;
+        uint16_t start, end; //bytes the block was translated from
+        int count; //instructions it runs
+    };
+
+    enum
+    {
+        NOT_TRANSLATED = -1, //not run often enough yet, or its code changed
+        NO_BLOCK = -2 //starts with an instruction left to the interpreter
+    };
+
+    uint8_t *arena; //executable memory, filled from the start and thrown away as a whole when full
+    size_t arena_used;
+    std::vector<Block> blocks;
+    std::vector<int> block_at; //index into blocks for every address, or one of the values above
+    std::vector<uint8_t> hits; //times each address was reached without a block
+    std::vector<uint8_t> code; //addresses covered by at least one block
+    bool xo_chip;
+
+    int translate(const Chip8State *, uint16_t); //returns the new block or NO_BLOCK
+    void flush();
+
+public:
+    Jit(bool); //XO-CHIP mode
+
+    static bool is_supported(); //false on hosts that can't run the generated code
+
+    //runs translated blocks from pc until it reaches one the interpreter has to run, a block longer than the
+    //remaining budget or an idle loop. Returns the number of instructions executed
+    int run(Chip8State *, int);
+
+    void invalidate(uint16_t, int); //drops blocks translated from bytes the program wrote to
+
+    ~Jit();
+};
+
+
+#endif //CHIP8_JIT_H
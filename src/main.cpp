@@ -1,30 +1,281 @@
+#include <pthread.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstring>
+#include <fstream>
 #include <iostream>
-#include <zconf.h>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <cstdlib>
+#include <thread>
 #include <SDL_video.h>
 #include <SDL_render.h>
 #include <SDL_events.h>
 #include <SDL.h>
+#include "aot.h"
+#include "audio.h"
 #include "chip8.h"
+#include "debugger.h"
+#include "expand.h"
+#include "gdb_stub.h"
+#include "histogram.h"
+#include "overlay.h"
+#include "spsc_queue.h"
+#include "surface_display.h"
+#include "trace.h"
+#include "triple_buffer.h"
 
-uint8_t keymap[16] = {
-        SDLK_x,
-        SDLK_1,
-        SDLK_2,
-        SDLK_3,
-        SDLK_q,
-        SDLK_w,
-        SDLK_e,
-        SDLK_a,
-        SDLK_s,
-        SDLK_d,
-        SDLK_z,
-        SDLK_c,
-        SDLK_4,
-        SDLK_r,
-        SDLK_f,
-        SDLK_v,
+//SDL scancode names of the keys for CHIP-8 keys 0 to F, the left side of a QWERTY keyboard. Scancodes are positions,
+//so the layout stays the same shape on other keyboards
+const char *default_bindings[16] = {"X", "1", "2", "3", "Q", "W", "E", "A", "S", "D", "Z", "C", "4", "R", "F", "V"};
+
+//CHIP-8 key for every scancode, -1 for the ones that aren't bound, so a key event is a single lookup
+int8_t key_for_scancode[SDL_NUM_SCANCODES];
+
+void bind_default_keys()
+{
+    memset(key_for_scancode, -1, sizeof(key_for_scancode));
+    for (int key = 0; key < 16; key++)
+    {
+        key_for_scancode[SDL_GetScancodeFromName(default_bindings[key])] = (int8_t) key;
+    }
+}
+
+//replaces the bindings with the ones in a file of "<hex key> <scancode name>" lines, a key can have several. Blank
+//lines and lines starting with # are skipped. Returns false, naming the bad line, if the file can't be used
+bool load_bindings(const char *path)
+{
+    std::ifstream file(path);
+    if (!file.is_open())
+    {
+        std::cerr << "Could not open " << path << std::endl;
+        return false;
+    }
+    memset(key_for_scancode, -1, sizeof(key_for_scancode));
+    std::string line;
+    for (int number = 1; getline(file, line); number++)
+    {
+        std::istringstream in(line);
+        std::string key, name;
+        if (!(in >> key) || key[0] == '#')
+        {
+            continue;
+        }
+        getline(in >> std::ws, name);
+        char *end;
+        long value = strtol(key.c_str(), &end, 16);
+        SDL_Scancode scancode = SDL_GetScancodeFromName(name.c_str());
+        if (*end != '\0' || value < 0 || value > 15 || scancode == SDL_SCANCODE_UNKNOWN)
+        {
+            std::cerr << path << ":" << number << ": expected a key from 0 to F and a key name, got \"" << line
+                      << "\"\n";
+            return false;
+        }
+        key_for_scancode[scancode] = (int8_t) value;
+    }
+    return true;
+}
+
+//colours for each combination of the two XO-CHIP planes, plain CHIP-8 only uses the first two. Set with -palette
+uint32_t palette[4] = {
+        0xFF000000,
+        0xFFFFFFFF,
+        0xFFAAAAAA,
+        0xFF555555,
+};
+
+//a finished frame on its way from the emulation thread to the render thread, still packed like Chip8State::display
+struct Frame
+{
+    int width, height;
+    uint64_t planes[2][64][2];
+    //running totals for the overlay, which takes the difference between two frames
+    uint64_t instructions;
+    Uint64 emulate_ticks, sleep_ticks; //performance counter ticks spent running frames and waiting for the next
 };
 
+//the keypad after a key went down or up, stamped with the performance counter when the window thread saw it
+struct KeyEvent
+{
+    Uint64 time;
+    uint16_t keys;
+};
+
+const int MAX_RUN_AHEAD = 8; //frames, more than any game's input lag
+const double MIN_SPEED = 0.01, MAX_SPEED = 1000.0; //multiples of real time, -speed 0 runs uncapped instead
+
+//reads 4 comma separated RRGGBB colours into palette, returns false if the list is malformed
+bool parse_palette(const char *list)
+{
+    uint32_t colours[4];
+    for (int i = 0; i < 4; i++)
+    {
+        char *end;
+        colours[i] = 0xFF000000 | (uint32_t) strtoul(list, &end, 16);
+        if (end - list != 6 || *end != (i == 3 ? '\0' : ','))
+        {
+            return false;
+        }
+        list = end + 1;
+    }
+    memcpy(palette, colours, sizeof(palette));
+    return true;
+}
+
+//reads a multiple of real time of at least MIN_SPEED, or 0 for as fast as possible. Returns false if it isn't one
+bool parse_speed(const char *text, double &speed)
+{
+    char *end;
+    double value = strtod(text, &end);
+    if (end == text || *end != '\0' || !(value == 0.0 || (value >= MIN_SPEED && value <= MAX_SPEED)))
+    {
+        return false;
+    }
+    speed = value;
+    return true;
+}
+
+//keeps a thread on one CPU so the scheduler doesn't move it away from its warm caches, returns false if it can't
+bool pin_thread(std::thread &thread, int cpu)
+{
+#ifdef __linux__
+    if (cpu >= CPU_SETSIZE)
+    {
+        return false;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set) == 0;
+#else
+    (void) thread;
+    (void) cpu;
+    return false;
+#endif
+}
+
+//distributions printed by -stats, in nanoseconds. Each is written by one thread
+Histogram frame_intervals; //emulation thread, start of one frame to the next while nothing holds it up
+Histogram batch_times; //emulation thread, running a frame's instructions
+Histogram input_latencies; //emulation thread, a key event to the end of the instructions it was made in
+Histogram present_times; //window thread, drawing and presenting a frame
+std::atomic<bool> stats_requested(false); //set by SIGUSR1, the emulation thread prints at its next frame
+
+void print_stats()
+{
+    Histogram *histograms[] = {&frame_intervals, &batch_times, &input_latencies, &present_times};
+    const char *names[] = {"frame interval", "instructions", "input latency", "present"};
+    printf("%-16s %9s %9s %9s %9s %9s %9s\n", "milliseconds", "count", "p50", "p90", "p99", "p99.9", "max");
+    for (int i = 0; i < 4; i++)
+    {
+        Histogram &histogram = *histograms[i];
+        printf("%-16s %9llu %9.3f %9.3f %9.3f %9.3f %9.3f\n", names[i], (unsigned long long) histogram.count(),
+               histogram.percentile(0.5) / 1e6, histogram.percentile(0.9) / 1e6, histogram.percentile(0.99) / 1e6,
+               histogram.percentile(0.999) / 1e6, histogram.max() / 1e6);
+    }
+    fflush(stdout);
+}
+
+void request_stats(int)
+{
+    stats_requested = true;
+}
+
+#ifdef CHIP8_TRACE
+const char *trace_path = nullptr; //set by -trace, the timeline is written there on exit
+
+void write_trace()
+{
+    if (!trace_write(trace_path))
+    {
+        std::cerr << "Could not write the trace to " << trace_path << std::endl;
+    }
+}
+#endif
+
+//reads a debugger command from stdin, returns true if the program should run again
+bool debugger_prompt(Debugger &debugger)
+{
+    std::string line, command;
+    std::cout << "> " << std::flush;
+    if (!getline(std::cin, line) || (!line.empty() && line[0] == 27) || line == "q") //esc or quit
+    {
+        exit(0);
+    }
+
+    std::istringstream in(line);
+    in >> command;
+    if (command.empty() || command == "s")
+    {
+        debugger.step();
+        return true;
+    }
+    if (command == "n")
+    {
+        debugger.step_over();
+        return true;
+    }
+    if (command == "f")
+    {
+        if (!debugger.step_out())
+        {
+            std::cout << "Not in a subroutine\n";
+            return false;
+        }
+        return true;
+    }
+    if (command == "c")
+    {
+        return true;
+    }
+    if (command == "p")
+    {
+        debugger.print_state();
+        return false;
+    }
+    if (command == "d")
+    {
+        debugger.clear_all();
+        return false;
+    }
+
+    std::string arg;
+    int length = 1;
+    in >> arg >> length;
+    char *end;
+    long value = strtol(arg.c_str(), &end, 16);
+    if (command == "b" && !arg.empty() && *end == '\0')
+    {
+        debugger.set_breakpoint((uint16_t) value, !debugger.has_breakpoint((uint16_t) value));
+        std::cout << (debugger.has_breakpoint((uint16_t) value) ? "Breakpoint set\n" : "Breakpoint removed\n");
+        return false;
+    }
+    if (command == "w" && !arg.empty() && *end == '\0')
+    {
+        debugger.set_watchpoint((uint16_t) value, length, true);
+        return false;
+    }
+    if (command == "r" && (arg == "I" || arg == "i"))
+    {
+        debugger.set_register_watch(16, true);
+        return false;
+    }
+    if (command == "r" && arg.size() == 1 && *end == '\0')
+    {
+        debugger.set_register_watch((int) value, true);
+        return false;
+    }
+
+    std::cout << "Commands: enter or s - step, n - step over call, f - run to return, c - continue, p - print registers\n"
+              << "b <addr> - toggle breakpoint, w <addr> [len] - watch memory, r <X or I> - watch register, "
+              << "d - delete all breakpoints and watchpoints, q - quit\n";
+    return false;
+}
+
 int main(int argc, char *argv[])
 {
 
@@ -39,9 +290,34 @@ int main(int argc, char *argv[])
         //print the help menu
         std::cout << "Normal usage: ./Chip8_Emulator <path_to_rom>\n"
                   << "By default,audio is on. You can disable it by adding -a\n"
+                  << "Add -x to run XO-CHIP ROMs with 64k of memory\n"
+                  << "Add -c <n> to run n instructions per 60Hz frame, the default is 11\n"
+                  << "Add -aot <library> to run the ROM translated by chip8_aot\n"
+                  << "Add -j to translate hot code to x86-64 at run time\n"
+                  << "Add -i to skip invalid opcodes instead of halting on the first one\n"
+                  << "Add -sync to pace emulation by the audio device clock instead of sleeping\n"
+                  << "Add -p <cpu> to keep the emulation thread on one CPU\n"
+                  << "Add -speed <multiple> to run faster or slower than real time, 0 runs as fast as possible. "
+                  << "Holding Tab also runs as fast as possible, unless -keys binds it\n"
+                  << "Add -overlay to show frame rate and timing numbers, F1 shows and hides them\n"
+                  << "Add -stats to print percentiles of frame, instruction, input and present times on exit, and "
+                  << "on SIGUSR1\n"
+                  << "Add -ahead <n> to show each frame as it will be n frames later, hiding games' input lag\n"
+                  << "Add -keys <file> to load key bindings, lines of a key from 0 to F and an SDL key name\n"
+                  << "Add -soft to draw into the window surface without a renderer, the default when SDL only has "
+                  << "its software renderer\n"
+                  << "Add -palette <RRGGBB,RRGGBB,RRGGBB,RRGGBB> to change the colours, the last two are only used "
+                  << "by XO-CHIP ROMs\n"
+#ifdef CHIP8_TRACE
+                  << "Add -trace <file> to write a timeline of the emulation and window threads on exit, open it in "
+                  << "chrome://tracing or ui.perfetto.dev\n"
+#endif
                   << "Other modes are also available\n"
                   << "1. Single step mode:\n"
                   << "Type -s flag to execute one instruction at a time waiting for you to press enter after each cycle\n"
+                  << "Type h in single step mode to list the other debugger commands\n"
+                  << "Add -b <hex address> to run until the instruction at that address, then single step\n"
+                  << "Add -g <port> to let gdb attach with 'target remote localhost:<port>'\n"
                   << "2. Trace mode:\n"
                   << "Type -t to print the program counter, register values and opcode executed each cycle. "
                   << "It follows this pattern:\n"
@@ -50,14 +326,23 @@ int main(int argc, char *argv[])
     }
 
     Chip8 chip8;
-    if (!chip8.load_rom(argv[1])) //loading ROM provided as argument
-    {
-        std::cerr << "ROM could not be loaded. Possibly invalid path given\n";
-        exit(1);
-    }
-
-
-    bool trace_mode = false, single_step_mode = false, audio_on = true;
+    Debugger debugger(chip8);
+    GdbStub gdb(chip8, debugger);
+    int gdb_port = 0;
+    const char *aot_path = nullptr;
+    bool use_jit = false;
+    bool skip_faults = false;
+    bool audio_sync = false;
+    int pin_cpu = -1;
+    double speed = 1.0; //multiple of real time, 0 for as fast as possible
+    int run_ahead = 0; //frames emulated past the current one and thrown away each frame, only the display is kept
+    bool soft_display = false;
+    bool show_overlay = false;
+    bool show_stats = false;
+    const char *bindings_path = nullptr;
+    bool trace_mode = false, audio_on = true;
+    bool debugging = false, stopped = false; //stopped is true while the debugger waits for a command
+    int cycles_per_frame = 11; //close to the 1.5ms per instruction the emulator used to sleep for
     if (argc > 2) //there are flags
     {
         for (int i = 2; i < argc; i++)
@@ -68,12 +353,86 @@ int main(int argc, char *argv[])
             }
             else if (strcmp(argv[i], "-s") == 0) //single step mode
             {
-                single_step_mode = true;
+                debugging = true;
+                stopped = true;
+            }
+            else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc)
+            {
+                debugging = true;
+                debugger.set_breakpoint((uint16_t) strtol(argv[++i], NULL, 16), true);
+            }
+            else if (strcmp(argv[i], "-g") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0)
+            {
+                debugging = true;
+                gdb_port = atoi(argv[++i]);
             }
             else if (strcmp(argv[i], "-a") == 0)
             {
                 audio_on = false;
             }
+            else if (strcmp(argv[i], "-x") == 0)
+            {
+                chip8.set_xo_chip(true);
+            }
+            else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0)
+            {
+                cycles_per_frame = atoi(argv[++i]);
+            }
+            else if (strcmp(argv[i], "-aot") == 0 && i + 1 < argc)
+            {
+                aot_path = argv[++i];
+            }
+            else if (strcmp(argv[i], "-j") == 0)
+            {
+                use_jit = true;
+            }
+            else if (strcmp(argv[i], "-i") == 0)
+            {
+                skip_faults = true;
+            }
+            else if (strcmp(argv[i], "-sync") == 0)
+            {
+                audio_sync = true;
+            }
+            else if (strcmp(argv[i], "-palette") == 0 && i + 1 < argc && parse_palette(argv[i + 1]))
+            {
+                i++;
+            }
+            else if (strcmp(argv[i], "-keys") == 0 && i + 1 < argc)
+            {
+                bindings_path = argv[++i];
+            }
+            else if (strcmp(argv[i], "-soft") == 0)
+            {
+                soft_display = true;
+            }
+            else if (strcmp(argv[i], "-overlay") == 0)
+            {
+                show_overlay = true;
+            }
+            else if (strcmp(argv[i], "-stats") == 0)
+            {
+                show_stats = true;
+            }
+#ifdef CHIP8_TRACE
+            else if (strcmp(argv[i], "-trace") == 0 && i + 1 < argc)
+            {
+                trace_path = argv[++i];
+            }
+#endif
+            else if (strcmp(argv[i], "-speed") == 0 && i + 1 < argc && parse_speed(argv[i + 1], speed))
+            {
+                i++;
+            }
+            else if (strcmp(argv[i], "-ahead") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0 &&
+                     atoi(argv[i + 1]) <= MAX_RUN_AHEAD)
+            {
+                run_ahead = atoi(argv[++i]);
+            }
+            else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc && atoi(argv[i + 1]) >= 0)
+            {
+                pin_cpu = atoi(argv[++i]);
+            }
             else
             {
                 std::cerr << "Invalid flags given. Type -help to check usage\n";
@@ -82,6 +441,59 @@ int main(int argc, char *argv[])
         }
     }
 
+    if (show_stats)
+    {
+        atexit(print_stats);
+#ifdef SIGUSR1
+        signal(SIGUSR1, request_stats);
+#endif
+    }
+
+#ifdef CHIP8_TRACE
+    if (trace_path != nullptr)
+    {
+        atexit(write_trace); //every way out of the emulator goes through exit
+    }
+#endif
+
+    if (!chip8.load_rom(argv[1])) //loading ROM provided as argument
+    {
+        std::cerr << "ROM could not be loaded. Possibly invalid path given\n";
+        exit(1);
+    }
+
+    //only the first fault is reported, a broken ROM would otherwise print a line for every instruction it runs
+    int fault_count = 0;
+    FaultHandler report_fault = [&](const Chip8Fault &fault)
+    {
+        if (fault_count++ == 0)
+        {
+            fprintf(stderr, "Invalid opcode %.4X at %.4X, %s\n", fault.opcode, fault.pc,
+                    skip_faults ? "skipping it and any others" : "halted");
+        }
+        return skip_faults ? FAULT_SKIP : FAULT_HALT;
+    };
+    chip8.set_fault_policy(FAULT_CALLBACK, report_fault);
+
+    if (use_jit && !chip8.set_jit(true))
+    {
+        std::cerr << "The JIT only runs on x86-64, using the interpreter\n";
+    }
+
+    if (aot_path != nullptr)
+    {
+        const AotProgram *program = load_aot_program(aot_path);
+        if (program == nullptr)
+        {
+            exit(1);
+        }
+        if (!chip8.set_aot_program(program))
+        {
+            std::cerr << aot_path << " was translated from a different ROM or without matching -x\n";
+            exit(1);
+        }
+    }
+
     //set up SDL
     SDL_Window *window;
     SDL_Renderer *renderer;
@@ -95,6 +507,13 @@ int main(int argc, char *argv[])
         exit(1);
     }
 
+    bind_default_keys();
+    if (bindings_path != nullptr && !load_bindings(bindings_path))
+    {
+        SDL_Quit();
+        exit(1);
+    }
+
     window = SDL_CreateWindow("Chip8 Emulator", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, wt, ht,
                               SDL_WINDOW_SHOWN);
 
@@ -105,99 +524,529 @@ int main(int argc, char *argv[])
         exit(1);
     }
 
-    renderer = SDL_CreateRenderer(window, -1, 0);
-    if (renderer == nullptr)
+    //SDL's software renderer scales the texture slower than frames are emulated, so when it is all there is the
+    //frames are drawn into the window surface instead. It can't be used while the window has a renderer
+    SurfaceDisplay surface_display(window);
+    renderer = nullptr;
+    texture = nullptr;
+    if (!soft_display)
     {
-        std::cerr << "Error in initializing rendering " << SDL_GetError() << std::endl;
-        SDL_Quit();
-        exit(1);
+        renderer = SDL_CreateRenderer(window, -1, 0);
+        SDL_RendererInfo info;
+        if (renderer != nullptr && SDL_GetRendererInfo(renderer, &info) == 0 && (info.flags & SDL_RENDERER_SOFTWARE))
+        {
+            SDL_DestroyRenderer(renderer);
+            renderer = nullptr;
+            soft_display = true;
+        }
+    }
+    if (soft_display && !surface_display.open())
+    {
+        soft_display = false;
     }
 
-    SDL_RenderSetLogicalSize(renderer, wt, ht);
+    if (!soft_display)
+    {
+        if (renderer == nullptr)
+        {
+            renderer = SDL_CreateRenderer(window, -1, 0);
+        }
+        if (renderer == nullptr)
+        {
+            std::cerr << "Error in initializing rendering " << SDL_GetError() << std::endl;
+            SDL_Quit();
+            exit(1);
+        }
 
-    texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, 64, 32);
-    if (texture == nullptr)
+        SDL_RenderSetLogicalSize(renderer, wt, ht);
+
+        //big enough for high resolution mode, low resolution only uses the top left 64*32
+        texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, 128, 64);
+        if (texture == nullptr)
+        {
+            std::cerr << "Error in setting up texture " << SDL_GetError() << std::endl;
+            SDL_Quit();
+            exit(1);
+        }
+    }
+
+    Audio audio;
+    if ((audio_on || audio_sync) && !audio.open())
     {
-        std::cerr << "Error in setting up texture " << SDL_GetError() << std::endl;
+        std::cerr << "Could not open audio, running without sound " << SDL_GetError() << std::endl;
+    }
+    audio_sync = audio_sync && audio.is_open();
+
+    if (gdb_port != 0 && !gdb.start(gdb_port))
+    {
+        std::cerr << "Could not listen for gdb on port " << gdb_port << std::endl;
         SDL_Quit();
         exit(1);
     }
 
-    while (true)
+    //the emulation thread owns the Chip8 from here on. It hands finished frames to this thread, which owns SDL,
+    //through a triple buffer and gets every change of the keypad back through a queue, so a slow present never
+    //holds up emulation
+    TripleBuffer<Frame> frames;
+    uint16_t keys = 0; //bit n is set while key n is held, only used by this thread
+    SpscQueue<KeyEvent, 256> key_events;
+    std::atomic<bool> keys_dropped(false); //key_events was full, the emulation thread takes the keypad as it is now
+    std::atomic<bool> turbo(false); //Tab is held, emulation runs as fast as it can
+    std::atomic<bool> overlay_on(show_overlay); //frames are published every frame for the overlay's numbers
+    std::atomic<bool> frame_pending(false); //a frame event is in the SDL queue and hasn't been handled
+    std::mutex input_mutex;
+    std::condition_variable input_changed; //wakes an emulation thread that is waiting for a key
+    Uint32 frame_event = SDL_RegisterEvents(1);
+
+    //faster than real time there are more frames than the display can show, the ones in between are skipped
+    SDL_DisplayMode mode;
+    int refresh_rate = 60;
+    if (SDL_GetCurrentDisplayMode(SDL_GetWindowDisplayIndex(window), &mode) == 0 && mode.refresh_rate > 0)
+    {
+        refresh_rate = mode.refresh_rate;
+    }
+    const Uint64 refresh_ticks = SDL_GetPerformanceFrequency() / refresh_rate;
+
+    std::thread emulation([&]()
     {
-        chip8.single_cycle(trace_mode, audio_on);
+        TRACE_THREAD("emulation");
+        Uint64 next_frame = SDL_GetPerformanceCounter();
+        int frame_cycles = 0; //instructions run so far in the current frame
+        //emulated time in 60Hz frames divided by the speed, so it follows real time. The audio edges are stamped with
+        //it and -sync paces by it, a fast forwarded beep is shorter instead of piling up in the audio queue
+        double audio_frames = 0.0;
+        Uint64 last_shown = 0; //when the last frame was published
+        bool unshown = false; //a frame was drawn since then but skipped
+        uint64_t instructions = 0; //totals handed to the overlay with each frame
+        Uint64 emulate_ticks = 0, sleep_ticks = 0;
+        Uint64 last_start = SDL_GetPerformanceCounter();
+        std::unique_ptr<Chip8State> snapshot(new Chip8State()); //the real machine while run ahead emulates past it
+        const double ns_per_tick = 1e9 / SDL_GetPerformanceFrequency();
+        bool steady = false; //the last frame ran at the chosen speed without waiting on input, gdb or the debugger
+        Uint64 key_times[256]; //when the key events made in this frame came in
 
-        SDL_Event event;
-        while (SDL_PollEvent(&event))
+        while (true)
         {
-            if (event.type == SDL_QUIT)
+            //the key events that came in since the last frame started are made at the same points of this frame, a
+            //fixed frame late instead of at whichever frame boundary the window thread got them in before. A key
+            //tapped within one frame is pressed for part of the next one. The debugger takes them at once
+            Uint64 start = SDL_GetPerformanceCounter();
+            double rate = turbo ? 0.0 : speed; //multiple of real time for this frame, 0 for as fast as possible
+            //performance counter ticks per emulated frame, 0 when uncapped
+            Uint64 frame_ticks = rate > 0.0 ? (Uint64) (SDL_GetPerformanceFrequency() / (60.0 * rate)) : 0;
+            uint64_t base = chip8.get_cycle_count();
+            if (steady)
             {
-                exit(0);
+                frame_intervals.record((uint64_t) ((start - last_start) * ns_per_tick));
             }
+            steady = rate == speed;
+            if (stats_requested.exchange(false))
+            {
+                print_stats();
+            }
+            int drained = 0;
+            {
+                TRACE_SCOPE("input");
+                KeyEvent key;
+                while (key_events.pop(key))
+                {
+                    if (drained < 256)
+                    {
+                        key_times[drained++] = key.time;
+                    }
+                    uint64_t cycle = 0;
+                    if (!debugging && start > last_start)
+                    {
+                        Uint64 into = key.time > last_start ? std::min(key.time, start) - last_start : 0;
+                        cycle = base + std::min(into * cycles_per_frame / (start - last_start),
+                                                (Uint64) cycles_per_frame - 1);
+                    }
+                    chip8.queue_keypad(cycle, key.keys);
+                }
+                if (keys_dropped.exchange(false))
+                {
+                    std::lock_guard<std::mutex> lock(input_mutex);
+                    chip8.queue_keypad(debugging ? 0 : base + cycles_per_frame - 1, keys);
+                }
+            }
+            last_start = start;
+
+            //while gdb has the program halted the window stays responsive but no instructions run
+            gdb.poll();
+            bool halted = gdb.is_halted();
+            steady = steady && !halted && !stopped;
+            if (!halted && stopped && !debugger_prompt(debugger))
+            {
+                continue;
+            }
+
+            int ran_before = frame_cycles;
+            Uint64 batch_start = SDL_GetPerformanceCounter();
+            {
+                TRACE_SCOPE("instructions");
+                if (!halted && debugging && gdb.is_attached())
+                {
+                    //stops go to gdb instead of the prompt
+                    frame_cycles += debugger.run(cycles_per_frame - frame_cycles, trace_mode);
+                    gdb.report_stop(debugger.get_stop_reason());
+                }
+                else if (!halted && debugging)
+                {
+                    frame_cycles += debugger.run(cycles_per_frame - frame_cycles, trace_mode);
+                    stopped = debugger.get_stop_reason() != STOP_NONE;
+                    if (debugger.get_stop_reason() == STOP_BREAKPOINT)
+                    {
+                        printf("Breakpoint at %.4X\n", debugger.get_stop_address());
+                    }
+                    else if (debugger.get_stop_reason() == STOP_WATCHPOINT)
+                    {
+                        printf("Watchpoint on %.4X\n", debugger.get_stop_address());
+                    }
+                    if (stopped)
+                    {
+                        debugger.print_state();
+                    }
+                }
+                else if (!halted)
+                {
+                    frame_cycles += chip8.run_cycles(cycles_per_frame, trace_mode);
+                }
+            }
+            instructions += frame_cycles - ran_before;
+            Uint64 batch_end = SDL_GetPerformanceCounter();
+            if (!halted)
+            {
+                batch_times.record((uint64_t) ((batch_end - batch_start) * ns_per_tick));
+                for (int i = 0; i < drained; i++)
+                {
+                    input_latencies.record(batch_end > key_times[i] ?
+                                           (uint64_t) ((batch_end - key_times[i]) * ns_per_tick) : 0);
+                }
+            }
+            //the tone can start in an instruction and stop in a timer tick, so it is checked after both. It is
+            //silenced while the debugger or gdb holds the program, and when there is no real time to play it in
+            bool paused = stopped || gdb.is_halted() || !audio_on || rate == 0.0;
+            double frame_length = rate > 0.0 ? 1.0 / rate : 0.0; //in audio_frames
+            audio.set_tone(chip8.is_sound_on() && !paused,
+                           audio_frames + frame_length * frame_cycles / cycles_per_frame);
+            //a stop in the middle of a frame holds the timers back until the rest of the frame's instructions have
+            //run
+            if (!gdb.is_halted() && (!stopped || frame_cycles >= cycles_per_frame))
+            {
+                TRACE_SCOPE("timers");
+                frame_cycles = 0;
+                audio_frames += frame_length;
+                chip8.update_timers();
+                audio.set_tone(chip8.is_sound_on() && !paused, audio_frames);
+            }
+
+            //faster than real time a drawn frame is only published once the display is ready for another one
+            bool fast = rate == 0.0 || rate > 1.0;
 
-            if (event.type == SDL_KEYDOWN)
+            //run ahead emulates the next frames with the keys as they are now, shows where they end up and goes back.
+            //They only run instructions and timers, the tone and anything else the frontend does is left out. A game
+            //that takes a few frames to react to a key then shows the reaction the frame the key goes down
+            bool speculative = run_ahead > 0 && !fast && !debugging && !trace_mode && !chip8.needs_input();
+            bool draw = chip8.get_draw_flag() || unshown || overlay_on;
+            if (speculative)
             {
-                if (event.key.keysym.sym == SDLK_ESCAPE)
+                TRACE_SCOPE("run ahead");
+                chip8.set_draw_flag(false);
+                *snapshot = chip8.get_state();
+                //a fault the real frames may never reach does the same to the state but isn't reported
+                chip8.set_fault_policy(skip_faults ? FAULT_SKIP : FAULT_HALT);
+                for (int frame = 0; frame < run_ahead; frame++)
                 {
-                    exit(0);
+                    chip8.run_cycles(cycles_per_frame, false);
+                    chip8.update_timers();
                 }
+                chip8.set_fault_policy(FAULT_CALLBACK, report_fault);
+                draw = draw || chip8.get_draw_flag();
+            }
 
-                for (int i = 0; i < 16; ++i)
+            Uint64 now = SDL_GetPerformanceCounter();
+            if (draw && fast && !stopped && now - last_shown < refresh_ticks && !chip8.needs_input())
+            {
+                chip8.set_draw_flag(false);
+                unshown = true;
+                draw = false;
+            }
+            if (draw)
+            {
+                TRACE_SCOPE("publish");
+                chip8.set_draw_flag(false);
+                unshown = false;
+                last_shown = now;
+                Frame &frame = frames.write_buffer();
+                frame.width = chip8.get_display_width();
+                frame.height = chip8.get_display_height();
+                frame.instructions = instructions;
+                frame.emulate_ticks = emulate_ticks + (now - start);
+                frame.sleep_ticks = sleep_ticks;
+                for (int plane = 0; plane < 2; plane++)
                 {
-                    if (event.key.keysym.sym == keymap[i])
+                    for (int row = 0; row < frame.height; row++)
                     {
-                        chip8.set_keypad_value(i, 1);
+                        memcpy(frame.planes[plane][row], chip8.get_display_row(plane, row), sizeof(frame.planes[0][0]));
                     }
                 }
+                frames.publish();
+                //one wake up in the queue at a time, the render thread takes whatever frame is newest by then
+                if (!frame_pending.exchange(true))
+                {
+                    SDL_Event wake;
+                    memset(&wake, 0, sizeof(wake));
+                    wake.type = frame_event;
+                    SDL_PushEvent(&wake);
+                }
             }
+            if (speculative)
+            {
+                TRACE_SCOPE("restore");
+                chip8.set_state(*snapshot);
+            }
+
+            Uint64 waiting = SDL_GetPerformanceCounter();
+            emulate_ticks += waiting - start;
 
-            if (event.type == SDL_KEYUP)
+            //a program that can only be woken up by input gets no more frames until there is some
+            if (!stopped && !gdb.is_attached() && chip8.needs_input())
             {
-                for (int i = 0; i < 16; ++i)
+                TRACE_SCOPE("wait for input");
+                steady = false;
+                std::unique_lock<std::mutex> lock(input_mutex);
+                auto input_pending = [&]()
                 {
-                    if (event.key.keysym.sym == keymap[i])
+                    return !key_events.empty() || keys_dropped;
+                };
+                if (gdb_port == 0)
+                {
+                    input_changed.wait(lock, input_pending);
+                }
+                else
+                {
+                    //gdb's packets are only handled by polling, so a debugger attaching or breaking in is looked for
+                    //every few milliseconds
+                    while (!input_changed.wait_for(lock, std::chrono::milliseconds(5), input_pending))
                     {
-                        chip8.set_keypad_value(i, 0);
+                        gdb.poll();
+                        if (gdb.is_attached())
+                        {
+                            break;
+                        }
                     }
                 }
+                next_frame = SDL_GetPerformanceCounter() + frame_ticks;
             }
 
+            if (gdb.is_halted())
+            {
+                //poll gdb often so its requests are answered quickly
+                TRACE_SCOPE("gdb halted");
+                SDL_Delay(1);
+                next_frame = SDL_GetPerformanceCounter() + frame_ticks;
+            }
+            else if (!stopped && audio_sync && rate > 0.0)
+            {
+                //the device consuming samples is the clock, so the timers keep pace with the sound exactly
+                TRACE_SCOPE("wait for audio");
+                audio.wait_for_device(audio_frames);
+            }
+            else if (!stopped && rate > 0.0)
+            {
+                //sleep until the next frame, giving up on catching up if we have fallen more than a frame behind
+                TRACE_SCOPE("sleep");
+                now = SDL_GetPerformanceCounter();
+                if (now < next_frame)
+                {
+                    SDL_Delay((Uint32) ((next_frame - now) * 1000 / SDL_GetPerformanceFrequency()));
+                }
+                else if (now - next_frame > frame_ticks)
+                {
+                    next_frame = now;
+                }
+                next_frame += frame_ticks;
+            }
+            sleep_ticks += SDL_GetPerformanceCounter() - waiting;
         }
+    });
+    if (pin_cpu >= 0 && !pin_thread(emulation, pin_cpu))
+    {
+        std::cerr << "Could not pin the emulation thread to CPU " << pin_cpu << std::endl;
+    }
+
+    //this thread only handles SDL events and presents frames, sleeping until there is one of either
+    ExpandTable expand_table;
+    build_expand_table(palette, expand_table);
+    Overlay overlay;
+    SDL_Texture *overlay_texture = nullptr; //made the first time the overlay is shown over a texture
+    const double us_per_tick = 1000000.0 / SDL_GetPerformanceFrequency();
+    Frame last_frame; //totals of the last frame the overlay saw
+    memset(&last_frame, 0, sizeof(last_frame));
+    Uint64 last_present = SDL_GetPerformanceCounter();
 
-        if (chip8.get_draw_flag())
+    //draws a frame and the overlay when it is on, the times of each part go in times
+    auto show = [&](const Frame &frame, FrameTimes &times)
+    {
+        Uint64 begin = SDL_GetPerformanceCounter();
+        Uint64 expanded = begin, uploaded = begin;
+        if (soft_display)
         {
-            chip8.set_draw_flag(false);
-            uint32_t pixels[32 * 64];
-            for (int i = 0; i < 32 * 64; i++)
             {
-                if (chip8.get_display_value(i) == 0)
+                TRACE_SCOPE("expand");
+                surface_display.draw(frame.planes, frame.width, frame.height, expand_table);
+                if (overlay_on)
                 {
-                    pixels[i] = 0xFF000000;
+                    surface_display.draw_overlay(overlay, 4, 4);
                 }
-                else
+            }
+            expanded = SDL_GetPerformanceCounter();
+            {
+                TRACE_SCOPE("upload");
+                surface_display.update();
+            }
+            uploaded = SDL_GetPerformanceCounter();
+        }
+        else
+        {
+            //the palette is applied while expanding straight into the texture's own memory
+            SDL_Rect area = {0, 0, frame.width, frame.height};
+            void *pixels;
+            int pitch;
+            if (SDL_LockTexture(texture, &area, &pixels, &pitch) != 0)
+            {
+                return;
+            }
+            {
+                TRACE_SCOPE("expand");
+                for (int row = 0; row < frame.height; row++)
                 {
-                    pixels[i] = 0xFFFFFFFF;
+                    expand_row(frame.planes[0][row], frame.planes[1][row], frame.width, expand_table,
+                               (uint32_t *) ((uint8_t *) pixels + row * pitch));
                 }
             }
-
-            SDL_UpdateTexture(texture, NULL, pixels, 64 * sizeof(uint32_t));
+            expanded = SDL_GetPerformanceCounter();
+            {
+                TRACE_SCOPE("upload");
+                SDL_UnlockTexture(texture);
+            }
+            uploaded = SDL_GetPerformanceCounter();
+            TRACE_SCOPE("present");
             SDL_RenderClear(renderer);
-            SDL_RenderCopy(renderer, texture, NULL, NULL);
+            SDL_RenderCopy(renderer, texture, &area, NULL);
+            if (overlay_on && overlay_texture == nullptr)
+            {
+                overlay_texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING,
+                                                    Overlay::WIDTH, Overlay::HEIGHT);
+            }
+            if (overlay_on && overlay_texture != nullptr &&
+                SDL_LockTexture(overlay_texture, NULL, &pixels, &pitch) == 0)
+            {
+                overlay.draw((uint32_t *) pixels, pitch / (int) sizeof(uint32_t));
+                SDL_UnlockTexture(overlay_texture);
+                SDL_Rect corner = {4, 4, Overlay::WIDTH, Overlay::HEIGHT};
+                SDL_RenderCopy(renderer, overlay_texture, NULL, &corner);
+            }
             SDL_RenderPresent(renderer);
         }
+        Uint64 presented = SDL_GetPerformanceCounter();
+        times.expand = (float) ((expanded - begin) * us_per_tick);
+        times.upload = (float) ((uploaded - expanded) * us_per_tick);
+        times.present = (float) ((presented - uploaded) * us_per_tick);
+    };
+
+    TRACE_THREAD("window");
+    SDL_Event event;
+    while (true)
+    {
+        {
+            TRACE_SCOPE("wait for event");
+            if (SDL_WaitEvent(&event) == 0)
+            {
+                //the emulation thread has no way to be stopped, so this leaves the same way closing the window does
+                std::cerr << "Could not wait for events " << SDL_GetError() << std::endl;
+                exit(1);
+            }
+        }
+        TRACE_SCOPE("event");
 
-        usleep(1500);
+        if (event.type == SDL_QUIT || (event.type == SDL_KEYDOWN && event.key.keysym.sym == SDLK_ESCAPE))
+        {
+            exit(0);
+        }
 
-        if (single_step_mode)
+        if (event.type == SDL_KEYDOWN && event.key.repeat == 0 && event.key.keysym.scancode == SDL_SCANCODE_F1 &&
+            key_for_scancode[SDL_SCANCODE_F1] < 0)
         {
-            std::string temp;
-            getline(std::cin, temp);
-            if (temp[0] == 27) //esc
+            overlay_on = !overlay_on;
+            if (soft_display)
             {
-                exit(0);
+                surface_display.invalidate(); //the panel is only taken away by drawing everything again
+            }
+        }
+
+        if ((event.type == SDL_KEYDOWN || event.type == SDL_KEYUP) &&
+            event.key.keysym.scancode == SDL_SCANCODE_TAB && key_for_scancode[SDL_SCANCODE_TAB] < 0)
+        {
+            turbo = event.type == SDL_KEYDOWN;
+        }
+
+        if ((event.type == SDL_KEYDOWN || event.type == SDL_KEYUP) && event.key.keysym.scancode >= 0 &&
+            event.key.keysym.scancode < SDL_NUM_SCANCODES && key_for_scancode[event.key.keysym.scancode] >= 0)
+        {
+            uint16_t bit = (uint16_t) (1u << key_for_scancode[event.key.keysym.scancode]);
+            std::lock_guard<std::mutex> lock(input_mutex);
+            uint16_t changed = (uint16_t) (event.type == SDL_KEYDOWN ? keys | bit : keys & ~bit);
+            if (changed != keys) //held keys repeat
+            {
+                keys = changed;
+                if (!key_events.push(KeyEvent{SDL_GetPerformanceCounter(), keys}))
+                {
+                    keys_dropped = true;
+                }
+                input_changed.notify_one();
+            }
+        }
+
+        if (event.type == SDL_WINDOWEVENT && soft_display)
+        {
+            //a resized window gets a new surface, and an exposed one needs everything drawn again
+            if (event.window.event == SDL_WINDOWEVENT_SIZE_CHANGED || event.window.event == SDL_WINDOWEVENT_EXPOSED)
+            {
+                surface_display.invalidate();
+                const Frame &frame = frames.read_buffer();
+                if (frame.width != 0)
+                {
+                    FrameTimes ignored = FrameTimes();
+                    show(frame, ignored);
+                }
             }
         }
-    }
 
-    return 0;
-}
\ No newline at end of file
+        if (event.type == frame_event)
+        {
+            frame_pending = false;
+            if (!frames.update())
+            {
+                continue;
+            }
+            const Frame &frame = frames.read_buffer();
+            FrameTimes times = FrameTimes();
+            Uint64 begin = SDL_GetPerformanceCounter();
+            show(frame, times);
+            Uint64 now = SDL_GetPerformanceCounter();
+            present_times.record((uint64_t) ((now - begin) * us_per_tick * 1000.0));
+            if (overlay_on)
+            {
+                //the emulation thread's share since the last frame shown, which may have been several frames ago
+                times.emulate = (float) ((frame.emulate_ticks - last_frame.emulate_ticks) * us_per_tick);
+                times.sleep = (float) ((frame.sleep_ticks - last_frame.sleep_ticks) * us_per_tick);
+                times.interval = (float) ((now - last_present) * us_per_tick);
+                times.instructions = (uint32_t) (frame.instructions - last_frame.instructions);
+                overlay.record(times);
+            }
+            last_present = now;
+            last_frame = frame;
+        }
+    }
+}
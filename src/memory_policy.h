@@ -0,0 +1,101 @@
+//
+// How the interpreter turns the addresses, stack pointers and key numbers a program computes into indexes, chosen at
+// compile time. Build with CHIP8_CHECKED_MEMORY to stop with a diagnostic on anything out of range, or with
+// CHIP8_UNCHECKED_MEMORY to trust the program. The default wraps like the hardware, at a cost of one AND
+//
+
+#ifndef CHIP8_MEMORY_POLICY_H
+#define CHIP8_MEMORY_POLICY_H
+
+
+#include <cstdio>
+#include <cstdlib>
+
+//wraps addresses to the memory size, the stack to 16 entries and keys to 16 keys
+struct MaskedMemory
+{
+    static int address(int address, int mask)
+    {
+        return address & mask;
+    }
+
+    static int stack_slot(int sp)
+    {
+        return sp & 0xF;
+    }
+
+    static int stack_pointer(int sp) //what sp becomes after a push or pop moved it
+    {
+        return sp & 0xF;
+    }
+
+    static int key(int key)
+    {
+        return key & 0xF;
+    }
+};
+
+//aborts on the first access outside memory, the stack or the keypad, for debugging ROMs and the emulator
+struct CheckedMemory
+{
+    static int out_of_range(const char *what, int value)
+    {
+        fprintf(stderr, "%s 0x%X is out of range\n", what, value);
+        abort();
+    }
+
+    static int address(int address, int mask)
+    {
+        return (address & ~mask) == 0 ? address : out_of_range("Memory address", address);
+    }
+
+    static int stack_slot(int sp)
+    {
+        return sp < 16 ? sp : out_of_range(sp == 0xFF ? "Stack underflow, stack pointer" : "Stack pointer", sp);
+    }
+
+    static int stack_pointer(int sp)
+    {
+        return sp & 0xFF; //left out of range so the next access reports it
+    }
+
+    static int key(int key)
+    {
+        return key < 16 ? key : out_of_range("Key", key);
+    }
+};
+
+//no checks at all, a program that goes out of range corrupts the emulator
+struct UncheckedMemory
+{
+    static int address(int address, int)
+    {
+        return address;
+    }
+
+    static int stack_slot(int sp)
+    {
+        return sp;
+    }
+
+    static int stack_pointer(int sp)
+    {
+        return sp & 0xFF;
+    }
+
+    static int key(int key)
+    {
+        return key;
+    }
+};
+
+#if defined(CHIP8_CHECKED_MEMORY)
+typedef CheckedMemory MemoryPolicy;
+#elif defined(CHIP8_UNCHECKED_MEMORY)
+typedef UncheckedMemory MemoryPolicy;
+#else
+typedef MaskedMemory MemoryPolicy;
+#endif
+
+
+#endif //CHIP8_MEMORY_POLICY_H
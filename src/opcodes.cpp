@@ -0,0 +1,247 @@
+//
+// Opcode decoding shared by the interpreter, debugger and disassembler
+//
+
+#include <cstdio>
+#include "opcodes.h"
+
+const OpInfo op_info[OP_COUNT] =
+        {
+                {"???",             0}, //OP_INVALID
+                {"CLS",             OPF_DRAWS},
+                {"RET",             OPF_RETURN},
+                {"SCD %n",          OPF_DRAWS},
+                {"SCU %n",          OPF_DRAWS},
+                {"SCR",             OPF_DRAWS},
+                {"SCL",             OPF_DRAWS},
+                {"LOW",             OPF_DRAWS},
+                {"HIGH",            OPF_DRAWS},
+                {"JP %a",           OPF_JUMP},
+                {"CALL %a",         OPF_CALL},
+                {"SE %x, %b",       OPF_SKIP},
+                {"SNE %x, %b",      OPF_SKIP},
+                {"SE %x, %y",       OPF_SKIP},
+                {"SAVE %x - %y",    OPF_WRITES_MEMORY},
+                {"LOAD %x - %y",    0},
+                {"LD %x, %b",       0},
+                {"ADD %x, %b",      0},
+                {"LD %x, %y",       0},
+                {"OR %x, %y",       0},
+                {"AND %x, %y",      0},
+                {"XOR %x, %y",      0},
+                {"ADD %x, %y",      0},
+                {"SUB %x, %y",      0},
+                {"SHR %x",          0},
+                {"SUBN %x, %y",     0},
+                {"SHL %x",          0},
+                {"SNE %x, %y",      OPF_SKIP},
+                {"LD I, %a",        0},
+                {"JP V0, %a",       OPF_INDIRECT},
+                {"RND %x, %b",      0},
+                {"DRW %x, %y, %n",  OPF_DRAWS},
+                {"SKP %x",          OPF_SKIP},
+                {"SKNP %x",         OPF_SKIP},
+                {"LD I, %l",        OPF_LONG},
+                {"PLANE %p",        0},
+                {"AUDIO",           0},
+                {"LD %x, DT",       0},
+                {"LD %x, K",        0},
+                {"LD DT, %x",       0},
+                {"LD ST, %x",       0},
+                {"ADD I, %x",       0},
+                {"LD F, %x",        0},
+                {"PITCH %x",        0},
+                {"LD B, %x",        OPF_WRITES_MEMORY},
+                {"LD [I], %x",      OPF_WRITES_MEMORY},
+                {"LD %x, [I]",      0},
+        };
+
+//the decoding rules, only used to build op_table
+static Op decode_opcode(int opcode)
+{
+    int x = (opcode & 0x0F00) >> 8, n = opcode & 0x000F, nn = opcode & 0x00FF;
+    switch (opcode >> 12)
+    {
+        case 0x0:
+            if (opcode == 0x00E0)
+            {
+                return OP_CLS;
+            }
+            if (opcode == 0x00EE)
+            {
+                return OP_RET;
+            }
+            if ((opcode & 0xFFF0) == 0x00C0)
+            {
+                return OP_SCROLL_DOWN;
+            }
+            if ((opcode & 0xFFF0) == 0x00D0)
+            {
+                return OP_SCROLL_UP;
+            }
+            if (opcode == 0x00FB)
+            {
+                return OP_SCROLL_RIGHT;
+            }
+            if (opcode == 0x00FC)
+            {
+                return OP_SCROLL_LEFT;
+            }
+            if (opcode == 0x00FE)
+            {
+                return OP_LORES;
+            }
+            if (opcode == 0x00FF)
+            {
+                return OP_HIRES;
+            }
+            return OP_INVALID;
+
+        case 0x1:
+            return OP_JP;
+        case 0x2:
+            return OP_CALL;
+        case 0x3:
+            return OP_SE_BYTE;
+        case 0x4:
+            return OP_SNE_BYTE;
+
+        case 0x5:
+            return n == 0 ? OP_SE_REG : n == 2 ? OP_SAVE_RANGE : n == 3 ? OP_LOAD_RANGE : OP_INVALID;
+
+        case 0x6:
+            return OP_LD_BYTE;
+        case 0x7:
+            return OP_ADD_BYTE;
+
+        case 0x8:
+        {
+            static const Op alu[16] = {OP_LD_REG, OP_OR, OP_AND, OP_XOR, OP_ADD_REG, OP_SUB, OP_SHR, OP_SUBN,
+                                       OP_INVALID, OP_INVALID, OP_INVALID, OP_INVALID, OP_INVALID, OP_INVALID, OP_SHL,
+                                       OP_INVALID};
+            return alu[n];
+        }
+
+        case 0x9:
+            return n == 0 ? OP_SNE_REG : OP_INVALID;
+        case 0xA:
+            return OP_LD_I;
+        case 0xB:
+            return OP_JP_V0;
+        case 0xC:
+            return OP_RND;
+        case 0xD:
+            return OP_DRW;
+
+        case 0xE:
+            return nn == 0x9E ? OP_SKP : nn == 0xA1 ? OP_SKNP : OP_INVALID;
+
+        default:
+            switch (nn)
+            {
+                case 0x00:
+                    return x == 0 ? OP_LD_I_LONG : OP_INVALID;
+                case 0x01:
+                    return x < 4 ? OP_PLANE : OP_INVALID;
+                case 0x02:
+                    return x == 0 ? OP_AUDIO : OP_INVALID;
+                case 0x07:
+                    return OP_GET_DELAY;
+                case 0x0A:
+                    return OP_WAIT_KEY;
+                case 0x15:
+                    return OP_SET_DELAY;
+                case 0x18:
+                    return OP_SET_SOUND;
+                case 0x1E:
+                    return OP_ADD_I;
+                case 0x29:
+                    return OP_FONT;
+                case 0x33:
+                    return OP_BCD;
+                case 0x3A:
+                    return OP_PITCH;
+                case 0x55:
+                    return OP_STORE;
+                case 0x65:
+                    return OP_LOAD;
+                default:
+                    return OP_INVALID;
+            }
+    }
+}
+
+struct OpTable
+{
+    uint8_t ops[65536];
+
+    OpTable()
+    {
+        for (int opcode = 0; opcode < 65536; opcode++)
+        {
+            ops[opcode] = (uint8_t) decode_opcode(opcode);
+        }
+    }
+};
+
+const uint8_t *op_table()
+{
+    static const OpTable table;
+    return table.ops;
+}
+
+int memory_write_length(int opcode)
+{
+    int x = (opcode & 0x0F00) >> 8, y = (opcode & 0x00F0) >> 4;
+    switch (decode(opcode))
+    {
+        case OP_BCD:
+            return 3;
+        case OP_STORE:
+            return x + 1;
+        case OP_SAVE_RANGE:
+            return (x > y ? x - y : y - x) + 1;
+        default:
+            return 0;
+    }
+}
+
+std::string format_instruction(int opcode, int next)
+{
+    std::string text;
+    char operand[16];
+    for (const char *p = op_info[decode(opcode)].syntax; *p != '\0'; p++)
+    {
+        if (*p != '%')
+        {
+            text += *p;
+            continue;
+        }
+        switch (*++p)
+        {
+            case 'x':
+                sprintf(operand, "V%X", (opcode & 0x0F00) >> 8);
+                break;
+            case 'y':
+                sprintf(operand, "V%X", (opcode & 0x00F0) >> 4);
+                break;
+            case 'n':
+                sprintf(operand, "%d", opcode & 0x000F);
+                break;
+            case 'b':
+                sprintf(operand, "0x%.2X", opcode & 0x00FF);
+                break;
+            case 'a':
+                sprintf(operand, "0x%.3X", opcode & 0x0FFF);
+                break;
+            case 'l':
+                sprintf(operand, "0x%.4X", next & 0xFFFF);
+                break;
+            default: //%p
+                sprintf(operand, "%d", (opcode & 0x0F00) >> 8);
+                break;
+        }
+        text += operand;
+    }
+    return text;
+}
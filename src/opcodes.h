@@ -0,0 +1,100 @@
+//
+// Opcode decoding shared by the interpreter, debugger and disassembler
+//
+
+#ifndef CHIP8_OPCODES_H
+#define CHIP8_OPCODES_H
+
+
+#include <cstdint>
+#include <string>
+
+//every instruction the interpreter knows
+enum Op
+{
+    OP_INVALID,
+    OP_CLS, //00E0
+    OP_RET, //00EE
+    OP_SCROLL_DOWN, //00CN
+    OP_SCROLL_UP, //00DN
+    OP_SCROLL_RIGHT, //00FB
+    OP_SCROLL_LEFT, //00FC
+    OP_LORES, //00FE
+    OP_HIRES, //00FF
+    OP_JP, //1NNN
+    OP_CALL, //2NNN
+    OP_SE_BYTE, //3XNN
+    OP_SNE_BYTE, //4XNN
+    OP_SE_REG, //5XY0
+    OP_SAVE_RANGE, //5XY2
+    OP_LOAD_RANGE, //5XY3
+    OP_LD_BYTE, //6XNN
+    OP_ADD_BYTE, //7XNN
+    OP_LD_REG, //8XY0
+    OP_OR, //8XY1
+    OP_AND, //8XY2
+    OP_XOR, //8XY3
+    OP_ADD_REG, //8XY4
+    OP_SUB, //8XY5
+    OP_SHR, //8XY6
+    OP_SUBN, //8XY7
+    OP_SHL, //8XYE
+    OP_SNE_REG, //9XY0
+    OP_LD_I, //ANNN
+    OP_JP_V0, //BNNN
+    OP_RND, //CXNN
+    OP_DRW, //DXYN
+    OP_SKP, //EX9E
+    OP_SKNP, //EXA1
+    OP_LD_I_LONG, //F000 NNNN
+    OP_PLANE, //FN01
+    OP_AUDIO, //F002
+    OP_GET_DELAY, //FX07
+    OP_WAIT_KEY, //FX0A
+    OP_SET_DELAY, //FX15
+    OP_SET_SOUND, //FX18
+    OP_ADD_I, //FX1E
+    OP_FONT, //FX29
+    OP_PITCH, //FX3A
+    OP_BCD, //FX33
+    OP_STORE, //FX55
+    OP_LOAD, //FX65
+    OP_COUNT
+};
+
+//control flow and side effects of an instruction
+enum OpFlags
+{
+    OPF_JUMP = 1, //always continues at NNN
+    OPF_CALL = 2, //continues at NNN and returns to the next instruction
+    OPF_RETURN = 4,
+    OPF_SKIP = 8, //may skip the next instruction
+    OPF_INDIRECT = 16, //target is only known at run time
+    OPF_WRITES_MEMORY = 32, //writes memory starting at I
+    OPF_LONG = 64, //4 bytes long
+    OPF_DRAWS = 128 //changes the display
+};
+
+struct OpInfo
+{
+    const char *syntax; //%x and %y are VX and VY, %n is N, %b is NN, %a is NNN, %l is the 16 bit word after F000
+    int flags;
+};
+
+extern const OpInfo op_info[OP_COUNT];
+
+//Op for every opcode, built on the first call so static initialisers in other files can decode too
+const uint8_t *op_table();
+
+inline Op decode(int opcode)
+{
+    static const uint8_t *const table = op_table();
+    return (Op) table[opcode];
+}
+
+int memory_write_length(int); //bytes the instruction writes starting at I
+
+std::string format_instruction(int, int); //assembly for an opcode, the second argument is the word after it
+
+
+#endif //CHIP8_OPCODES_H
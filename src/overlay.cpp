@@ -0,0 +1,141 @@
+//
+// Performance numbers drawn over the display
+//
+
+#include <algorithm>
+#include <cstring>
+#include "chip8.h"
+#include "overlay.h"
+
+static const int MARGIN = 4;
+static const int LINE = 7; //a 5 pixel high digit and the gap under it
+static const int ROWS = 7;
+static const int GRAPH_HEIGHT = Overlay::HEIGHT - 2 * MARGIN - ROWS * LINE - 2; //2 pixels under the numbers
+static const float US_PER_PIXEL = 1000.0f; //graph scale
+static const float FRAME_US = 1000000.0f / 60; //a 60Hz frame, marked across the graph
+
+static const uint32_t BACKGROUND = 0xFF101010;
+static const uint32_t OTHER = 0xFF303030; //the part of an interval none of the times cover
+static const uint32_t MARK = 0xFF808080;
+//frames per second, instructions per second, then the times in the order of FrameTimes
+static const uint32_t COLOURS[ROWS] = {0xFFFFFFFF, 0xFFAAAAAA, 0xFFE04040, 0xFFE0C040, 0xFF40C040, 0xFF4080E0,
+                                       0xFF707070};
+
+static void fill(uint32_t *pixels, int pitch, int x, int y, int width, int height, uint32_t colour)
+{
+    for (int row = y; row < y + height; row++)
+    {
+        std::fill(pixels + row * pitch + x, pixels + row * pitch + x + width, colour);
+    }
+}
+
+//a decimal number in the 4x5 font with its first digit at x
+static void draw_number(uint32_t *pixels, int pitch, int x, int y, uint64_t value, uint32_t colour)
+{
+    char digits[24];
+    int length = 0;
+    do
+    {
+        digits[length++] = (char) (value % 10);
+        value /= 10;
+    }
+    while (value != 0);
+
+    for (int i = 0; i < length; i++, x += 5)
+    {
+        const uint8_t *glyph = chip8_fontset + digits[length - 1 - i] * 5;
+        for (int row = 0; row < 5; row++)
+        {
+            for (int column = 0; column < 4; column++)
+            {
+                if (glyph[row] & (0x80 >> column))
+                {
+                    pixels[(y + row) * pitch + x + column] = colour;
+                }
+            }
+        }
+    }
+}
+
+//std::min takes them by reference, which needs them defined somewhere
+const int Overlay::HISTORY;
+const int Overlay::AVERAGE;
+
+Overlay::Overlay() : count(0), next(0)
+{
+    memset(history, 0, sizeof(history));
+}
+
+const FrameTimes &Overlay::recent(int age) const
+{
+    return history[(next - 1 - age + HISTORY) % HISTORY];
+}
+
+void Overlay::record(const FrameTimes &times)
+{
+    history[next] = times;
+    next = (next + 1) % HISTORY;
+    count = std::min(count + 1, HISTORY);
+}
+
+void Overlay::draw(uint32_t *pixels, int pitch) const
+{
+    fill(pixels, pitch, 0, 0, WIDTH, HEIGHT, BACKGROUND);
+
+    //averages over the last few frames, a single frame's numbers change too fast to read
+    double sums[ROWS] = {};
+    int frames = std::min(count, AVERAGE);
+    for (int i = 0; i < frames; i++)
+    {
+        const FrameTimes &times = recent(i);
+        const float parts[] = {times.interval, (float) times.instructions, times.emulate, times.expand, times.upload,
+                               times.present, times.sleep};
+        for (int row = 0; row < ROWS; row++)
+        {
+            sums[row] += parts[row];
+        }
+    }
+    uint64_t values[ROWS] = {};
+    if (frames != 0 && sums[0] > 0.0)
+    {
+        values[0] = (uint64_t) (frames * 1000000.0 / sums[0] + 0.5);
+        values[1] = (uint64_t) (sums[1] * 1000000.0 / sums[0] + 0.5);
+        for (int row = 2; row < ROWS; row++)
+        {
+            values[row] = (uint64_t) (sums[row] / frames + 0.5);
+        }
+    }
+    for (int row = 0; row < ROWS; row++)
+    {
+        int y = MARGIN + row * LINE;
+        fill(pixels, pitch, MARGIN, y, 4, 5, COLOURS[row]);
+        draw_number(pixels, pitch, MARGIN + 8, y, values[row], COLOURS[row]);
+    }
+
+    //oldest frame on the left, each column stacked up from the bottom
+    int bottom = HEIGHT - MARGIN;
+    for (int i = 0; i < count; i++)
+    {
+        const FrameTimes &times = recent(count - 1 - i);
+        int x = MARGIN + HISTORY - count + i;
+        const float parts[] = {times.emulate, times.expand, times.upload, times.present, times.sleep};
+        float total = 0.0f;
+        int y = bottom;
+        for (int part = 0; part < 5 && y > bottom - GRAPH_HEIGHT; part++)
+        {
+            total += parts[part];
+            int top = std::max(bottom - GRAPH_HEIGHT, bottom - (int) (total / US_PER_PIXEL));
+            fill(pixels, pitch, x, top, 1, y - top, COLOURS[part + 2]);
+            y = top;
+        }
+        int top = std::max(bottom - GRAPH_HEIGHT, bottom - (int) (times.interval / US_PER_PIXEL));
+        if (top < y)
+        {
+            fill(pixels, pitch, x, top, 1, y - top, OTHER);
+        }
+    }
+    for (int x = MARGIN; x < MARGIN + HISTORY; x += 2)
+    {
+        pixels[(bottom - (int) (FRAME_US / US_PER_PIXEL)) * pitch + x] = MARK;
+    }
+}
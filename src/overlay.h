@@ -0,0 +1,49 @@
+//
+// Performance numbers and a frame time graph drawn over the display with the CHIP-8 font, so it needs nothing from
+// SDL and costs nothing while it is hidden
+//
+
+#ifndef CHIP8_OVERLAY_H
+#define CHIP8_OVERLAY_H
+
+
+#include <cstdint>
+
+//where the time between two presented frames went, in microseconds
+struct FrameTimes
+{
+    float emulate, expand, upload, present, sleep;
+    float interval; //since the frame before was presented
+    uint32_t instructions; //executed in that time
+};
+
+//a panel of numbers above a graph. The font only has hex digits, so each row starts with a swatch of its colour
+//instead of a name. The rows are frames per second, instructions per second, then the average of each time in
+//FrameTimes over the last AVERAGE frames. The graph stacks the times of the last HISTORY frames in the same colours,
+//with whatever else the interval went on on top, one pixel per millisecond
+class Overlay
+{
+public:
+    static const int HISTORY = 120;
+    static const int AVERAGE = 30;
+    static const int WIDTH = HISTORY + 8, HEIGHT = 91; //pixels of the panel
+
+private:
+    FrameTimes history[HISTORY];
+    int count; //recorded so far, up to HISTORY
+    int next; //index the next record goes to
+
+    const FrameTimes &recent(int) const; //0 is the latest
+
+public:
+    Overlay();
+
+    void record(const FrameTimes &);
+
+    //draws the whole panel as opaque ARGB pixels, the first argument is its top left corner and the second the
+    //distance between rows in pixels
+    void draw(uint32_t *, int) const;
+};
+
+
+#endif //CHIP8_OVERLAY_H
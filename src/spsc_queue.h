@@ -0,0 +1,65 @@
+//
+// Bounded lock-free queue for one producer thread and one consumer thread
+//
+
+#ifndef CHIP8_SPSC_QUEUE_H
+#define CHIP8_SPSC_QUEUE_H
+
+
+#include <atomic>
+
+//N must be a power of two. push is only called from the producer thread, pop, peek and empty only from the consumer
+template<typename T, unsigned N>
+class SpscQueue
+{
+private:
+    T items[N];
+    alignas(64) std::atomic<unsigned> head; //next item to read, only written by the consumer
+    alignas(64) std::atomic<unsigned> tail; //next slot to write, only written by the producer
+
+public:
+    SpscQueue() : head(0), tail(0)
+    {}
+
+    bool push(const T &item) //returns false if the queue is full
+    {
+        unsigned t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) == N)
+        {
+            return false;
+        }
+        items[t & (N - 1)] = item;
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    T *peek() //the oldest item without removing it, nullptr if the queue is empty
+    {
+        unsigned h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire))
+        {
+            return nullptr;
+        }
+        return &items[h & (N - 1)];
+    }
+
+    bool pop(T &item) //returns false if the queue is empty
+    {
+        T *front = peek();
+        if (front == nullptr)
+        {
+            return false;
+        }
+        item = *front;
+        head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool empty()
+    {
+        return head.load(std::memory_order_relaxed) == tail.load(std::memory_order_acquire);
+    }
+};
+
+
+#endif //CHIP8_SPSC_QUEUE_H
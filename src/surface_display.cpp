@@ -0,0 +1,131 @@
+//
+// Presents frames by drawing straight into the window surface
+//
+
+#include <algorithm>
+#include <cstring>
+#include <SDL_video.h>
+#include "surface_display.h"
+
+static const int MAX_SCALED_WIDTH = 128 * 64;
+
+SurfaceDisplay::SurfaceDisplay(SDL_Window *window) : window(window), surface(nullptr), shown_width(0),
+                                                     shown_height(0), full(true)
+{
+    memset(shown, 0, sizeof(shown));
+}
+
+bool SurfaceDisplay::open()
+{
+    surface = SDL_GetWindowSurface(window);
+    full = true;
+    //the palette and the overlay are ARGB words, written as they are
+    return surface != nullptr && (surface->format->format == SDL_PIXELFORMAT_ARGB8888 ||
+                                  surface->format->format == SDL_PIXELFORMAT_RGB888);
+}
+
+void SurfaceDisplay::invalidate()
+{
+    surface = nullptr;
+    full = true;
+}
+
+void SurfaceDisplay::draw(const uint64_t (*planes)[64][2], int width, int height, const ExpandTable &table)
+{
+    if (surface == nullptr && !open())
+    {
+        return;
+    }
+    if (width != shown_width || height != shown_height)
+    {
+        full = true;
+    }
+    int scale = std::max(1, std::min(std::min(surface->w / width, surface->h / height), MAX_SCALED_WIDTH / width));
+    int left = std::max(0, (surface->w - width * scale) / 2), top = std::max(0, (surface->h - height * scale) / 2);
+    int rows = std::min(height, surface->h / scale);
+    int scaled_width = std::min(width * scale, surface->w);
+
+    if (SDL_MUSTLOCK(surface) && SDL_LockSurface(surface) != 0)
+    {
+        return;
+    }
+    uint8_t *pixels = (uint8_t *) surface->pixels;
+    if (full)
+    {
+        for (int y = 0; y < surface->h; y++)
+        {
+            memset(pixels + y * surface->pitch, 0, surface->w * sizeof(uint32_t));
+        }
+    }
+    for (int row = 0; row < rows; row++)
+    {
+        if (!full && memcmp(planes[0][row], shown[0][row], sizeof(shown[0][row])) == 0 &&
+            memcmp(planes[1][row], shown[1][row], sizeof(shown[1][row])) == 0)
+        {
+            continue;
+        }
+        uint32_t line[128], scaled[MAX_SCALED_WIDTH];
+        expand_row(planes[0][row], planes[1][row], width, table, line);
+        scale_row(line, width, scale, scaled);
+        int y = top + row * scale;
+        for (int copy = 0; copy < scale; copy++)
+        {
+            memcpy(pixels + (y + copy) * surface->pitch + left * sizeof(uint32_t), scaled,
+                   scaled_width * sizeof(uint32_t));
+        }
+        //neighbouring rows go out as one rectangle
+        if (!dirty.empty() && dirty.back().y + dirty.back().h == y)
+        {
+            dirty.back().h += scale;
+        }
+        else
+        {
+            dirty.push_back(SDL_Rect{left, y, scaled_width, scale});
+        }
+    }
+    if (SDL_MUSTLOCK(surface))
+    {
+        SDL_UnlockSurface(surface);
+    }
+
+    memcpy(shown, planes, sizeof(shown));
+    shown_width = width;
+    shown_height = height;
+}
+
+void SurfaceDisplay::draw_overlay(const Overlay &overlay, int x, int y)
+{
+    if (surface == nullptr || x + Overlay::WIDTH > surface->w || y + Overlay::HEIGHT > surface->h)
+    {
+        return;
+    }
+    if (SDL_MUSTLOCK(surface) && SDL_LockSurface(surface) != 0)
+    {
+        return;
+    }
+    overlay.draw((uint32_t *) ((uint8_t *) surface->pixels + y * surface->pitch) + x,
+                 surface->pitch / (int) sizeof(uint32_t));
+    if (SDL_MUSTLOCK(surface))
+    {
+        SDL_UnlockSurface(surface);
+    }
+    dirty.push_back(SDL_Rect{x, y, Overlay::WIDTH, Overlay::HEIGHT});
+}
+
+void SurfaceDisplay::update()
+{
+    if (surface == nullptr)
+    {
+        return;
+    }
+    if (full)
+    {
+        SDL_UpdateWindowSurface(window);
+    }
+    else if (!dirty.empty())
+    {
+        SDL_UpdateWindowSurfaceRects(window, dirty.data(), (int) dirty.size());
+    }
+    dirty.clear();
+    full = false;
+}
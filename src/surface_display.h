@@ -0,0 +1,43 @@
+//
+// Presents frames by drawing straight into the window surface, for when SDL only has its software renderer and
+// scaling a texture through it costs more than emulating the frame
+//
+
+#ifndef CHIP8_SURFACE_DISPLAY_H
+#define CHIP8_SURFACE_DISPLAY_H
+
+
+#include <cstdint>
+#include <vector>
+#include <SDL_video.h>
+#include "expand.h"
+#include "overlay.h"
+
+class SurfaceDisplay
+{
+private:
+    SDL_Window *window;
+    SDL_Surface *surface; //null until the next present after a resize, when SDL replaces it
+    uint64_t shown[2][64][2]; //the planes on the surface now, rows that still match aren't drawn again
+    int shown_width, shown_height;
+    bool full; //the whole surface has to be drawn, after a resize, an expose or a resolution change
+    std::vector<SDL_Rect> dirty; //parts of the surface written since the last update
+
+public:
+    explicit SurfaceDisplay(SDL_Window *);
+
+    bool open(); //false if the window surface isn't 32 bit ARGB or XRGB
+
+    void invalidate(); //call on resize or expose, the next present draws everything
+
+    //width by height pixels of packed planes like Chip8State::display, scaled by the largest integer that fits. It
+    //only reaches the screen on the next update
+    void draw(const uint64_t (*)[64][2], int, int, const ExpandTable &);
+
+    void draw_overlay(const Overlay &, int, int); //the panel with its top left corner at x, y, after the frame
+
+    void update(); //shows everything drawn since the last update
+};
+
+
+#endif //CHIP8_SURFACE_DISPLAY_H
@@ -0,0 +1,112 @@
+//
+// Timeline of where each thread spends its time
+//
+
+#include "trace.h"
+
+#ifdef CHIP8_TRACE
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+#include <vector>
+
+//scopes kept per thread, the oldest are overwritten. At 60 frames of a dozen scopes a second this is about 6 minutes
+static const uint64_t TRACE_EVENTS = 1 << 18;
+
+struct TraceEvent
+{
+    const char *name;
+    uint64_t begin, end;
+};
+
+//written only by its own thread. count is published after each event so the writer can read without locking
+struct TraceBuffer
+{
+    TraceEvent events[TRACE_EVENTS];
+    std::atomic<uint64_t> count;
+    const char *thread_name;
+};
+
+static std::mutex buffers_mutex;
+static std::vector<TraceBuffer *> buffers; //every thread that recorded, never freed so threads can end first
+static thread_local TraceBuffer *local = nullptr;
+static std::atomic<bool> recording(true);
+static const std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+
+static uint64_t now_ns()
+{
+    return (uint64_t) std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() -
+                                                                           epoch).count();
+}
+
+static TraceBuffer *local_buffer()
+{
+    if (local == nullptr)
+    {
+        local = new TraceBuffer();
+        local->count = 0;
+        local->thread_name = nullptr;
+        std::lock_guard<std::mutex> lock(buffers_mutex);
+        buffers.push_back(local);
+    }
+    return local;
+}
+
+TraceScope::TraceScope(const char *name) : name(name), begin(now_ns())
+{}
+
+TraceScope::~TraceScope()
+{
+    if (!recording.load(std::memory_order_relaxed))
+    {
+        return;
+    }
+    TraceBuffer *buffer = local_buffer();
+    uint64_t count = buffer->count.load(std::memory_order_relaxed);
+    buffer->events[count % TRACE_EVENTS] = TraceEvent{name, begin, now_ns()};
+    buffer->count.store(count + 1, std::memory_order_release);
+}
+
+void trace_thread_name(const char *name)
+{
+    local_buffer()->thread_name = name;
+}
+
+bool trace_write(const char *path)
+{
+    recording = false;
+    FILE *file = fopen(path, "w");
+    if (file == nullptr)
+    {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(buffers_mutex);
+    fprintf(file, "{\"traceEvents\":[\n");
+    bool first = true;
+    for (size_t thread = 0; thread < buffers.size(); thread++)
+    {
+        TraceBuffer *buffer = buffers[thread];
+        if (buffer->thread_name != nullptr)
+        {
+            fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%zu,\"args\":{\"name\":\"%s\"}}",
+                    first ? "" : ",\n", thread, buffer->thread_name);
+            first = false;
+        }
+        //a thread that was inside a scope when recording stopped may still write one more event, over the oldest
+        uint64_t count = buffer->count.load(std::memory_order_acquire);
+        uint64_t oldest = count > TRACE_EVENTS - 1 ? count - (TRACE_EVENTS - 1) : 0;
+        for (uint64_t i = oldest; i < count; i++)
+        {
+            const TraceEvent &event = buffer->events[i % TRACE_EVENTS];
+            fprintf(file, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%zu,\"ts\":%.3f,\"dur\":%.3f}",
+                    first ? "" : ",\n", event.name, thread, event.begin / 1000.0, (event.end - event.begin) / 1000.0);
+            first = false;
+        }
+    }
+    fprintf(file, "\n],\"displayTimeUnit\":\"ms\"}\n");
+    return fclose(file) == 0;
+}
+
+#endif
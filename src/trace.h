@@ -0,0 +1,48 @@
+//
+// Timeline of where each thread spends its time, written as Chrome trace JSON for chrome://tracing or Perfetto.
+// Only built with CHIP8_TRACE defined, otherwise every macro here is an empty statement
+//
+
+#ifndef CHIP8_TRACE_H
+#define CHIP8_TRACE_H
+
+
+#ifdef CHIP8_TRACE
+
+#include <cstdint>
+
+//records the time from its construction to the end of the enclosing scope under a name, which must be a string
+//literal or otherwise live until the trace is written. Recording is a few stores into a buffer of the calling
+//thread, no locks
+class TraceScope
+{
+private:
+    const char *name;
+    uint64_t begin; //nanoseconds
+
+public:
+    explicit TraceScope(const char *);
+
+    ~TraceScope();
+};
+
+void trace_thread_name(const char *); //what the calling thread is called in the trace
+
+//stops recording and writes every thread's recent scopes, returns false if the file can't be written. Scopes
+//recorded by other threads while it runs are dropped
+bool trace_write(const char *);
+
+#define TRACE_CONCAT2(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT2(a, b)
+#define TRACE_SCOPE(name) TraceScope TRACE_CONCAT(trace_scope_, __LINE__)(name)
+#define TRACE_THREAD(name) trace_thread_name(name)
+
+#else
+
+#define TRACE_SCOPE(name) ((void) 0)
+#define TRACE_THREAD(name) ((void) 0)
+
+#endif
+
+
+#endif //CHIP8_TRACE_H
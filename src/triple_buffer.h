@@ -0,0 +1,56 @@
+//
+// Lock-free handoff of the latest value from one producer thread to one consumer thread
+//
+
+#ifndef CHIP8_TRIPLE_BUFFER_H
+#define CHIP8_TRIPLE_BUFFER_H
+
+
+#include <atomic>
+
+//the writer fills its buffer and publishes it, swapping it with the one in the middle. The reader swaps its buffer
+//with the middle one when that holds something newer. Neither side ever waits, and values published before the reader
+//got to them are dropped
+template<typename T>
+class TripleBuffer
+{
+private:
+    static const unsigned FRESH = 4; //set in middle when it was published after the reader last took it
+
+    T buffers[3];
+    alignas(64) std::atomic<unsigned> middle; //index of the buffer in between, with FRESH
+    alignas(64) unsigned back; //only used by the writer
+    alignas(64) unsigned front; //only used by the reader
+
+public:
+    TripleBuffer() : buffers(), middle(1), back(0), front(2)
+    {}
+
+    T &write_buffer() //what the writer fills, it may hold any earlier value
+    {
+        return buffers[back];
+    }
+
+    void publish()
+    {
+        back = middle.exchange(back | FRESH, std::memory_order_acq_rel) & 3;
+    }
+
+    bool update() //takes the newest published value, returns false if there is nothing newer than read_buffer
+    {
+        if ((middle.load(std::memory_order_relaxed) & FRESH) == 0)
+        {
+            return false;
+        }
+        front = middle.exchange(front, std::memory_order_acq_rel) & 3;
+        return true;
+    }
+
+    const T &read_buffer() //value initialised until the first update
+    {
+        return buffers[front];
+    }
+};
+
+
+#endif //CHIP8_TRIPLE_BUFFER_H
@@ -3,8 +3,21 @@
 //
 
 #define CATCH_CONFIG_MAIN
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <vector>
 #include "../catch/catch.hpp"
 #include "../src/chip8.h"
+#include "../src/debugger.h"
+#include "../src/disasm.h"
+#include "../src/expand.h"
+#include "../src/histogram.h"
+#include "../src/jit.h"
+#include "../src/overlay.h"
+#include "../src/trace.h"
 
 TEST_CASE("load_rom function")
 {
@@ -14,3 +27,408 @@ TEST_CASE("load_rom function")
     REQUIRE(chip8.load_rom("../roms/PONG") == true); //testing normal case
 }
 
+
+TEST_CASE("load_rom in XO-CHIP mode")
+{
+    Chip8 chip8;
+    chip8.set_xo_chip(true);
+    REQUIRE(chip8.load_rom("../screenshots/brix.jpg") == true); //64k of memory fits ROMs bigger than 4k
+}
+
+TEST_CASE("idle detection")
+{
+    Chip8 maze;
+    REQUIRE(maze.load_rom("../roms/MAZE") == true);
+    REQUIRE(maze.run_cycles(100000, false) < 100000); //MAZE jumps to itself once the maze is drawn
+    REQUIRE(maze.get_idle_state() == IDLE_HALT);
+    REQUIRE(maze.needs_input() == true);
+
+    Chip8 blitz;
+    REQUIRE(blitz.load_rom("../roms/BLITZ") == true);
+    blitz.run_cycles(100000, false);
+    REQUIRE(blitz.get_idle_state() == IDLE_KEY); //title screen waits for a key
+    blitz.set_keypad_value(5, 1);
+    REQUIRE(blitz.run_cycles(1, false) == 1);
+    REQUIRE(blitz.get_idle_state() == IDLE_NONE);
+}
+
+//V0 = 1, an invalid opcode, V1 = 2, then a jump to itself
+static void load_faulting_program(Chip8 &chip8)
+{
+    std::unique_ptr<Chip8State> state(new Chip8State(chip8.get_state()));
+    const uint8_t program[] = {0x60, 0x01, 0xFF, 0xFF, 0x61, 0x02, 0x12, 0x06};
+    memcpy(state->memory + 0x200, program, sizeof(program));
+    chip8.set_state(*state);
+}
+
+TEST_CASE("fault policies")
+{
+    Chip8 halt;
+    load_faulting_program(halt);
+    REQUIRE(halt.run_cycles(100, false) == 2);
+    REQUIRE(halt.get_idle_state() == IDLE_FAULT);
+    REQUIRE(halt.get_fault().code == FAULT_INVALID_OPCODE);
+    REQUIRE(halt.get_fault().pc == 0x202);
+    REQUIRE(halt.get_fault().opcode == 0xFFFF);
+    REQUIRE(halt.run_cycles(100, false) == 0); //stays halted
+    REQUIRE(halt.get_state().pc == 0x202);
+    halt.clear_fault();
+    REQUIRE(halt.get_fault().code == FAULT_NONE);
+    REQUIRE(halt.run_cycles(100, false) == 1); //runs straight into it again
+
+    Chip8 skip;
+    load_faulting_program(skip);
+    skip.set_fault_policy(FAULT_SKIP);
+    skip.run_cycles(100, false);
+    REQUIRE(skip.get_idle_state() == IDLE_HALT);
+    REQUIRE(skip.get_state().V[1] == 2);
+    REQUIRE(skip.get_fault().pc == 0x202); //still recorded
+
+    Chip8 callback;
+    load_faulting_program(callback);
+    int calls = 0;
+    callback.set_fault_policy(FAULT_CALLBACK, [&](const Chip8Fault &fault)
+    {
+        calls++;
+        return fault.pc == 0x202 ? FAULT_SKIP : FAULT_HALT;
+    });
+    callback.run_cycles(100, false);
+    REQUIRE(calls == 1);
+    REQUIRE(callback.get_state().V[1] == 2);
+
+    Debugger debugger(halt);
+    debugger.run(100, false);
+    REQUIRE(debugger.get_stop_reason() == STOP_FAULT);
+    REQUIRE(debugger.get_stop_address() == 0x202);
+}
+
+//a program given by its opcodes at 0x200
+static void load_program(Chip8 &chip8, std::initializer_list<uint16_t> opcodes)
+{
+    std::unique_ptr<Chip8State> state(new Chip8State(chip8.get_state()));
+    int address = 0x200;
+    for (uint16_t opcode : opcodes)
+    {
+        state->memory[address++] = (uint8_t) (opcode >> 8);
+        state->memory[address++] = (uint8_t) opcode;
+    }
+    chip8.set_state(*state);
+}
+
+TEST_CASE("queued input")
+{
+    //a key pressed and released inside one batch while FX0A waits for it, the wait passes until the press
+    Chip8 wait;
+    load_program(wait, {0xF10A, 0x1202});
+    wait.queue_keypad(5, 1 << 7);
+    wait.queue_keypad(6, 0);
+    REQUIRE(wait.run_cycles(100, false) == 3);
+    REQUIRE(wait.get_state().V[1] == 7);
+    REQUIRE(wait.get_keypad() == 0);
+    REQUIRE(wait.get_cycle_count() == 100);
+    wait.queue_keypad(150, 1 << 2);
+    wait.queue_keypad(120, 1 << 3); //earlier than the change before it, so it is made after it
+    wait.run_cycles(100, false);
+    REQUIRE(wait.get_keypad() == 1 << 3);
+
+    //V2 counts the loops run while key 0 is held, which translated blocks have to get exactly right too
+    Chip8 interpreter, jit;
+    load_program(interpreter, {0xE09E, 0x1200, 0x7201, 0x1200});
+    load_program(jit, {0xE09E, 0x1200, 0x7201, 0x1200});
+    jit.set_jit(true);
+    for (Chip8 *chip8 : {&interpreter, &jit})
+    {
+        chip8->queue_keypad(1001, 1);
+        chip8->queue_keypad(1031, 0);
+        REQUIRE(chip8->run_cycles(2000, false) == 2000);
+    }
+    REQUIRE(interpreter.get_state().V[2] == 10);
+    REQUIRE(jit.get_state().V[2] == 10);
+}
+
+TEST_CASE("debugger breakpoints, stepping and watchpoints")
+{
+    Chip8 chip8;
+    Debugger debugger(chip8);
+    REQUIRE(chip8.load_rom("../roms/PONG") == true);
+
+    debugger.set_breakpoint(0x200, true); //set before anything ran, still stops on the first instruction
+    REQUIRE(debugger.run(1000, false) == 0);
+    REQUIRE(debugger.get_stop_reason() == STOP_BREAKPOINT);
+    REQUIRE(debugger.step_out() == false); //not in a subroutine
+    debugger.set_breakpoint(0x200, false);
+
+    debugger.set_breakpoint(0x210, true); //PONG calls its score drawing routine at 0x210
+    REQUIRE(debugger.run(1000, false) == 8);
+    REQUIRE(debugger.get_stop_reason() == STOP_BREAKPOINT);
+    REQUIRE(debugger.get_stop_address() == 0x210);
+
+    std::unique_ptr<Chip8State> at_call(new Chip8State(chip8.get_state()));
+    debugger.step();
+    debugger.run(1000, false);
+    REQUIRE(debugger.step_out() == true);
+    debugger.run(1000, false);
+    REQUIRE(debugger.get_stop_reason() == STOP_STEP);
+    REQUIRE(debugger.get_stop_address() == 0x212);
+    chip8.set_state(*at_call); //back at the breakpoint, which is no longer where the debugger stopped
+    REQUIRE(debugger.run(1000, false) == 0);
+    REQUIRE(debugger.get_stop_address() == 0x210);
+
+    debugger.step_over();
+    debugger.run(1000, false);
+    REQUIRE(debugger.get_stop_reason() == STOP_STEP);
+    REQUIRE(debugger.get_stop_address() == 0x212);
+
+    debugger.set_register_watch(6, true); //6603 at 0x212 sets V6
+    REQUIRE(debugger.run(1000, false) == 1);
+    REQUIRE(debugger.get_stop_reason() == STOP_WATCHPOINT);
+    REQUIRE(debugger.get_stop_address() == 6);
+
+    debugger.clear_all();
+    REQUIRE(debugger.run(5, false) == 5);
+    REQUIRE(debugger.get_stop_reason() == STOP_NONE);
+}
+
+TEST_CASE("control flow graph")
+{
+    Chip8 chip8;
+    REQUIRE(chip8.load_rom("../roms/PONG") == true);
+    ControlFlowGraph cfg(chip8.get_memory(), 0x200 + 246, false);
+    cfg.build(0x200);
+
+    //the first block ends in CALL 0x2D4 and falls through to 0x212
+    const BasicBlock &entry = cfg.get_blocks().at(0x200);
+    REQUIRE(entry.end == 0x212);
+    REQUIRE(entry.calls.size() == 1);
+    REQUIRE(entry.calls[0] == 0x2D4);
+    REQUIRE(entry.successors[0] == 0x212);
+
+    //SE V0, 0x00 at 0x21C has both the next and the skipped instruction as successors
+    const BasicBlock &poll = cfg.get_blocks().at(0x21A);
+    REQUIRE(poll.successors.size() == 2);
+    REQUIRE(poll.successors[1] == 0x220);
+
+    //the sprites at the end of the ROM are never decoded
+    REQUIRE(cfg.is_instruction(0x200));
+    REQUIRE_FALSE(cfg.is_instruction(0x2EA));
+}
+
+TEST_CASE("jit runs ROMs exactly like the interpreter")
+{
+    if (!Jit::is_supported())
+    {
+        return;
+    }
+    const char *roms[] = {"../roms/INVADERS", "../roms/KALEID", "../roms/SYZYGY", "../roms/TETRIS"};
+    for (int r = 0; r < 4; r++)
+    {
+        Chip8 interpreter, jit;
+        REQUIRE(interpreter.load_rom(roms[r]) == true);
+        REQUIRE(jit.load_rom(roms[r]) == true);
+        REQUIRE(jit.set_jit(true));
+        for (int frame = 0; frame < 600; frame++)
+        {
+            for (int key = 0; key < 16; key++)
+            {
+                interpreter.set_keypad_value(key, frame / 20 % 16 == key);
+                jit.set_keypad_value(key, frame / 20 % 16 == key);
+            }
+            REQUIRE(interpreter.run_cycles(200, false) == jit.run_cycles(200, false));
+            interpreter.update_timers();
+            jit.update_timers();
+        }
+        for (int row = 0; row < 32; row++)
+        {
+            REQUIRE(interpreter.get_display_row(0, row)[0] == jit.get_display_row(0, row)[0]);
+        }
+    }
+}
+
+TEST_CASE("code written while tracing is translated again")
+{
+    if (!Jit::is_supported())
+    {
+        return;
+    }
+    //a loop adding 1 to V1, and an FX55 at 0x210 that is only reached by moving pc there
+    Chip8 chip8;
+    REQUIRE(chip8.set_jit(true));
+    std::unique_ptr<Chip8State> state(new Chip8State(chip8.get_state()));
+    const uint8_t loop[] = {0x71, 0x01, 0x12, 0x00}, store[] = {0xF0, 0x55, 0x12, 0x00};
+    memcpy(state->memory + 0x200, loop, sizeof(loop));
+    memcpy(state->memory + 0x210, store, sizeof(store));
+    chip8.set_state(*state);
+    chip8.run_cycles(10000, false); //hot enough to be translated
+
+    //only registers change, so set_state keeps the translated loop
+    *state = chip8.get_state();
+    state->pc = 0x210;
+    state->I = 0x200;
+    state->V[0] = 0x72; //7101 becomes 7201, the loop adds to V2 instead
+    chip8.set_state(*state);
+    //the trace lines go to stdout, which is pointed at /dev/null so they don't land in the test output
+    fflush(stdout);
+    int saved_stdout = dup(1);
+    int null_fd = open("/dev/null", O_WRONLY);
+    REQUIRE(null_fd >= 0);
+    dup2(null_fd, 1);
+    close(null_fd);
+    chip8.run_cycles(2, true);
+    fflush(stdout);
+    dup2(saved_stdout, 1);
+    close(saved_stdout);
+    chip8.run_cycles(1000, false);
+    REQUIRE(chip8.get_state().V[1] == state->V[1]);
+    REQUIRE(chip8.get_state().V[2] == (uint8_t) 500); //every other instruction is the add
+}
+
+TEST_CASE("restored snapshots run the same again")
+{
+    for (int use_jit = 0; use_jit < 2; use_jit++)
+    {
+        Chip8 chip8;
+        REQUIRE(chip8.load_rom("../roms/BLITZ") == true);
+        chip8.set_jit(use_jit != 0);
+        chip8.set_keypad(1 << 5);
+        chip8.run_cycles(100000, false); //past the title screen
+        std::unique_ptr<Chip8State> snapshot(new Chip8State(chip8.get_state()));
+        uint64_t hashes[2];
+        for (int run = 0; run < 2; run++)
+        {
+            chip8.set_state(*snapshot);
+            for (int frame = 0; frame < 120; frame++)
+            {
+                chip8.run_cycles(200, false);
+                chip8.update_timers();
+            }
+            hashes[run] = chip8.get_display_hash();
+        }
+        REQUIRE(hashes[0] == hashes[1]);
+        REQUIRE(chip8.get_cycle_count() == snapshot->cycle_count + 120 * 200);
+    }
+}
+
+TEST_CASE("palette expansion")
+{
+    const uint32_t palette[4] = {0xFF000000, 0xFFFFFFFF, 0xFFAAAAAA, 0xFF555555};
+    ExpandTable table;
+    build_expand_table(palette, table);
+    uint64_t seed = 1;
+    for (int i = 0; i < 100; i++)
+    {
+        uint64_t planes[2][2];
+        for (int w = 0; w < 4; w++)
+        {
+            seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+            planes[w / 2][w % 2] = seed;
+        }
+        for (int width = 64; width <= 128; width += 64)
+        {
+            uint32_t pixels[128], expected[128];
+            expand_row(planes[0], planes[1], width, table, pixels);
+            for (int x = 0; x < width; x++)
+            {
+                int bit = 63 - (x & 63);
+                expected[x] = palette[((planes[0][x >> 6] >> bit) & 1) | (((planes[1][x >> 6] >> bit) & 1) << 1)];
+            }
+            REQUIRE(memcmp(pixels, expected, width * sizeof(uint32_t)) == 0);
+        }
+    }
+}
+
+TEST_CASE("integer row scaling")
+{
+    uint32_t in[128], out[128 * 10];
+    for (int x = 0; x < 128; x++)
+    {
+        in[x] = 0xFF000000u | (uint32_t) x;
+    }
+    for (int scale = 1; scale <= 10; scale++)
+    {
+        scale_row(in, 128, scale, out);
+        bool same = true;
+        for (int x = 0; x < 128 * scale; x++)
+        {
+            same = same && out[x] == in[x / scale];
+        }
+        REQUIRE(same);
+    }
+}
+
+TEST_CASE("overlay numbers and graph")
+{
+    Overlay overlay;
+    for (int i = 0; i < Overlay::AVERAGE; i++)
+    {
+        overlay.record(FrameTimes{2000, 100, 100, 100, 14000, 1000000.0f / 60, 11});
+    }
+    std::vector<uint32_t> pixels(Overlay::WIDTH * Overlay::HEIGHT);
+    overlay.draw(pixels.data(), Overlay::WIDTH);
+
+    //60 frames per second in the first row, the top of the 6 is a full line and the row under it only the left end
+    const uint32_t white = 0xFFFFFFFF;
+    for (int x = 12; x < 16; x++)
+    {
+        REQUIRE(pixels[4 * Overlay::WIDTH + x] == white);
+    }
+    REQUIRE(pixels[5 * Overlay::WIDTH + 12] == white);
+    REQUIRE(pixels[5 * Overlay::WIDTH + 13] != white);
+    REQUIRE(pixels[4 * Overlay::WIDTH + 4] == white); //its swatch
+
+    //the newest frame is the rightmost column of the graph, 2ms of emulation at the bottom
+    int bottom = Overlay::HEIGHT - 5, right = Overlay::HISTORY + 3;
+    REQUIRE(pixels[bottom * Overlay::WIDTH + right] == pixels[(4 + 2 * 7) * Overlay::WIDTH + 4]);
+    REQUIRE(pixels[(bottom - 1) * Overlay::WIDTH + right] == pixels[(4 + 2 * 7) * Overlay::WIDTH + 4]);
+    REQUIRE(pixels[(bottom - 2) * Overlay::WIDTH + right] != pixels[(4 + 2 * 7) * Overlay::WIDTH + 4]);
+}
+
+TEST_CASE("histogram percentiles")
+{
+    Histogram small;
+    REQUIRE(small.percentile(0.5) == 0);
+    for (uint64_t value = 1; value <= 100; value++)
+    {
+        small.record(value);
+    }
+    REQUIRE(small.count() == 100);
+    REQUIRE(small.percentile(0.5) == 50); //exact below 128
+    REQUIRE(small.percentile(0.99) == 99);
+    REQUIRE(small.max() == 100);
+
+    //a million microseconds in nanoseconds, every percentile within 1.6% over
+    Histogram large;
+    for (uint64_t us = 1; us <= 1000000; us++)
+    {
+        large.record(us * 1000);
+    }
+    const double fractions[] = {0.5, 0.9, 0.99, 0.999};
+    for (double fraction : fractions)
+    {
+        double exact = fraction * 1000000 * 1000;
+        REQUIRE(large.percentile(fraction) >= exact);
+        REQUIRE(large.percentile(fraction) <= exact * 1.016);
+    }
+    REQUIRE(large.percentile(1.0) == 1000000000);
+
+    large.record((uint64_t) 1 << 50); //past the last bucket, still counted
+    REQUIRE(large.max() == (uint64_t) 1 << 50);
+    REQUIRE(large.percentile(1.0) == (uint64_t) 1 << 50);
+}
+
+#ifdef CHIP8_TRACE
+TEST_CASE("trace export")
+{
+    TRACE_THREAD("test");
+    {
+        TRACE_SCOPE("outer");
+        TRACE_SCOPE("inner");
+    }
+    REQUIRE(trace_write("trace_test.json") == true); //recording stops here for the rest of the run
+    std::ifstream file("trace_test.json");
+    std::string json((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    REQUIRE(json.compare(0, 15, "{\"traceEvents\":") == 0);
+    REQUIRE(json.find("\"args\":{\"name\":\"test\"}") != std::string::npos);
+    REQUIRE(json.find("\"name\":\"outer\",\"ph\":\"X\"") != std::string::npos);
+    REQUIRE(json.find("\"name\":\"inner\",\"ph\":\"X\"") != std::string::npos);
+}
+#endif
@@ -0,0 +1,154 @@
+//
+// Golden framebuffer hashes for every ROM in roms/. After a change that is meant to alter what ROMs draw, rerun
+// with CHIP8_UPDATE_GOLDEN=1 ./tests to rewrite test/golden and check the new files in
+//
+
+#include <dirent.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "../catch/catch.hpp"
+#include "../src/chip8.h"
+
+static const int GOLDEN_FRAMES = 600;
+static const int GOLDEN_CYCLES = 11; //the emulator's default instructions per frame
+
+//the same input for every ROM, each key in turn is held for 10 frames with 10 frames of nothing in between
+static void press_keys(Chip8 &chip8, int frame)
+{
+    for (int key = 0; key < 16; key++)
+    {
+        chip8.set_keypad_value(key, frame % 20 < 10 && frame / 20 % 16 == key);
+    }
+}
+
+static void run_frame(Chip8 &chip8, int frame)
+{
+    press_keys(chip8, frame);
+    chip8.run_cycles(GOLDEN_CYCLES, false);
+    chip8.update_timers();
+}
+
+static std::vector<std::string> ascii_display(Chip8 &chip8)
+{
+    std::vector<std::string> rows;
+    int width = chip8.get_display_width();
+    for (int y = 0; y < chip8.get_display_height(); y++)
+    {
+        std::string row;
+        for (int x = 0; x < width; x++)
+        {
+            row += chip8.get_display_value(y * width + x) != 0 ? '#' : '.';
+        }
+        rows.push_back(row);
+    }
+    return rows;
+}
+
+//the divergent frame against the one before it, which still matched: + was drawn, - was erased
+static std::string ascii_diff(const std::string &rom, int frame)
+{
+    Chip8 chip8;
+    chip8.load_rom(rom);
+    for (int i = 0; i < frame; i++)
+    {
+        run_frame(chip8, i);
+    }
+    std::vector<std::string> before = ascii_display(chip8);
+    run_frame(chip8, frame);
+    std::vector<std::string> after = ascii_display(chip8);
+
+    std::string diff;
+    for (size_t y = 0; y < after.size(); y++)
+    {
+        for (size_t x = 0; x < after[y].size(); x++)
+        {
+            char was = y < before.size() && x < before[y].size() ? before[y][x] : '.';
+            diff += was == after[y][x] ? after[y][x] : after[y][x] == '#' ? '+' : '-';
+        }
+        diff += '\n';
+    }
+    return diff;
+}
+
+static std::vector<std::string> list_roms()
+{
+    std::vector<std::string> roms;
+    DIR *dir = opendir("../roms");
+    for (dirent *entry = dir != nullptr ? readdir(dir) : nullptr; entry != nullptr; entry = readdir(dir))
+    {
+        if (entry->d_name[0] != '.')
+        {
+            roms.push_back(entry->d_name);
+        }
+    }
+    if (dir != nullptr)
+    {
+        closedir(dir);
+    }
+    std::sort(roms.begin(), roms.end());
+    return roms;
+}
+
+TEST_CASE("golden framebuffer hashes")
+{
+    bool update = getenv("CHIP8_UPDATE_GOLDEN") != nullptr;
+    std::vector<std::string> roms = list_roms();
+    REQUIRE(!roms.empty());
+
+    for (size_t r = 0; r < roms.size(); r++)
+    {
+        std::string rom = "../roms/" + roms[r], golden_path = "../test/golden/" + roms[r] + ".txt";
+        Chip8 chip8;
+        REQUIRE(chip8.load_rom(rom) == true);
+        std::vector<uint64_t> hashes;
+        for (int frame = 0; frame < GOLDEN_FRAMES; frame++)
+        {
+            run_frame(chip8, frame);
+            hashes.push_back(chip8.get_display_hash());
+        }
+
+        if (update)
+        {
+            std::ofstream out(golden_path);
+            REQUIRE(out.is_open());
+            out << "# " << roms[r] << ", " << GOLDEN_FRAMES << " frames of " << GOLDEN_CYCLES << " instructions\n";
+            for (size_t i = 0; i < hashes.size(); i++)
+            {
+                char line[32];
+                snprintf(line, sizeof(line), "%.16llx\n", (unsigned long long) hashes[i]);
+                out << line;
+            }
+            continue;
+        }
+
+        std::ifstream in(golden_path);
+        if (!in.is_open())
+        {
+            FAIL(golden_path << " is missing, run CHIP8_UPDATE_GOLDEN=1 ./tests to create it");
+        }
+        std::vector<uint64_t> expected;
+        std::string line;
+        while (getline(in, line))
+        {
+            if (!line.empty() && line[0] != '#')
+            {
+                expected.push_back(strtoull(line.c_str(), nullptr, 16));
+            }
+        }
+        REQUIRE(expected.size() == hashes.size());
+
+        std::vector<uint64_t>::iterator first = std::mismatch(hashes.begin(), hashes.end(), expected.begin()).first;
+        if (first != hashes.end())
+        {
+            int frame = (int) (first - hashes.begin());
+            std::ostringstream message;
+            message << roms[r] << " first differs at frame " << frame << "\n" << ascii_diff(rom, frame);
+            FAIL_CHECK(message.str());
+        }
+    }
+}
@@ -0,0 +1,547 @@
+//
+// Every instruction of the original CHIP-8 set run on its own against a reference written from the spec, over all
+// the inputs that matter. Rows are split into chunks that run on all cores, Catch only sees the collected failures
+//
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+#include "../catch/catch.hpp"
+#include "../src/chip8.h"
+#include "../src/memory_policy.h"
+
+static const int CHUNK = 4096; //inputs run by a worker before it picks the next chunk
+
+//V1 and V2 are the X and Y of every two register instruction, I points at scratch memory
+static const uint16_t SCRATCH = 0x300;
+
+//out of range stack pointers and keys only have a defined result when the build wraps them
+static const bool MASKED = std::is_same<MemoryPolicy, MaskedMemory>::value;
+static const int STACK_DEPTH = MASKED ? 16 : 15; //calls made from this depth don't leave sp out of range
+static const int KEY_VALUES = MASKED ? 256 : 16; //values of VX tried for the key skips
+
+//the only memory any row reads or writes besides the font, the rest is left out of the copies and compares
+static const int WINDOW_START = 0x200, WINDOW_END = 0x400;
+
+struct OpcodeRow
+{
+    const char *name;
+    int inputs;
+    void (*setup)(Chip8State &, int); //writes the instruction at 0x200 and the registers for one input
+    void (*reference)(Chip8State &); //what the instruction should do to the state setup left
+};
+
+static void put_opcode(Chip8State &s, int opcode)
+{
+    s.memory[0x200] = (uint8_t) (opcode >> 8);
+    s.memory[0x201] = (uint8_t) opcode;
+}
+
+static int opcode_at_pc(const Chip8State &s)
+{
+    return (s.memory[s.pc] << 8) | s.memory[s.pc + 1];
+}
+
+//two register instructions take VX from the low and VY from the high byte of the input
+static void setup_xy(Chip8State &s, int opcode, int input)
+{
+    put_opcode(s, opcode);
+    s.V[1] = (uint8_t) input;
+    s.V[2] = (uint8_t) (input >> 8);
+}
+
+//3XNN and friends take VX from the low and NN from the high byte
+static void setup_x_nn(Chip8State &s, int opcode, int input)
+{
+    put_opcode(s, opcode | (input >> 8));
+    s.V[1] = (uint8_t) input;
+}
+
+static void advance(Chip8State &s, bool skip)
+{
+    s.pc += skip ? 4 : 2;
+}
+
+static void set_vf(Chip8State &s, uint8_t result, bool flag)
+{
+    s.V[1] = result;
+    s.V[0xF] = flag ? 1 : 0;
+}
+
+static const OpcodeRow rows[] = {
+        {"00E0 CLS", 1,
+                [](Chip8State &s, int)
+                {
+                    put_opcode(s, 0x00E0);
+                    memset(s.display, 0xA5, sizeof(s.display));
+                },
+                [](Chip8State &s)
+                {
+                    memset(s.display[0], 0, sizeof(s.display[0])); //only plane 0 is selected
+                    s.draw_flag = true;
+                    advance(s, false);
+                }},
+        {"00EE RET", 16,
+                [](Chip8State &s, int input)
+                {
+                    put_opcode(s, 0x00EE);
+                    s.sp = (uint8_t) (input + 1);
+                    s.stack[input] = (uint16_t) (0x400 + input * 2);
+                },
+                [](Chip8State &s)
+                {
+                    s.sp--;
+                    s.pc = (uint16_t) (s.stack[s.sp] + 2);
+                }},
+        {"1NNN JP", 4096,
+                [](Chip8State &s, int input) { put_opcode(s, 0x1000 | input); },
+                [](Chip8State &s)
+                {
+                    int target = opcode_at_pc(s) & 0x0FFF;
+                    s.idle_state = target == s.pc ? IDLE_HALT : IDLE_NONE;
+                    s.pc = (uint16_t) target;
+                }},
+        {"00EE RET with nothing on the stack", MASKED ? 1 : 0,
+                [](Chip8State &s, int)
+                {
+                    put_opcode(s, 0x00EE);
+                    s.stack[15] = 0x400;
+                },
+                [](Chip8State &s)
+                {
+                    s.sp = 15; //the stack is a ring of 16
+                    s.pc = 0x402;
+                }},
+        {"2NNN CALL", 4096,
+                [](Chip8State &s, int input)
+                {
+                    put_opcode(s, 0x2000 | input);
+                    s.sp = (uint8_t) (input % STACK_DEPTH);
+                },
+                [](Chip8State &s)
+                {
+                    s.stack[s.sp] = s.pc;
+                    s.sp = (uint8_t) ((s.sp + 1) & 0xF); //a 17th call overwrites the oldest return address
+                    s.pc = (uint16_t) (opcode_at_pc(s) & 0x0FFF);
+                }},
+        {"3XNN SE", 65536,
+                [](Chip8State &s, int input) { setup_x_nn(s, 0x3100, input); },
+                [](Chip8State &s) { advance(s, s.V[1] == (opcode_at_pc(s) & 0xFF)); }},
+        {"4XNN SNE", 65536,
+                [](Chip8State &s, int input) { setup_x_nn(s, 0x4100, input); },
+                [](Chip8State &s) { advance(s, s.V[1] != (opcode_at_pc(s) & 0xFF)); }},
+        {"5XY0 SE", 65536,
+                [](Chip8State &s, int input) { setup_xy(s, 0x5120, input); },
+                [](Chip8State &s) { advance(s, s.V[1] == s.V[2]); }},
+        {"3XNN SE over F000 NNNN", 2,
+                [](Chip8State &s, int input)
+                {
+                    setup_x_nn(s, 0x3100, input);
+                    s.xo_chip = true;
+                    s.memory[0x202] = 0xF0;
+                },
+                [](Chip8State &s) { s.pc += s.V[1] == 0 ? 6 : 2; }},
+        {"EX9E SKP over F000 NNNN", 2,
+                [](Chip8State &s, int input)
+                {
+                    put_opcode(s, 0xE19E);
+                    s.keypad = (uint16_t) input;
+                    s.xo_chip = true;
+                    s.memory[0x202] = 0xF0;
+                },
+                [](Chip8State &s) { s.pc += s.keypad != 0 ? 6 : 2; }},
+        {"EXA1 SKNP over F000 NNNN", 2,
+                [](Chip8State &s, int input)
+                {
+                    put_opcode(s, 0xE1A1);
+                    s.keypad = (uint16_t) input;
+                    s.xo_chip = true;
+                    s.memory[0x202] = 0xF0;
+                },
+                [](Chip8State &s) { s.pc += s.keypad == 0 ? 6 : 2; }},
+        {"6XNN LD", 256,
+                [](Chip8State &s, int input) { put_opcode(s, 0x6100 | input); },
+                [](Chip8State &s)
+                {
+                    s.V[1] = (uint8_t) opcode_at_pc(s);
+                    advance(s, false);
+                }},
+        {"7XNN ADD", 65536,
+                [](Chip8State &s, int input) { setup_x_nn(s, 0x7100, input); },
+                [](Chip8State &s)
+                {
+                    s.V[1] = (uint8_t) (s.V[1] + opcode_at_pc(s)); //VF is left alone
+                    advance(s, false);
+                }},
+        {"8XY0 LD", 65536,
+                [](Chip8State &s, int input) { setup_xy(s, 0x8120, input); },
+                [](Chip8State &s)
+                {
+                    s.V[1] = s.V[2];
+                    advance(s, false);
+                }},
+        {"8XY1 OR", 65536,
+                [](Chip8State &s, int input) { setup_xy(s, 0x8121, input); },
+                [](Chip8State &s)
+                {
+                    set_vf(s, s.V[1] | s.V[2], false);
+                    advance(s, false);
+                }},
+        {"8XY2 AND", 65536,
+                [](Chip8State &s, int input) { setup_xy(s, 0x8122, input); },
+                [](Chip8State &s)
+                {
+                    set_vf(s, s.V[1] & s.V[2], false);
+                    advance(s, false);
+                }},
+        {"8XY3 XOR", 65536,
+                [](Chip8State &s, int input) { setup_xy(s, 0x8123, input); },
+                [](Chip8State &s)
+                {
+                    set_vf(s, s.V[1] ^ s.V[2], false);
+                    advance(s, false);
+                }},
+        {"8XY4 ADD", 65536,
+                [](Chip8State &s, int input) { setup_xy(s, 0x8124, input); },
+                [](Chip8State &s)
+                {
+                    set_vf(s, (uint8_t) (s.V[1] + s.V[2]), s.V[1] + s.V[2] > 255);
+                    advance(s, false);
+                }},
+        {"8XY5 SUB", 65536,
+                [](Chip8State &s, int input) { setup_xy(s, 0x8125, input); },
+                [](Chip8State &s)
+                {
+                    set_vf(s, (uint8_t) (s.V[1] - s.V[2]), s.V[1] >= s.V[2]);
+                    advance(s, false);
+                }},
+        {"8XY6 SHR", 65536,
+                [](Chip8State &s, int input) { setup_xy(s, 0x8126, input); },
+                [](Chip8State &s)
+                {
+                    set_vf(s, (uint8_t) (s.V[1] >> 1), (s.V[1] & 1) != 0); //VY is ignored
+                    advance(s, false);
+                }},
+        {"8XY7 SUBN", 65536,
+                [](Chip8State &s, int input) { setup_xy(s, 0x8127, input); },
+                [](Chip8State &s)
+                {
+                    set_vf(s, (uint8_t) (s.V[2] - s.V[1]), s.V[2] >= s.V[1]);
+                    advance(s, false);
+                }},
+        {"8XYE SHL", 65536,
+                [](Chip8State &s, int input) { setup_xy(s, 0x812E, input); },
+                [](Chip8State &s)
+                {
+                    set_vf(s, (uint8_t) (s.V[1] << 1), (s.V[1] & 0x80) != 0);
+                    advance(s, false);
+                }},
+        {"9XY0 SNE", 65536,
+                [](Chip8State &s, int input) { setup_xy(s, 0x9120, input); },
+                [](Chip8State &s) { advance(s, s.V[1] != s.V[2]); }},
+        {"ANNN LD I", 4096,
+                [](Chip8State &s, int input) { put_opcode(s, 0xA000 | input); },
+                [](Chip8State &s)
+                {
+                    s.I = (uint16_t) (opcode_at_pc(s) & 0x0FFF);
+                    advance(s, false);
+                }},
+        {"BNNN JP V0", 65536,
+                [](Chip8State &s, int input)
+                {
+                    put_opcode(s, 0xB000 | (input >> 4));
+                    s.V[0] = (uint8_t) input;
+                },
+                [](Chip8State &s) { s.pc = (uint16_t) ((opcode_at_pc(s) & 0x0FFF) + s.V[0]); }},
+        {"CXNN RND", 256,
+                [](Chip8State &s, int input) { put_opcode(s, 0xC100 | input); },
+                [](Chip8State &s)
+                {
+                    s.V[1] = (uint8_t) (5 & opcode_at_pc(s)); //single_cycle still uses a fixed number
+                    advance(s, false);
+                }},
+        {"DXYN DRW", 65536,
+                [](Chip8State &s, int input)
+                {
+                    setup_xy(s, 0xD125, input);
+                    s.I = 8 * 5; //the font's 8 has pixels in every row and column
+                    for (int row = 0; row < 32; row++)
+                    {
+                        s.display[0][row][0] = row % 3 == 0 ? 0x8000000000000001ull : 0;
+                    }
+                },
+                [](Chip8State &s)
+                {
+                    bool collision = false;
+                    for (int row = 0; row < 5; row++)
+                    {
+                        for (int col = 0; col < 8; col++)
+                        {
+                            if ((s.memory[s.I + row] & (0x80 >> col)) == 0)
+                            {
+                                continue;
+                            }
+                            //each row wraps on its own, a pixel past the right edge comes back on the left of
+                            //the same row and not at the start of the next one
+                            int x = (s.V[1] + col) % 64, y = (s.V[2] + row) % 32;
+                            uint64_t bit = 1ull << (63 - x);
+                            collision |= (s.display[0][y][0] & bit) != 0;
+                            s.display[0][y][0] ^= bit;
+                        }
+                    }
+                    s.V[0xF] = collision ? 1 : 0;
+                    s.draw_flag = true;
+                    advance(s, false);
+                }},
+        {"EX9E SKP", KEY_VALUES * 16,
+                [](Chip8State &s, int input)
+                {
+                    put_opcode(s, 0xE19E);
+                    s.V[1] = (uint8_t) (input % KEY_VALUES);
+                    s.keypad = (uint16_t) (1 << input / KEY_VALUES);
+                },
+                [](Chip8State &s) { advance(s, (s.keypad >> (s.V[1] & 0xF) & 1) != 0); }},
+        {"EXA1 SKNP", KEY_VALUES * 16,
+                [](Chip8State &s, int input)
+                {
+                    put_opcode(s, 0xE1A1);
+                    s.V[1] = (uint8_t) (input % KEY_VALUES);
+                    s.keypad = (uint16_t) (1 << input / KEY_VALUES);
+                },
+                [](Chip8State &s) { advance(s, (s.keypad >> (s.V[1] & 0xF) & 1) == 0); }},
+        {"FX07 LD DT", 256,
+                [](Chip8State &s, int input)
+                {
+                    put_opcode(s, 0xF107);
+                    s.delay_timer = (uint8_t) input;
+                },
+                [](Chip8State &s)
+                {
+                    s.V[1] = s.delay_timer;
+                    advance(s, false);
+                }},
+        {"FX0A LD K", 65536,
+                [](Chip8State &s, int input)
+                {
+                    put_opcode(s, 0xF10A);
+                    s.keypad = (uint16_t) input;
+                },
+                [](Chip8State &s)
+                {
+                    //with several keys down the lowest one wins, with none pc stays put until a key is pressed
+                    int key = 0;
+                    while (key < 16 && ((s.keypad >> key) & 1) == 0)
+                    {
+                        key++;
+                    }
+                    if (key == 16)
+                    {
+                        s.idle_state = IDLE_KEY;
+                        return;
+                    }
+                    s.V[1] = (uint8_t) key;
+                    advance(s, false);
+                }},
+        {"FX15 LD DT", 256,
+                [](Chip8State &s, int input)
+                {
+                    put_opcode(s, 0xF115);
+                    s.V[1] = (uint8_t) input;
+                },
+                [](Chip8State &s)
+                {
+                    s.delay_timer = s.V[1];
+                    advance(s, false);
+                }},
+        {"FX18 LD ST", 256,
+                [](Chip8State &s, int input)
+                {
+                    put_opcode(s, 0xF118);
+                    s.V[1] = (uint8_t) input;
+                },
+                [](Chip8State &s)
+                {
+                    s.sound_timer = s.V[1];
+                    advance(s, false);
+                }},
+        {"FX1E ADD I", 65536,
+                [](Chip8State &s, int input)
+                {
+                    put_opcode(s, 0xF11E);
+                    s.I = (uint16_t) (input >> 4);
+                    s.V[1] = (uint8_t) (input * 7);
+                },
+                [](Chip8State &s)
+                {
+                    s.V[0xF] = s.I + s.V[1] > 0xFFF ? 1 : 0; //overflow past 4k, which some ROMs rely on
+                    s.I = (uint16_t) (s.I + s.V[1]);
+                    advance(s, false);
+                }},
+        {"FX29 LD F", 256,
+                [](Chip8State &s, int input)
+                {
+                    put_opcode(s, 0xF129);
+                    s.V[1] = (uint8_t) input;
+                },
+                [](Chip8State &s)
+                {
+                    s.I = (uint16_t) (s.V[1] * 5);
+                    advance(s, false);
+                }},
+        {"FX33 LD B", 256,
+                [](Chip8State &s, int input)
+                {
+                    put_opcode(s, 0xF133);
+                    s.V[1] = (uint8_t) input;
+                },
+                [](Chip8State &s)
+                {
+                    s.memory[s.I] = (uint8_t) (s.V[1] / 100);
+                    s.memory[s.I + 1] = (uint8_t) (s.V[1] / 10 % 10);
+                    s.memory[s.I + 2] = (uint8_t) (s.V[1] % 10);
+                    advance(s, false);
+                }},
+        {"FX55 LD [I]", 16,
+                [](Chip8State &s, int input)
+                {
+                    put_opcode(s, 0xF055 | input << 8);
+                    for (int i = 0; i < 16; i++)
+                    {
+                        s.V[i] = (uint8_t) (i * 17 + 3);
+                    }
+                },
+                [](Chip8State &s)
+                {
+                    int x = (opcode_at_pc(s) >> 8) & 0xF;
+                    memcpy(s.memory + s.I, s.V, (size_t) x + 1);
+                    s.I = (uint16_t) (s.I + x + 1);
+                    advance(s, false);
+                }},
+        {"FX65 LD V", 16,
+                [](Chip8State &s, int input)
+                {
+                    put_opcode(s, 0xF065 | input << 8);
+                    for (int i = 0; i < 16; i++)
+                    {
+                        s.memory[SCRATCH + i] = (uint8_t) (i * 17 + 3);
+                    }
+                },
+                [](Chip8State &s)
+                {
+                    int x = (opcode_at_pc(s) >> 8) & 0xF;
+                    memcpy(s.V, s.memory + s.I, (size_t) x + 1);
+                    s.I = (uint16_t) (s.I + x + 1);
+                    advance(s, false);
+                }},
+};
+
+//names the first part of the state that differs, empty if there is none
+static std::string compare_states(const Chip8State &a, const Chip8State &b)
+{
+    for (int i = 0; i < 16; i++)
+    {
+        if (a.V[i] != b.V[i])
+        {
+            std::ostringstream name;
+            name << "V" << std::hex << std::uppercase << i;
+            return name.str();
+        }
+    }
+    if (a.I != b.I) return "I";
+    if (a.pc != b.pc) return "pc";
+    if (a.sp != b.sp) return "sp";
+    if (memcmp(a.stack, b.stack, sizeof(a.stack)) != 0) return "stack";
+    if (a.delay_timer != b.delay_timer || a.sound_timer != b.sound_timer) return "timers";
+    if (memcmp(a.memory + WINDOW_START, b.memory + WINDOW_START, WINDOW_END - WINDOW_START) != 0) return "memory";
+    if (memcmp(a.display, b.display, sizeof(a.display)) != 0) return "display";
+    if (a.draw_flag != b.draw_flag) return "draw flag";
+    if (a.idle_state != b.idle_state) return "idle state";
+    if (a.fault.code != b.fault.code || a.fault.pc != b.fault.pc || a.fault.opcode != b.fault.opcode) return "fault";
+    return "";
+}
+
+//a full copy of the state is mostly memory, so only the window is copied over a state that already matches elsewhere
+static void copy_state(Chip8State &to, const Chip8State &from)
+{
+    size_t start = offsetof(Chip8State, memory), end = start + sizeof(from.memory);
+    memcpy(&to, &from, start);
+    memcpy(to.memory + WINDOW_START, from.memory + WINDOW_START, WINDOW_END - WINDOW_START);
+    memcpy((char *) &to + end, (const char *) &from + end, sizeof(Chip8State) - end);
+}
+
+//runs inputs [first, first + count) of a row, returns a message for the first input that went wrong
+static std::string run_chunk(const OpcodeRow &row, int first, int count)
+{
+    Chip8 chip8;
+    std::unique_ptr<Chip8State> clean(new Chip8State(chip8.get_state())), input(new Chip8State(*clean)),
+            expected(new Chip8State(*clean));
+    clean->I = SCRATCH;
+
+    for (int n = first; n < first + count; n++)
+    {
+        copy_state(*input, *clean);
+        row.setup(*input, n);
+        copy_state(*expected, *input);
+        row.reference(*expected);
+
+        chip8.set_state(*input);
+        chip8.single_cycle(false);
+        std::string field = compare_states(chip8.get_state(), *expected);
+        if (!field.empty())
+        {
+            std::ostringstream message;
+            message << row.name << ": input " << n << " (V0 " << (int) input->V[0] << ", V1 " << (int) input->V[1]
+                    << ", V2 " << (int) input->V[2] << ", I " << input->I << ") left the wrong " << field;
+            return message.str();
+        }
+    }
+    return "";
+}
+
+TEST_CASE("every opcode matches the reference")
+{
+    //one job per chunk of each row, taken in turn by the workers
+    std::vector<std::pair<int, int>> jobs;
+    for (int r = 0; r < (int) (sizeof(rows) / sizeof(rows[0])); r++)
+    {
+        for (int first = 0; first < rows[r].inputs; first += CHUNK)
+        {
+            jobs.push_back(std::make_pair(r, first));
+        }
+    }
+
+    std::vector<std::string> failures(jobs.size());
+    std::atomic<int> next(0);
+    std::vector<std::thread> workers;
+    int thread_count = std::max(1, (int) std::thread::hardware_concurrency());
+    for (int t = 0; t < thread_count; t++)
+    {
+        workers.push_back(std::thread([&]()
+                                      {
+                                          for (int job = next++; job < (int) jobs.size(); job = next++)
+                                          {
+                                              const OpcodeRow &row = rows[jobs[job].first];
+                                              int first = jobs[job].second;
+                                              failures[job] = run_chunk(row, first,
+                                                                        std::min(CHUNK, row.inputs - first));
+                                          }
+                                      }));
+    }
+    for (size_t t = 0; t < workers.size(); t++)
+    {
+        workers[t].join();
+    }
+
+    for (size_t job = 0; job < jobs.size(); job++)
+    {
+        INFO(failures[job]);
+        CHECK(failures[job].empty());
+    }
+}
@@ -0,0 +1,382 @@
+//
+// Translates a ROM ahead of time into C++ that runs on a Chip8State, to be built as a shared library and loaded
+// with -aot. Drawing, scrolling, FX0A, CXNN, BNNN and instructions that write memory are left to the interpreter,
+// which also lets the emulator notice when the program overwrites translated code
+//
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <set>
+#include <sstream>
+#include <vector>
+#include "../src/aot.h"
+#include "../src/chip8.h"
+#include "../src/disasm.h"
+#include "../src/opcodes.h"
+
+static const uint8_t *memory;
+static bool xo_chip;
+
+static int opcode_at(int address)
+{
+    return (memory[(uint16_t) address] << 8) | memory[(uint16_t) (address + 1)];
+}
+
+//instructions with side effects outside Chip8State or on memory
+static bool is_interpreted(Op op)
+{
+    switch (op)
+    {
+        case OP_INVALID:
+        case OP_CLS:
+        case OP_SCROLL_DOWN:
+        case OP_SCROLL_UP:
+        case OP_SCROLL_RIGHT:
+        case OP_SCROLL_LEFT:
+        case OP_LORES:
+        case OP_HIRES:
+        case OP_SAVE_RANGE:
+        case OP_JP_V0:
+        case OP_RND:
+        case OP_DRW:
+        case OP_WAIT_KEY:
+        case OP_BCD:
+        case OP_STORE:
+            return true;
+        default:
+            return false;
+    }
+}
+
+//pc after a taken skip, F000 NNNN can be overwritten at run time so XO-CHIP ROMs check for it when skipping
+static std::string skip_target(int next)
+{
+    char text[96];
+    if (xo_chip)
+    {
+        snprintf(text, sizeof(text), "skip_from(s, 0x%.4X)", next);
+    }
+    else
+    {
+        snprintf(text, sizeof(text), "0x%.4X", (uint16_t) (next + 2));
+    }
+    return text;
+}
+
+//writes the C++ for one instruction, returns true if it ends the block by setting pc
+static bool translate(std::ostream &out, int address)
+{
+    int opcode = opcode_at(address);
+    int x = (opcode & 0x0F00) >> 8, y = (opcode & 0x00F0) >> 4, nn = opcode & 0x00FF;
+    int nnn = opcode & 0x0FFF, next = (uint16_t) (address + 2);
+    char line[256];
+
+    snprintf(line, sizeof(line), "                //%.4X  %s\n", address,
+             format_instruction(opcode, opcode_at(address + 2)).c_str());
+    out << line;
+    switch (decode(opcode))
+    {
+        case OP_RET:
+            out << "                s->sp = (s->sp - 1) & 0xF;\n"
+                << "                s->pc = s->stack[s->sp] + 2;\n";
+            return true;
+
+        case OP_JP:
+            if (nnn == address)
+            {
+                out << "                s->idle_state = IDLE_HALT;\n";
+            }
+            else if (nnn + 4 == address)
+            {
+                snprintf(line, sizeof(line), "                if (is_delay_poll_loop(s, 0x%.3X))\n"
+                                             "                {\n"
+                                             "                    s->idle_state = IDLE_TIMER;\n"
+                                             "                }\n", nnn);
+                out << line;
+            }
+            snprintf(line, sizeof(line), "                s->pc = 0x%.3X;\n", nnn);
+            out << line;
+            return true;
+
+        case OP_CALL:
+            snprintf(line, sizeof(line), "                s->stack[s->sp & 0xF] = 0x%.4X;\n"
+                                         "                s->sp = (s->sp + 1) & 0xF;\n"
+                                         "                s->pc = 0x%.3X;\n", address, nnn);
+            out << line;
+            return true;
+
+        case OP_SE_BYTE:
+        case OP_SNE_BYTE:
+        case OP_SE_REG:
+        case OP_SNE_REG:
+        {
+            Op op = decode(opcode);
+            char operand[16];
+            if (op == OP_SE_BYTE || op == OP_SNE_BYTE)
+            {
+                snprintf(operand, sizeof(operand), "0x%.2X", nn);
+            }
+            else
+            {
+                snprintf(operand, sizeof(operand), "s->V[0x%X]", y);
+            }
+            snprintf(line, sizeof(line), "                s->pc = s->V[0x%X] %s %s ? %s : 0x%.4X;\n", x,
+                     op == OP_SE_BYTE || op == OP_SE_REG ? "==" : "!=", operand, skip_target(next).c_str(), next);
+            out << line;
+            return true;
+        }
+
+        case OP_SKP:
+        case OP_SKNP:
+            snprintf(line, sizeof(line),
+                     "                s->pc = (s->keypad >> (s->V[0x%X] & 0xF) & 1) %s 0 ? %s : 0x%.4X;\n", x,
+                     decode(opcode) == OP_SKP ? "!=" : "==", skip_target(next).c_str(), next);
+            out << line;
+            return true;
+
+        case OP_LOAD_RANGE:
+        {
+            int step = x <= y ? 1 : -1;
+            for (int i = 0; i <= (y - x) * step; i++)
+            {
+                snprintf(line, sizeof(line),
+                         "                s->V[0x%X] = s->memory[(s->I + %d) & s->memory_mask];\n",
+                         x + i * step, i);
+                out << line;
+            }
+            return false;
+        }
+
+        case OP_LD_BYTE:
+            snprintf(line, sizeof(line), "                s->V[0x%X] = 0x%.2X;\n", x, nn);
+            break;
+        case OP_ADD_BYTE:
+            snprintf(line, sizeof(line), "                s->V[0x%X] += 0x%.2X;\n", x, nn);
+            break;
+        case OP_LD_REG:
+            snprintf(line, sizeof(line), "                s->V[0x%X] = s->V[0x%X];\n", x, y);
+            break;
+        case OP_OR:
+        case OP_AND:
+        case OP_XOR:
+        {
+            Op op = decode(opcode);
+            snprintf(line, sizeof(line), "                s->V[0x%X] %s= s->V[0x%X];\n"
+                                         "                s->V[0xF] = 0;\n", x,
+                     op == OP_OR ? "|" : op == OP_AND ? "&" : "^", y);
+            break;
+        }
+
+        //VF is written before VX like the interpreter does, so 8FY4 and friends keep their results
+        case OP_ADD_REG:
+            snprintf(line, sizeof(line), "                s->V[0xF] = s->V[0x%X] + s->V[0x%X] > 0xFF;\n"
+                                         "                s->V[0x%X] += s->V[0x%X];\n", x, y, x, y);
+            break;
+        case OP_SUB:
+            snprintf(line, sizeof(line), "                s->V[0xF] = s->V[0x%X] >= s->V[0x%X];\n"
+                                         "                s->V[0x%X] -= s->V[0x%X];\n", x, y, x, y);
+            break;
+        case OP_SUBN:
+            snprintf(line, sizeof(line), "                s->V[0xF] = s->V[0x%X] <= s->V[0x%X];\n"
+                                         "                s->V[0x%X] = s->V[0x%X] - s->V[0x%X];\n", x, y, x, y, x);
+            break;
+        case OP_SHR:
+            snprintf(line, sizeof(line), "                s->V[0xF] = s->V[0x%X] & 1;\n"
+                                         "                s->V[0x%X] >>= 1;\n", x, x);
+            break;
+        case OP_SHL:
+            snprintf(line, sizeof(line), "                s->V[0xF] = s->V[0x%X] >> 7;\n"
+                                         "                s->V[0x%X] <<= 1;\n", x, x);
+            break;
+
+        case OP_LD_I:
+            snprintf(line, sizeof(line), "                s->I = 0x%.3X;\n", nnn);
+            break;
+        case OP_LD_I_LONG:
+            snprintf(line, sizeof(line), "                s->I = 0x%.4X;\n", opcode_at(address + 2));
+            break;
+        case OP_PLANE:
+            snprintf(line, sizeof(line), "                s->plane_mask = %d;\n", x & 3);
+            break;
+        case OP_AUDIO:
+            snprintf(line, sizeof(line), "                for (int i = 0; i < 16; i++)\n"
+                                         "                {\n"
+                                         "                    s->audio_pattern[i] = s->memory[(s->I + i) &\n"
+                                         "                                                    s->memory_mask];\n"
+                                         "                }\n");
+            break;
+        case OP_GET_DELAY:
+            snprintf(line, sizeof(line), "                s->V[0x%X] = s->delay_timer;\n", x);
+            break;
+        case OP_SET_DELAY:
+            snprintf(line, sizeof(line), "                s->delay_timer = s->V[0x%X];\n", x);
+            break;
+        case OP_SET_SOUND:
+            snprintf(line, sizeof(line), "                s->sound_timer = s->V[0x%X];\n", x);
+            break;
+        case OP_ADD_I:
+            snprintf(line, sizeof(line), "                s->V[0xF] = s->I + s->V[0x%X] > 0xFFF;\n"
+                                         "                s->I += s->V[0x%X];\n", x, x);
+            break;
+        case OP_FONT:
+            snprintf(line, sizeof(line), "                s->I = s->V[0x%X] * 5;\n", x);
+            break;
+        case OP_PITCH:
+            snprintf(line, sizeof(line), "                s->audio_pitch = s->V[0x%X];\n", x);
+            break;
+        case OP_LOAD:
+            snprintf(line, sizeof(line), "                for (int i = 0; i <= 0x%X; i++)\n"
+                                         "                {\n"
+                                         "                    s->V[i] = s->memory[(s->I + i) & s->memory_mask];\n"
+                                         "                }\n"
+                                         "                s->I += 0x%X;\n", x, x + 1);
+            break;
+        default:
+            break;
+    }
+    out << line;
+    return false;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 3 || strcmp(argv[1], "-help") == 0)
+    {
+        std::cout << "Usage: ./chip8_aot <path_to_rom> <output.cpp> [-x]\n"
+                  << "-x translates an XO-CHIP ROM, the emulator must also be run with -x\n"
+                  << "Build the output with g++ -O3 -shared -fPIC -I<path to src> and run it with -aot\n";
+        exit(argc < 3 ? 1 : 0);
+    }
+
+    Chip8 chip8;
+    if (argc > 3 && strcmp(argv[3], "-x") == 0)
+    {
+        chip8.set_xo_chip(true);
+    }
+    std::ifstream rom(argv[1], std::ios::binary | std::ios::ate);
+    if (!rom.is_open() || !chip8.load_rom(argv[1]))
+    {
+        std::cerr << "ROM could not be loaded. Possibly invalid path given\n";
+        exit(1);
+    }
+    int rom_size = (int) rom.tellg();
+    memory = chip8.get_memory();
+    xo_chip = chip8.is_xo_chip();
+
+    ControlFlowGraph cfg(memory, 0x200 + rom_size, xo_chip);
+    cfg.build(0x200);
+
+    //blocks start wherever pc can land after a jump, call, return, skip or an interpreted instruction
+    std::set<uint16_t> entries;
+    const std::map<uint16_t, BasicBlock> &blocks = cfg.get_blocks();
+    for (std::map<uint16_t, BasicBlock>::const_iterator it = blocks.begin(); it != blocks.end(); ++it)
+    {
+        entries.insert(it->first);
+        for (int address = it->second.start; address < it->second.end; address += 2)
+        {
+            if (cfg.is_instruction((uint16_t) address) && is_interpreted(decode(opcode_at(address))))
+            {
+                entries.insert((uint16_t) (address + 2));
+            }
+        }
+    }
+
+    std::ostringstream cases;
+    std::vector<uint16_t> starts, ends;
+    for (std::set<uint16_t>::iterator it = entries.begin(); it != entries.end(); ++it)
+    {
+        std::ostringstream body;
+        int address = *it, count = 0;
+        bool ended = false;
+        while (cfg.is_instruction((uint16_t) address) && !is_interpreted(decode(opcode_at(address))))
+        {
+            ended = translate(body, address);
+            address += decode(opcode_at(address)) == OP_LD_I_LONG ? 4 : 2;
+            count++;
+            if (ended)
+            {
+                break;
+            }
+        }
+        if (count == 0)
+        {
+            continue;
+        }
+
+        char line[256];
+        snprintf(line, sizeof(line), "            case 0x%.4X:\n"
+                                     "                if (!enabled[%d] || cycles - done < %d)\n"
+                                     "                {\n"
+                                     "                    return done;\n"
+                                     "                }\n", *it, (int) starts.size(), count);
+        cases << line << body.str();
+        if (!ended)
+        {
+            snprintf(line, sizeof(line), "                s->pc = 0x%.4X;\n", address);
+            cases << line;
+        }
+        snprintf(line, sizeof(line), "                done += %d;\n"
+                                     "                break;\n", count);
+        cases << line;
+        starts.push_back(*it);
+        ends.push_back((uint16_t) address);
+    }
+
+    std::ofstream out(argv[2]);
+    if (!out.is_open())
+    {
+        std::cerr << "Could not write " << argv[2] << std::endl;
+        exit(1);
+    }
+    out << "//\n// Translated from " << argv[1] << " by chip8_aot, do not edit\n//\n\n"
+        << "#include \"aot.h\"\n\n"
+        << "static inline bool is_delay_poll_loop(const Chip8State *s, int target)\n"
+        << "{\n"
+        << "    int read = (s->memory[target] << 8) | s->memory[(target + 1) & s->memory_mask];\n"
+        << "    int skip = (s->memory[(target + 2) & s->memory_mask] << 8) |\n"
+        << "               s->memory[(target + 3) & s->memory_mask];\n"
+        << "    return (read & 0xF0FF) == 0xF007 && ((skip & 0xF000) == 0x3000 || (skip & 0xF000) == 0x4000) &&\n"
+        << "           (skip & 0x0F00) == (read & 0x0F00);\n"
+        << "}\n\n";
+    if (xo_chip)
+    {
+        out << "static inline uint16_t skip_from(const Chip8State *s, uint16_t next)\n"
+            << "{\n"
+            << "    return next + (s->memory[next] == 0xF0 && s->memory[(uint16_t) (next + 1)] == 0x00 ? 4 : 2);\n"
+            << "}\n\n";
+    }
+    out << "static int run(Chip8State *s, int cycles, const uint8_t *enabled)\n"
+        << "{\n"
+        << "    int done = 0;\n"
+        << "    while (s->idle_state == IDLE_NONE)\n"
+        << "    {\n"
+        << "        switch (s->pc)\n"
+        << "        {\n"
+        << cases.str()
+        << "            default:\n"
+        << "                return done;\n"
+        << "        }\n"
+        << "    }\n"
+        << "    return done;\n"
+        << "}\n\n";
+
+    out << "static const uint16_t block_start[] = {";
+    for (size_t i = 0; i < starts.size(); i++)
+    {
+        out << (i % 8 == 0 ? "\n        " : " ") << starts[i] << ",";
+    }
+    out << "\n};\n\nstatic const uint16_t block_end[] = {";
+    for (size_t i = 0; i < ends.size(); i++)
+    {
+        out << (i % 8 == 0 ? "\n        " : " ") << ends[i] << ",";
+    }
+    out << "\n};\n\n"
+        << "extern \"C\" const AotProgram chip8_aot_program = {sizeof(Chip8State), "
+        << aot_rom_hash(memory + 0x200, rom_size) << "u, " << rom_size << ", " << (xo_chip ? "true" : "false") << ", "
+        << starts.size() << ", block_start, block_end, run};\n";
+
+    std::cout << starts.size() << " blocks translated" << std::endl;
+    return 0;
+}
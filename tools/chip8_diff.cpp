@@ -0,0 +1,481 @@
+//
+// Runs programs on the interpreter and on a translating engine side by side with the same input, compares the whole
+// machine every few instructions and on a mismatch bisects to the first instruction whose result differs
+//
+
+#include <dirent.h>
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <thread>
+#include <vector>
+#include "../src/aot.h"
+#include "../src/chip8.h"
+#include "../src/jit.h"
+#include "../src/opcodes.h"
+
+static const int CYCLES_PER_FRAME = 200;
+static const int FUZZ_LENGTH = 256; //instructions in a random program
+
+struct Options
+{
+    int frames = 600;
+    int every = 50; //instructions between compares
+    const AotProgram *aot = nullptr; //second engine when set, the JIT otherwise
+};
+
+struct Session
+{
+    std::string name;
+    std::unique_ptr<Chip8State> start; //machine right after loading
+};
+
+//the same input as the golden tests, each key in turn is held for 10 frames with 10 frames of nothing in between
+static void press_keys(Chip8 &chip8, int frame)
+{
+    for (int key = 0; key < 16; key++)
+    {
+        chip8.set_keypad_value(key, frame % 20 < 10 && frame / 20 % 16 == key);
+    }
+}
+
+//both engines stepped together in chunks of at most Options::every instructions, frame by frame
+class Lockstep
+{
+private:
+    const Options &options;
+    int frame, done; //instructions run so far in this frame
+
+public:
+    Chip8 reference, engine;
+    long long executed;
+
+    Lockstep(const Options &options, const Session &session) : options(options), frame(0), done(0), executed(0)
+    {
+        for (Chip8 *chip8 : {&reference, &engine})
+        {
+            chip8->set_state(*session.start);
+            press_keys(*chip8, 0);
+        }
+        if (options.aot != nullptr)
+        {
+            engine.set_aot_program(options.aot);
+        }
+        else
+        {
+            engine.set_jit(true);
+        }
+    }
+
+    //both halt on the first invalid opcode, which random programs can run into
+    bool finished()
+    {
+        return frame == options.frames || reference.get_idle_state() == IDLE_FAULT;
+    }
+
+    int get_frame()
+    {
+        return frame;
+    }
+
+    //runs up to limit instructions on both, never past the end of the frame, returns false if they disagree on
+    //how many they ran
+    bool step(int limit)
+    {
+        int count = std::min(limit, CYCLES_PER_FRAME - done);
+        int ran = reference.run_cycles(count, false);
+        bool same = engine.run_cycles(count, false) == ran;
+        executed += ran;
+        done += ran;
+        if (ran < count || done == CYCLES_PER_FRAME)
+        {
+            //idle for the rest of the frame, or out of instructions for it
+            frame++;
+            done = 0;
+            for (Chip8 *chip8 : {&reference, &engine})
+            {
+                chip8->update_timers();
+                press_keys(*chip8, frame);
+            }
+        }
+        return same;
+    }
+};
+
+//cheap check done every few instructions, diff_states says what differs
+static bool same_state(const Chip8State &a, const Chip8State &b)
+{
+    return memcmp(a.V, b.V, sizeof(a.V)) == 0 && a.I == b.I && a.pc == b.pc && a.sp == b.sp &&
+           memcmp(a.stack, b.stack, sizeof(a.stack)) == 0 && a.delay_timer == b.delay_timer &&
+           a.sound_timer == b.sound_timer && memcmp(a.memory, b.memory, sizeof(a.memory)) == 0 &&
+           memcmp(a.display, b.display, sizeof(a.display)) == 0 && a.plane_mask == b.plane_mask &&
+           a.hires == b.hires && memcmp(a.audio_pattern, b.audio_pattern, sizeof(a.audio_pattern)) == 0 &&
+           a.audio_pitch == b.audio_pitch && a.draw_flag == b.draw_flag && a.idle_state == b.idle_state &&
+           a.fault.code == b.fault.code && a.fault.pc == b.fault.pc && a.cycle_count == b.cycle_count;
+}
+
+static void diff_bytes(std::ostream &out, const char *name, const uint8_t *a, const uint8_t *b, int size)
+{
+    int shown = 0;
+    for (int i = 0; i < size && shown < 8; i++)
+    {
+        if (a[i] != b[i])
+        {
+            char line[64];
+            snprintf(line, sizeof(line), "  %s[%.4X] %.2X %.2X\n", name, i, a[i], b[i]);
+            out << line;
+            shown++;
+        }
+    }
+}
+
+//every part of the machine that differs, reference value first
+static std::string diff_states(const Chip8State &a, const Chip8State &b)
+{
+    std::ostringstream out;
+    char line[64];
+    for (int i = 0; i < 16; i++)
+    {
+        if (a.V[i] != b.V[i])
+        {
+            snprintf(line, sizeof(line), "  V%X %.2X %.2X\n", i, a.V[i], b.V[i]);
+            out << line;
+        }
+    }
+    const char *names[] = {"I", "pc", "sp", "delay", "sound"};
+    int values[][2] = {{a.I, b.I}, {a.pc, b.pc}, {a.sp, b.sp}, {a.delay_timer, b.delay_timer},
+                       {a.sound_timer, b.sound_timer}};
+    for (int i = 0; i < 5; i++)
+    {
+        if (values[i][0] != values[i][1])
+        {
+            snprintf(line, sizeof(line), "  %s %.4X %.4X\n", names[i], values[i][0], values[i][1]);
+            out << line;
+        }
+    }
+    diff_bytes(out, "stack", (const uint8_t *) a.stack, (const uint8_t *) b.stack, sizeof(a.stack));
+    diff_bytes(out, "memory", a.memory, b.memory, sizeof(a.memory));
+    for (int p = 0; p < 2; p++)
+    {
+        for (int row = 0; row < 64; row++)
+        {
+            if (memcmp(a.display[p][row], b.display[p][row], sizeof(a.display[p][row])) != 0)
+            {
+                snprintf(line, sizeof(line), "  plane %d row %d\n", p, row);
+                out << line;
+            }
+        }
+    }
+    if (a.plane_mask != b.plane_mask || a.hires != b.hires)
+    {
+        out << "  display mode\n";
+    }
+    diff_bytes(out, "audio", a.audio_pattern, b.audio_pattern, sizeof(a.audio_pattern));
+    if (a.audio_pitch != b.audio_pitch)
+    {
+        out << "  pitch\n";
+    }
+    if (a.draw_flag != b.draw_flag)
+    {
+        out << "  draw flag\n";
+    }
+    if (a.idle_state != b.idle_state)
+    {
+        out << "  idle state " << a.idle_state << " " << b.idle_state << "\n";
+    }
+    if (a.fault.code != b.fault.code || a.fault.pc != b.fault.pc)
+    {
+        snprintf(line, sizeof(line), "  fault %d at %.4X, %d at %.4X\n", a.fault.code, a.fault.pc, b.fault.code,
+                 b.fault.pc);
+        out << line;
+    }
+    if (a.cycle_count != b.cycle_count)
+    {
+        out << "  cycle count " << a.cycle_count << " " << b.cycle_count << "\n";
+    }
+    return out.str();
+}
+
+//replays the session up to the last chunk that matched, then bisects the next one down to a single instruction
+static std::string bisect(const Options &options, const Session &session, int good_chunks, int chunk_length)
+{
+    int low = 0, high = chunk_length; //low instructions past the good chunks still match, high do not
+    while (high - low > 1)
+    {
+        int middle = (low + high) / 2;
+        Lockstep run(options, session);
+        for (int i = 0; i < good_chunks; i++)
+        {
+            run.step(options.every);
+        }
+        if (run.step(middle) && same_state(run.reference.get_state(), run.engine.get_state()))
+        {
+            low = middle;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+
+    //the instruction run from the last matching state. Translated blocks only write back when they exit, so the
+    //bug can be in an earlier instruction of the block that ends here
+    Lockstep before_run(options, session), after_run(options, session);
+    for (int i = 0; i < good_chunks; i++)
+    {
+        before_run.step(options.every);
+        after_run.step(options.every);
+    }
+    if (low > 0)
+    {
+        before_run.step(low);
+    }
+    after_run.step(high);
+    const Chip8State &before = before_run.reference.get_state();
+    int opcode = (before.memory[before.pc] << 8) | before.memory[(uint16_t) (before.pc + 1)];
+    int next = (before.memory[(uint16_t) (before.pc + 2)] << 8) | before.memory[(uint16_t) (before.pc + 3)];
+    char line[128];
+    snprintf(line, sizeof(line), "first differs after instruction %lld, frame %d: %.4X %.4X %s\n",
+             after_run.executed, before_run.get_frame(), before.pc, opcode, format_instruction(opcode, next).c_str());
+    return line + diff_states(after_run.reference.get_state(), after_run.engine.get_state());
+}
+
+//one line if both engines agree, the bisected difference otherwise
+static std::string check_session(const Options &options, const Session &session, bool &same)
+{
+    Lockstep run(options, session);
+    int chunks = 0;
+    while (!run.finished())
+    {
+        long long executed = run.executed;
+        bool counts_match = run.step(options.every);
+        if (!counts_match || !same_state(run.reference.get_state(), run.engine.get_state()))
+        {
+            same = false;
+            return session.name + " " + bisect(options, session, chunks, (int) (run.executed - executed));
+        }
+        chunks++;
+    }
+    same = true;
+    return session.name + " ok, " + std::to_string(run.executed) + " instructions\n";
+}
+
+//random instructions the translators handle, jumps and calls stay inside the program so it runs to the end of
+//the session
+static void fuzz_program(uint8_t *program, std::mt19937 &random)
+{
+    for (int i = 0; i < FUZZ_LENGTH * 2; i += 2)
+    {
+        int x = (int) (random() & 0xF), y = (int) (random() & 0xF), nn = (int) (random() & 0xFF), op;
+        switch (random() % 19)
+        {
+            case 0: op = 0x6000 | x << 8 | nn; break;
+            case 1: op = 0x7000 | x << 8 | nn; break;
+            case 2: op = 0x8000 | x << 8 | y << 4 | (int) (random() % 8); break;
+            case 3: op = 0x800E | x << 8 | y << 4; break;
+            case 4: op = (random() & 1 ? 0x3000 : 0x4000) | x << 8 | (nn & 3); break;
+            case 5: op = (random() & 1 ? 0x5000 : 0x9000) | x << 8 | y << 4; break;
+            case 6: op = 0x1200 | (int) (random() % FUZZ_LENGTH) * 2; break;
+            case 7: op = 0xA000 | (int) (0x600 + random() % 0x800); break; //data lives above the program
+            case 8: op = 0xF01E | x << 8; break;
+            case 9: op = (random() & 1 ? 0xF065 : 0xF055) | x << 8; break;
+            case 10: op = 0xF033 | x << 8; break;
+            case 11: op = (random() & 1 ? 0xF007 : 0xF015) | x << 8; break;
+            case 12: op = 0x5002 | (int) (random() & 1) | x << 8 | y << 4; break;
+            case 13: op = 0xD000 | x << 8 | y << 4 | (nn & 0xF); break;
+            case 14: op = 0xC000 | x << 8 | nn; break;
+            case 15: op = 0x2200 | (int) (random() % FUZZ_LENGTH) * 2; break;
+            case 16: op = 0x00EE; break;
+            case 17: op = (random() & 1 ? 0xE09E : 0xE0A1) | x << 8; break;
+            default: op = 0x6000 | x << 8 | (nn & 0xF); break;
+        }
+        program[i] = (uint8_t) (op >> 8);
+        program[i + 1] = (uint8_t) op;
+    }
+    //a skip at the end still lands on a jump back to the start
+    for (int i = FUZZ_LENGTH * 2; i < FUZZ_LENGTH * 2 + 4; i += 2)
+    {
+        program[i] = 0x12;
+        program[i + 1] = 0x00;
+    }
+}
+
+//CMake points this at the repository's roms, so the default run doesn't depend on the working directory
+#ifndef CHIP8_ROM_DIR
+#define CHIP8_ROM_DIR "../roms"
+#endif
+
+static std::vector<std::string> list_roms(const std::string &path)
+{
+    std::vector<std::string> roms;
+    DIR *dir = opendir(path.c_str());
+    for (dirent *entry = dir != nullptr ? readdir(dir) : nullptr; entry != nullptr; entry = readdir(dir))
+    {
+        if (entry->d_name[0] != '.')
+        {
+            roms.push_back(path + "/" + entry->d_name);
+        }
+    }
+    if (dir != nullptr)
+    {
+        closedir(dir);
+    }
+    std::sort(roms.begin(), roms.end());
+    return roms;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc > 1 && strcmp(argv[1], "-help") == 0)
+    {
+        std::cout << "Usage: ./chip8_diff [path_to_rom ...] [-roms <dir>] [-x] [-aot <library>] [-fuzz <count>]"
+                  << " [-frames <count>] [-every <count>]\n"
+                  << "Runs each ROM on the interpreter and the JIT and reports the first instruction where they"
+                  << " differ. Without ROMs every ROM in the roms directory and 200 random programs are run\n"
+                  << "-roms runs every ROM in a directory, " << CHIP8_ROM_DIR << " by default\n"
+                  << "-x runs the ROMs in XO-CHIP mode\n"
+                  << "-aot compares against a ROM translated by chip8_aot instead of the JIT\n"
+                  << "-fuzz sets the number of random programs\n"
+                  << "-frames sets how long each program runs, 600 frames of 200 instructions by default\n"
+                  << "-every sets the number of instructions between compares, 50 by default\n";
+        exit(0);
+    }
+
+    Options options;
+    std::vector<std::string> roms;
+    int fuzz_count = -1;
+    bool xo_chip = false;
+    const char *rom_dir = nullptr;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-x") == 0)
+        {
+            xo_chip = true;
+        }
+        else if (strcmp(argv[i], "-roms") == 0 && i + 1 < argc)
+        {
+            rom_dir = argv[++i];
+        }
+        else if (strcmp(argv[i], "-aot") == 0 && i + 1 < argc)
+        {
+            options.aot = load_aot_program(argv[++i]);
+            if (options.aot == nullptr)
+            {
+                exit(1);
+            }
+        }
+        else if (strcmp(argv[i], "-fuzz") == 0 && i + 1 < argc)
+        {
+            fuzz_count = std::max(0, atoi(argv[++i]));
+        }
+        else if (strcmp(argv[i], "-frames") == 0 && i + 1 < argc)
+        {
+            options.frames = std::max(1, atoi(argv[++i]));
+        }
+        else if (strcmp(argv[i], "-every") == 0 && i + 1 < argc)
+        {
+            options.every = std::max(1, atoi(argv[++i]));
+        }
+        else if (argv[i][0] != '-')
+        {
+            roms.push_back(argv[i]);
+        }
+        else
+        {
+            std::cerr << "Invalid flags given. Type -help to check usage\n";
+            exit(1);
+        }
+    }
+    if (options.aot == nullptr && !Jit::is_supported())
+    {
+        std::cerr << "The JIT is not supported on this platform, give a translated ROM with -aot\n";
+        exit(1);
+    }
+    if (roms.empty() && fuzz_count < 0 && rom_dir == nullptr)
+    {
+        rom_dir = CHIP8_ROM_DIR;
+        fuzz_count = 200;
+    }
+    if (rom_dir != nullptr)
+    {
+        //an empty list would otherwise pass having compared nothing but random programs
+        std::vector<std::string> listed = list_roms(rom_dir);
+        if (listed.empty())
+        {
+            std::cerr << "No ROMs found in " << rom_dir << ", give a directory with -roms\n";
+            exit(1);
+        }
+        roms.insert(roms.end(), listed.begin(), listed.end());
+    }
+    if (options.aot != nullptr)
+    {
+        fuzz_count = 0; //a translation only fits the ROM it was made from
+    }
+
+    std::vector<Session> sessions;
+    for (size_t i = 0; i < roms.size(); i++)
+    {
+        Chip8 chip8;
+        chip8.set_xo_chip(xo_chip);
+        if (!chip8.load_rom(roms[i]))
+        {
+            std::cerr << roms[i] << " could not be loaded\n";
+            exit(1);
+        }
+        if (options.aot != nullptr && !chip8.set_aot_program(options.aot))
+        {
+            std::cerr << roms[i] << " is not the ROM the translation was made from\n";
+            exit(1);
+        }
+        sessions.push_back(Session{roms[i], std::unique_ptr<Chip8State>(new Chip8State(chip8.get_state()))});
+    }
+    for (int i = 0; i < std::max(fuzz_count, 0); i++)
+    {
+        std::mt19937 random((unsigned) i);
+        Chip8 chip8;
+        std::unique_ptr<Chip8State> start(new Chip8State(chip8.get_state()));
+        fuzz_program(start->memory + 0x200, random);
+        sessions.push_back(Session{"fuzz " + std::to_string(i), std::move(start)});
+    }
+
+    //sessions are independent, each worker takes the next one until they run out
+    std::vector<std::string> results(sessions.size());
+    std::vector<char> same(sessions.size());
+    std::atomic<size_t> next(0);
+    std::vector<std::thread> workers;
+    int thread_count = std::max(1, (int) std::thread::hardware_concurrency());
+    for (int t = 0; t < thread_count; t++)
+    {
+        workers.push_back(std::thread([&]()
+                                      {
+                                          for (size_t s = next++; s < sessions.size(); s = next++)
+                                          {
+                                              bool session_same;
+                                              results[s] = check_session(options, sessions[s], session_same);
+                                              same[s] = session_same;
+                                          }
+                                      }));
+    }
+    for (size_t t = 0; t < workers.size(); t++)
+    {
+        workers[t].join();
+    }
+
+    int differ = 0;
+    for (size_t s = 0; s < sessions.size(); s++)
+    {
+        differ += same[s] ? 0 : 1;
+        if (!same[s] || s < roms.size())
+        {
+            std::cout << results[s];
+        }
+    }
+    std::cout << differ << " of " << sessions.size() << " programs differ\n";
+    return differ == 0 ? 0 : 1;
+}
@@ -0,0 +1,62 @@
+//
+// Prints an annotated listing of the code reachable from 0x200 in a ROM, and optionally its control flow graph
+//
+
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include "../src/chip8.h"
+#include "../src/disasm.h"
+
+int main(int argc, char *argv[])
+{
+    if (argc <= 1 || strcmp(argv[1], "-help") == 0)
+    {
+        std::cout << "Usage: ./chip8_disasm <path_to_rom> [-x] [-dot <file>]\n"
+                  << "-x decodes F000 NNNN as a 4 byte XO-CHIP instruction and allows ROMs bigger than 4k\n"
+                  << "-dot writes the control flow graph in graphviz format to the file\n";
+        exit(argc <= 1 ? 1 : 0);
+    }
+
+    Chip8 chip8;
+    const char *dot_path = nullptr;
+    for (int i = 2; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-x") == 0)
+        {
+            chip8.set_xo_chip(true);
+        }
+        else if (strcmp(argv[i], "-dot") == 0 && i + 1 < argc)
+        {
+            dot_path = argv[++i];
+        }
+        else
+        {
+            std::cerr << "Invalid flags given. Type -help to check usage\n";
+            exit(1);
+        }
+    }
+
+    std::ifstream rom(argv[1], std::ios::binary | std::ios::ate);
+    if (!rom.is_open() || !chip8.load_rom(argv[1]))
+    {
+        std::cerr << "ROM could not be loaded. Possibly invalid path given\n";
+        exit(1);
+    }
+
+    ControlFlowGraph cfg(chip8.get_memory(), 0x200 + (int) rom.tellg(), chip8.is_xo_chip());
+    cfg.build(0x200);
+    cfg.print_listing(std::cout);
+
+    if (dot_path != nullptr)
+    {
+        std::ofstream dot(dot_path);
+        if (!dot.is_open())
+        {
+            std::cerr << "Could not write " << dot_path << std::endl;
+            exit(1);
+        }
+        cfg.print_dot(dot);
+    }
+    return 0;
+}
@@ -0,0 +1,389 @@
+//
+// Feeds mutated programs to the core to find crashes, out of bounds accesses and broken invariants. Built normally
+// it runs its own coverage guided loop on every core, using the (pc, instruction) pairs each program reaches as
+// feedback. Built with CHIP8_LIBFUZZER defined and clang's -fsanitize=fuzzer, libFuzzer drives
+// LLVMFuzzerTestOneInput instead
+//
+
+#include <dirent.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+#include "../src/chip8.h"
+#include "../src/opcodes.h"
+
+static const int FRAMES = 8; //each input runs for this many frames
+static const int CYCLES_PER_FRAME = 128;
+static const int MAX_PROGRAM = 4096 - 0x200;
+static const int COVERAGE_SIZE = 65536 * 64; //one entry per address and Op
+
+//runs one program from power on and reports every (pc, instruction) pair it reaches. Memory, the stack and the
+//timers are reset by restoring a snapshot, so a run costs one copy of the machine rather than a new Chip8
+class Runner
+{
+private:
+    Chip8 chip8;
+    std::unique_ptr<Chip8State> power_on;
+
+public:
+    explicit Runner(bool xo_chip)
+    {
+        chip8.set_xo_chip(xo_chip);
+        power_on.reset(new Chip8State(chip8.get_state()));
+    }
+
+    //calls visit(feature) before every instruction, returns false if the run left the machine in a broken state
+    template<typename Visit>
+    bool run(const uint8_t *program, size_t size, Visit visit)
+    {
+        size = std::min(size, (size_t) MAX_PROGRAM);
+        memcpy(power_on->memory + 0x200, program, size);
+        chip8.set_state(*power_on);
+        memset(power_on->memory + 0x200, 0, size);
+
+        for (int frame = 0; frame < FRAMES; frame++)
+        {
+            for (int key = 0; key < 16; key++)
+            {
+                chip8.set_keypad_value(key, key == frame * 5 % 16); //lets FX0A move on
+            }
+            for (int i = 0; i < CYCLES_PER_FRAME; i++)
+            {
+                const Chip8State &state = chip8.get_state();
+                Op op = decode((state.memory[state.pc] << 8) | state.memory[(uint16_t) (state.pc + 1)]);
+                visit(state.pc * 64 + op);
+                chip8.single_cycle(false);
+                if (chip8.get_idle_state() == IDLE_FAULT)
+                {
+                    return is_sane(); //halted for good on an invalid opcode
+                }
+                if (chip8.get_idle_state() != IDLE_NONE)
+                {
+                    break;
+                }
+            }
+            chip8.update_timers();
+        }
+        return is_sane();
+    }
+
+    //what must hold whatever the program did
+    bool is_sane()
+    {
+        const Chip8State &state = chip8.get_state();
+        return state.sp < 16 && state.plane_mask < 4 && state.idle_state <= IDLE_FAULT;
+    }
+};
+
+#ifdef CHIP8_LIBFUZZER
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    static Runner runner(false);
+    if (!runner.run(data, size, [](int) {}))
+    {
+        abort();
+    }
+    return 0;
+}
+
+#else
+
+//the input a worker is running, written out by the signal handler if the core crashes on it
+static thread_local const std::vector<uint8_t> *current_input = nullptr;
+
+static void save_input(const char *path, const std::vector<uint8_t> &input)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd >= 0)
+    {
+        ssize_t written = write(fd, input.data(), input.size());
+        (void) written;
+        close(fd);
+    }
+}
+
+static void crash_handler(int sig)
+{
+    if (current_input != nullptr)
+    {
+        save_input("crash.ch8", *current_input);
+        const char message[] = "\nCrashed, the program is in crash.ch8\n";
+        ssize_t written = write(STDERR_FILENO, message, sizeof(message) - 1);
+        (void) written;
+    }
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+//shared by all workers. The coverage map is only ever set, the corpus only grows
+struct Shared
+{
+    std::vector<std::atomic<uint8_t>> coverage;
+    std::atomic<int> features;
+    std::mutex corpus_mutex;
+    std::vector<std::vector<uint8_t>> corpus;
+    std::atomic<int> corpus_size;
+    std::atomic<long long> execs;
+    std::atomic<bool> stop;
+    bool xo_chip;
+
+    Shared() : coverage(COVERAGE_SIZE), features(0), corpus_size(0), execs(0), stop(false), xo_chip(false)
+    {}
+
+    void add(const std::vector<uint8_t> &input)
+    {
+        std::lock_guard<std::mutex> lock(corpus_mutex);
+        corpus.push_back(input);
+        corpus_size = (int) corpus.size();
+    }
+};
+
+//a random instruction the decoder knows, so mutations reach past the first invalid opcode more often
+static int random_instruction(std::mt19937 &random)
+{
+    for (;;)
+    {
+        int opcode = (int) (random() & 0xFFFF);
+        if (decode(opcode) != OP_INVALID)
+        {
+            return opcode;
+        }
+    }
+}
+
+static void mutate(std::vector<uint8_t> &input, const std::vector<std::vector<uint8_t>> &corpus,
+                   std::mt19937 &random)
+{
+    int count = 1 + (int) (random() % 4);
+    for (int m = 0; m < count; m++)
+    {
+        if (input.size() < 2)
+        {
+            input.resize(2);
+        }
+        size_t at = random() % (input.size() / 2) * 2; //instructions are word aligned
+        switch (random() % 6)
+        {
+            case 0:
+                input[at + random() % 2] ^= (uint8_t) (1 << random() % 8);
+                break;
+            case 1:
+                input[at + random() % 2] = (uint8_t) random();
+                break;
+            case 2:
+            {
+                int opcode = random_instruction(random);
+                input[at] = (uint8_t) (opcode >> 8);
+                input[at + 1] = (uint8_t) opcode;
+                break;
+            }
+            case 3:
+                //insert an instruction, moving the rest of the program up
+                if (input.size() + 2 <= MAX_PROGRAM)
+                {
+                    int opcode = random_instruction(random);
+                    input.insert(input.begin() + at, {(uint8_t) (opcode >> 8), (uint8_t) opcode});
+                }
+                break;
+            case 4:
+                //delete an instruction
+                if (input.size() > 2)
+                {
+                    input.erase(input.begin() + at, input.begin() + at + 2);
+                }
+                break;
+            default:
+            {
+                //splice in a run of words from another program
+                const std::vector<uint8_t> &other = corpus[random() % corpus.size()];
+                size_t from = random() % (other.size() / 2) * 2;
+                size_t length = std::min(other.size() - from, (size_t) (2 + random() % 64 * 2));
+                if (at + length > input.size())
+                {
+                    input.resize(std::min(at + length, (size_t) MAX_PROGRAM));
+                }
+                std::copy(other.begin() + from, other.begin() + from + std::min(length, input.size() - at),
+                          input.begin() + at);
+                break;
+            }
+        }
+    }
+}
+
+static void fuzz_worker(Shared &shared, unsigned seed)
+{
+    std::mt19937 random(seed);
+    Runner runner(shared.xo_chip);
+    std::vector<std::vector<uint8_t>> corpus; //local copy, refreshed when another worker adds to it
+    std::vector<uint8_t> input;
+    current_input = &input;
+    long long execs = 0;
+
+    while (!shared.stop)
+    {
+        if ((int) corpus.size() != shared.corpus_size)
+        {
+            std::lock_guard<std::mutex> lock(shared.corpus_mutex);
+            corpus.insert(corpus.end(), shared.corpus.begin() + corpus.size(), shared.corpus.end());
+        }
+        input = corpus[random() % corpus.size()];
+        mutate(input, corpus, random);
+
+        bool found = false;
+        bool sane = runner.run(input.data(), input.size(), [&](int feature)
+        {
+            if (shared.coverage[feature].load(std::memory_order_relaxed) == 0 &&
+                shared.coverage[feature].exchange(1) == 0)
+            {
+                shared.features++;
+                found = true;
+            }
+        });
+        if (!sane)
+        {
+            save_input("crash.ch8", input);
+            std::cerr << "\nThe machine was left in a broken state, the program is in crash.ch8\n";
+            abort();
+        }
+        if (found)
+        {
+            shared.add(input);
+        }
+        if (++execs % 1024 == 0)
+        {
+            shared.execs += 1024;
+        }
+    }
+}
+
+static std::vector<std::string> list_roms()
+{
+    std::vector<std::string> roms;
+    DIR *dir = opendir("../roms");
+    for (dirent *entry = dir != nullptr ? readdir(dir) : nullptr; entry != nullptr; entry = readdir(dir))
+    {
+        if (entry->d_name[0] != '.')
+        {
+            roms.push_back(std::string("../roms/") + entry->d_name);
+        }
+    }
+    if (dir != nullptr)
+    {
+        closedir(dir);
+    }
+    std::sort(roms.begin(), roms.end());
+    return roms;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc > 1 && strcmp(argv[1], "-help") == 0)
+    {
+        std::cout << "Usage: ./chip8_fuzz [seed_rom ...] [-x] [-time <seconds>] [-run <file>]\n"
+                  << "Mutates the seed ROMs, or every ROM in ../roms, on all cores and keeps the programs that reach"
+                  << " new code. A program that crashes the core or breaks an invariant is written to crash.ch8\n"
+                  << "-x runs in XO-CHIP mode\n"
+                  << "-time stops after the given number of seconds, 60 by default\n"
+                  << "-run runs a single program once, to reproduce a crash\n";
+        exit(0);
+    }
+
+    Shared shared;
+    std::vector<std::string> seeds;
+    const char *run_path = nullptr;
+    int seconds = 60;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-x") == 0)
+        {
+            shared.xo_chip = true;
+        }
+        else if (strcmp(argv[i], "-time") == 0 && i + 1 < argc)
+        {
+            seconds = std::max(1, atoi(argv[++i]));
+        }
+        else if (strcmp(argv[i], "-run") == 0 && i + 1 < argc)
+        {
+            run_path = argv[++i];
+        }
+        else if (argv[i][0] != '-')
+        {
+            seeds.push_back(argv[i]);
+        }
+        else
+        {
+            std::cerr << "Invalid flags given. Type -help to check usage\n";
+            exit(1);
+        }
+    }
+
+    if (run_path != nullptr)
+    {
+        std::ifstream file(run_path, std::ios::binary);
+        std::vector<uint8_t> input((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        Runner runner(shared.xo_chip);
+        bool sane = runner.run(input.data(), input.size(), [](int) {});
+        std::cout << run_path << (sane ? " ran without problems\n" : " left the machine in a broken state\n");
+        return sane ? 0 : 1;
+    }
+
+    if (seeds.empty())
+    {
+        seeds = list_roms();
+    }
+    for (size_t i = 0; i < seeds.size(); i++)
+    {
+        std::ifstream file(seeds[i], std::ios::binary);
+        std::vector<uint8_t> input((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        if (input.size() >= 2 && input.size() <= MAX_PROGRAM)
+        {
+            shared.add(input);
+        }
+    }
+    if (shared.corpus.empty())
+    {
+        shared.add(std::vector<uint8_t>{0x12, 0x00}); //nothing to start from, a jump to itself
+    }
+
+    signal(SIGSEGV, crash_handler);
+    signal(SIGBUS, crash_handler);
+    signal(SIGFPE, crash_handler);
+    signal(SIGABRT, crash_handler);
+
+    std::vector<std::thread> workers;
+    int thread_count = std::max(1, (int) std::thread::hardware_concurrency());
+    for (int t = 0; t < thread_count; t++)
+    {
+        workers.push_back(std::thread(fuzz_worker, std::ref(shared), (unsigned) t));
+    }
+
+    for (int second = 1; second <= seconds; second++)
+    {
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+        printf("%ds: %lld execs/s, %d features, %d programs in the corpus\n", second,
+               shared.execs.load() / second, shared.features.load(), shared.corpus_size.load());
+        fflush(stdout);
+    }
+    shared.stop = true;
+    for (size_t t = 0; t < workers.size(); t++)
+    {
+        workers[t].join();
+    }
+    return 0;
+}
+
+#endif //CHIP8_LIBFUZZER